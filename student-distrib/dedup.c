@@ -0,0 +1,262 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "dedup.h"
+#include "lib.h"
+#include "paging.h"
+#include "frame.h"
+#include "task.h"
+
+/**
+ * @file dedup.c
+ *
+ * @brief merging identical user pages of idle processes
+ *
+ * When nothing else can run, dedup_idle moves a hand over the user pages of
+ * idle processes (the same ones swap.c considers), a batch at a time, and
+ * hashes each private page it passes. A page whose contents match a page
+ * that is already shared is mapped to that page's frame copy-on-write and
+ * its own frame is freed. Otherwise it is remembered as a candidate for the
+ * rest of the sweep; when a second page with the same contents comes along,
+ * the candidate's frame becomes a shared page and the second page is merged
+ * into it. Writing to a merged page un-merges it through the usual
+ * copy-on-write fault (copy_on_write).
+ *
+ * The table of shared pages holds a reference to each frame, and lets go of
+ * the ones nothing else maps any more at the end of every sweep.
+ */
+
+// entries in a page table
+#define PAGES_PER_TABLE 1024
+// page table entries looked at by each dedup_idle call, at most
+#define DEDUP_MAX_STEPS 4096
+// FNV-1a parameters
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/**
+ * a frame that merged pages share
+ */
+typedef struct stable_page {
+    uint32_t hash;
+    // 0 if the entry is free
+    uint32_t frame;
+} stable_page_t;
+
+/**
+ * a page seen earlier in the sweep, which a page with the same contents
+ * would be merged with
+ */
+typedef struct candidate {
+    uint32_t hash;
+    uint32_t pid;
+    uint32_t page;
+    uint32_t frame;
+    // the sweep it was seen in; ones from earlier sweeps are stale
+    uint32_t sweep;
+} candidate_t;
+
+dedup_stats_t dedup_stats;
+
+static stable_page_t stable[DEDUP_MAX_STABLE];
+static candidate_t candidates[DEDUP_MAX_CANDIDATES];
+static uint32_t sweep = 1;
+
+// the hand: a process and a page of its user address space
+static uint32_t hand_pid = 1;
+static uint32_t hand_page = 0;
+
+// Forward declarations
+static void merge_page(uint32_t pid, uint32_t page, uint32_t frame);
+static int32_t mergeable(uint32_t pid, uint32_t page, uint32_t frame);
+static int32_t private_page(page_table_entry_t *pte);
+static uint32_t hash_page(const uint32_t *data);
+static int32_t same_page(uint32_t frame1, uint32_t frame2);
+static void next_sweep(void);
+
+/**
+ * merge a batch of pages of idle processes; called when nothing else can run
+ * (interrupts are off)
+ */
+void dedup_idle(void) {
+    process_t *process = get_process(hand_pid);
+    page_table_entry_t *pte;
+    uint32_t page;
+    uint32_t hashed = 0;
+    uint32_t steps;
+
+    for (steps = 0; steps < DEDUP_MAX_STEPS && hashed < DEDUP_BATCH;
+            steps++) {
+        if (hand_page == PAGES_PER_TABLE || process == NULL ||
+                !process_idle(process)) {
+            hand_page = 0;
+            if (++hand_pid == MAX_PROCESSES) {
+                hand_pid = 1;
+                next_sweep();
+            }
+            process = get_process(hand_pid);
+            continue;
+        }
+        page = USER_BASE + hand_page * KB(4);
+        pte = get_user_pte(hand_pid, page);
+        if (pte != NULL && private_page(pte)) {
+            merge_page(hand_pid, page, pte->addr_shifted << 12);
+            hashed++;
+        }
+        hand_page++;
+    }
+}
+
+/**
+ * @return the number of frames that merged pages share
+ */
+uint32_t dedup_shared_frames(void) {
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < DEDUP_MAX_STABLE; i++) {
+        if (stable[i].frame != 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @return the number of frames merging saves right now: every mapping of a
+ * shared frame but one
+ */
+uint32_t dedup_pages_saved(void) {
+    uint32_t saved = 0;
+    uint32_t refs;
+    uint32_t i;
+
+    for (i = 0; i < DEDUP_MAX_STABLE; i++) {
+        if (stable[i].frame != 0) {
+            // one of the references is the table's own
+            refs = frame_refs(stable[i].frame);
+            if (refs > 2) {
+                saved += refs - 2;
+            }
+        }
+    }
+    return saved;
+}
+
+/**
+ * merge a page with a shared page with the same contents, or with a
+ * candidate, or else make it a candidate
+ *
+ * @param frame the page's frame, private to it
+ */
+static void merge_page(uint32_t pid, uint32_t page, uint32_t frame) {
+    uint32_t hash = hash_page(phys_to_virt(frame));
+    candidate_t *candidate = &candidates[hash % DEDUP_MAX_CANDIDATES];
+    stable_page_t *entry = NULL;
+    uint32_t i;
+
+    dedup_stats.pages_scanned++;
+    for (i = 0; i < DEDUP_MAX_STABLE; i++) {
+        if (stable[i].frame == 0) {
+            if (entry == NULL) {
+                entry = &stable[i];
+            }
+        } else if (stable[i].hash == hash &&
+                same_page(stable[i].frame, frame)) {
+            frame_ref(stable[i].frame);
+            share_user_page(pid, page, stable[i].frame);
+            dedup_stats.merges++;
+            return;
+        }
+    }
+
+    if (entry != NULL && candidate->sweep == sweep &&
+            candidate->hash == hash && candidate->frame != frame &&
+            mergeable(candidate->pid, candidate->page, candidate->frame) &&
+            same_page(candidate->frame, frame)) {
+        // the candidate's frame becomes the shared copy, with a reference
+        // for the table
+        frame_ref(candidate->frame);
+        share_user_page(candidate->pid, candidate->page, candidate->frame);
+        entry->hash = hash;
+        entry->frame = candidate->frame;
+        candidate->sweep = 0;
+
+        frame_ref(entry->frame);
+        share_user_page(pid, page, entry->frame);
+        dedup_stats.merges++;
+        return;
+    }
+
+    candidate->hash = hash;
+    candidate->pid = pid;
+    candidate->page = page;
+    candidate->frame = frame;
+    candidate->sweep = sweep;
+}
+
+/**
+ * @return whether a page of a process is still mapped to a frame, which is
+ * private to it, and the process is still idle
+ */
+static int32_t mergeable(uint32_t pid, uint32_t page, uint32_t frame) {
+    process_t *process = get_process(pid);
+    page_table_entry_t *pte = get_user_pte(pid, page);
+
+    return process != NULL && process_idle(process) && pte != NULL &&
+        private_page(pte) && (pte->addr_shifted << 12) == frame;
+}
+
+/**
+ * @return whether a page is mapped to a frame that only it uses
+ */
+static int32_t private_page(page_table_entry_t *pte) {
+    return (pte->flags & PAGE_PRESENT) && !(pte->flags & PAGE_FOREIGN) &&
+        frame_refs(pte->addr_shifted << 12) == 1;
+}
+
+/**
+ * @return a hash of the contents of a page
+ */
+static uint32_t hash_page(const uint32_t *data) {
+    uint32_t hash = FNV_OFFSET;
+    uint32_t i;
+
+    for (i = 0; i < KB(4) / sizeof(uint32_t); i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @return whether two frames have the same contents
+ */
+static int32_t same_page(uint32_t frame1, uint32_t frame2) {
+    const uint32_t *data1 = phys_to_virt(frame1);
+    const uint32_t *data2 = phys_to_virt(frame2);
+    uint32_t i;
+
+    for (i = 0; i < KB(4) / sizeof(uint32_t); i++) {
+        if (data1[i] != data2[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * start a new sweep: forget the candidates, and let go of shared frames
+ * that no page maps any more
+ */
+static void next_sweep(void) {
+    uint32_t i;
+
+    if (++sweep == 0) {
+        sweep = 1;
+    }
+    dedup_stats.sweeps++;
+    for (i = 0; i < DEDUP_MAX_STABLE; i++) {
+        if (stable[i].frame != 0 && frame_refs(stable[i].frame) == 1) {
+            frame_free(stable[i].frame, FRAME_ORDER_4KB);
+            stable[i].frame = 0;
+        }
+    }
+}
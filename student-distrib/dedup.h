@@ -0,0 +1,31 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include "types.h"
+
+// pages looked at by each dedup_idle call
+#define DEDUP_BATCH 16
+// distinct frames that merged pages can share at once
+#define DEDUP_MAX_STABLE 256
+// pages remembered from the current sweep as merge candidates
+#define DEDUP_MAX_CANDIDATES 256
+
+/**
+ * Counters of page merging
+ */
+typedef struct dedup_stats {
+    // pages hashed, and pages merged into another with the same contents
+    uint32_t pages_scanned;
+    uint32_t merges;
+    // full sweeps over every idle process
+    uint32_t sweeps;
+} dedup_stats_t;
+
+extern dedup_stats_t dedup_stats;
+
+void dedup_idle(void);
+uint32_t dedup_shared_frames(void);
+uint32_t dedup_pages_saved(void);
+
+#endif /* _DEDUP_H */
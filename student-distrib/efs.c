@@ -1,44 +1,146 @@
 #include "efs.h"
 #include "lib.h"
+#include "mem.h"
+#include "fdc.h"
+#include "spinlock.h"
+#include "uaccess.h"
 
-block_t* efs_blocks;
+/* The EFS is a writable file system made of blocks of the read-only file
+ * system's size. Block 0 is the super block, with a bitmap of the blocks in
+ * use; block 1 is the root directory, laid out like the read-only boot
+ * block, whose dentries point at inode blocks. A file's inode lists its data
+ * blocks, like a read-only inode; the list ends at the first 0.
+ *
+ * The EFS lives either in the floppy's track cache, which reads blocks on
+ * first use and writes changed ones back when the system is idle (see
+ * fdc_cache_idle), or only in memory when the floppy holds the read-only
+ * file system.
+ */
 
-void efs_set_start(void* address) {
-    efs_blocks = (block_t*)address;
-    return;
-}
+data_block_t* efs_blocks;
+
+// blocks in the EFS, known before its super block is read
+static uint32_t efs_num_blocks;
+// set if the EFS is on the floppy
+static uint32_t efs_on_floppy;
+// the bitmap word efs_get_new_block starts looking in (next fit)
+static uint32_t alloc_hint;
 
 int32_t efs_get_new_block(void);
+void efs_free_block(uint32_t index);
 int32_t efs_num_data_blocks(void);
+dentry_block_t* efs_get_root_dentry_block(void);
+static void* efs_block(uint32_t index);
+static uint8_t* efs_data_block(uint32_t index);
+static void efs_dirty(void* block);
+static inode_t* efs_create(dentry_block_t* dentry_block, const uint8_t* fname);
+static int32_t efs_reserve(inode_t* inode, uint32_t length);
+static void efs_release(inode_t* inode, uint32_t length);
+static int32_t efs_first_zero(uint32_t word);
+static int32_t efs_blank(void);
+
+/* Mount the EFS: from the floppy if (on_floppy) is set and the floppy holds
+ * an EFS, or is blank and can be formatted as one; in memory otherwise, so a
+ * disk holding anything else is never written to.
+ *
+ * Returns 1 if the EFS is on the floppy, 0 if it is in memory only, -1 if
+ * memory ran out
+ */
+int32_t init_efs(int32_t on_floppy) {
+    super_block_t* super_block;
+    uint8_t* image;
+    if(on_floppy) {
+        image = kmalloc_aligned(FDC_MAX_SIZE, KB(4));
+        if(image != NULL) {
+            fdc_cache_init(image, FDC_MAX_SIZE);
+            efs_set_start(image);
+            efs_on_floppy = 1;
+            efs_num_blocks = FDC_MAX_SIZE / EFS_BLOCK_SIZE;
+            super_block = efs_block(EFS_SUPER_BLOCK);
+            if(super_block != NULL && super_block->magic == EFS_MAGIC &&
+                    super_block->num_blocks == efs_num_blocks) {
+                return 1;
+            }
+            if(super_block != NULL && efs_blank()) {
+                efs_new(efs_num_blocks);
+                return 1;
+            }
+            fdc_cache_init(NULL, 0);
+            efs_on_floppy = 0;
+            kfree(image);
+        }
+    }
+    image = kmalloc_aligned(EFS_MEMORY_SIZE, KB(4));
+    if(image == NULL) {
+        efs_blocks = NULL;
+        efs_num_blocks = 0;
+        return -1;
+    }
+    efs_set_start(image);
+    efs_new(EFS_MEMORY_SIZE / EFS_BLOCK_SIZE);
+    return 0;
+}
+
+void efs_set_start(void* address) {
+    efs_blocks = (data_block_t*)address;
+    return;
+}
 
-void efs_new(void) {
+/* Format the EFS with (num_blocks) blocks: everything but the super block
+ * and an empty root directory is free.
+ */
+void efs_new(uint32_t num_blocks) {
     uint32_t i;
     super_block_t* super_block;
-    super_block = (super_block_t*) &efs_blocks[0];
+    if(num_blocks > EFS_BITMAP_WORDS * 32) {
+        num_blocks = EFS_BITMAP_WORDS * 32;
+    }
+    efs_num_blocks = num_blocks;
+    super_block = efs_block(EFS_SUPER_BLOCK);
+    if(super_block == NULL) {
+        return;
+    }
+    memset(super_block, 0, EFS_BLOCK_SIZE);
+    super_block->magic = EFS_MAGIC;
+    super_block->num_blocks = num_blocks;
+    super_block->free_blocks = num_blocks - 1;
+    // the super block, and bits past the last block, are never free
     super_block->block_map[0] = 1;
-    for(i = 1; i < 4092; i++) {
-        super_block->block_map[i] = 0;
+    for(i = num_blocks; i < EFS_BITMAP_WORDS * 32; i++) {
+        super_block->block_map[i / 32] |= 1 << (i % 32);
     }
-    super_block->num_blocks = 1;
-    efs_mkdir(1);
+    alloc_hint = 0;
+    efs_dirty(super_block);
+    efs_mkdir(EFS_ROOT_BLOCK);
     return;
 }
 
+/* Make an empty directory.
+ *
+ * Returns the block of the directory, -1 if there is no room
+ */
 int32_t efs_mkdir(uint32_t parent_index) {
     int32_t dentry_block_index;
     dentry_block_t* dentry_block;
     dentry_block_index = efs_get_new_block();
-    dentry_block = (dentry_block_t*) &efs_blocks[dentry_block_index];
+    if(dentry_block_index < 0) {
+        return -1;
+    }
+    dentry_block = efs_block(dentry_block_index);
+    if(dentry_block == NULL) {
+        efs_free_block(dentry_block_index);
+        return -1;
+    }
+    memset(dentry_block, 0, EFS_BLOCK_SIZE);
     dentry_block->master_entry.num_dentries = 2;
-    dentry_block->master_entry.num_inodes = 0;
-    dentry_block->master_entry.num_data_blocks = 0;
     strcpy((int8_t*)dentry_block->dentry[0].name, ".");
     dentry_block->dentry[0].type = DENTRY_DIRECTORY;
-    dentry_block->dentry[0].block_index = dentry_block_index;
+    dentry_block->dentry[0].inode = dentry_block_index;
     strcpy((int8_t*)dentry_block->dentry[1].name, "..");
     dentry_block->dentry[1].type = DENTRY_DIRECTORY;
-    dentry_block->dentry[1].block_index = parent_index;
-    return 0;
+    dentry_block->dentry[1].inode = parent_index;
+    efs_dirty(dentry_block);
+    return dentry_block_index;
 }
 
 int32_t efs_read_dentry_by_index(dentry_block_t* dentry_block,
@@ -65,8 +167,7 @@ int32_t efs_read_dentry_by_name(dentry_block_t* dentry_block,
 
     //check if file with fname exists
     for(i = 0; i < num_dentries; i++) {
-        bucket = efs_read_dentry_by_index(dentry_block, i, &tmp_dentry);
-        if(bucket < 0) {
+        if(efs_read_dentry_by_index(dentry_block, i, &tmp_dentry) < 0) {
             return -1;
         }
         if(strncmp((int8_t*)fname, (int8_t*)tmp_dentry.name, NAME_MAX) == 0) {
@@ -77,9 +178,52 @@ int32_t efs_read_dentry_by_name(dentry_block_t* dentry_block,
     return -1;
 }
 
+/* Open a file in the root directory, creating it if there is none.
+ *
+ * Returns the file's inode, NULL if the name is not valid or names a
+ * directory, or there is no room
+ */
+inode_t* efs_open(const uint8_t* fname) {
+    dentry_block_t* root;
+    dentry_t* dentry;
+    inode_t* inode = NULL;
+    uint32_t length = strlen((int8_t*)fname);
+    uint32_t flags;
+    uint32_t i;
+
+    if(length < 1 || length > NAME_MAX) {
+        return NULL;
+    }
+    for(i = 0; i < length; i++) {
+        if(fname[i] == '/') {
+            return NULL;
+        }
+    }
+    block_interrupts(&flags);
+    root = efs_get_root_dentry_block();
+    if(root == NULL) {
+        restore_interrupts(flags);
+        return NULL;
+    }
+    for(i = 0; i < root->master_entry.num_dentries; i++) {
+        dentry = &root->dentry[i];
+        if(strncmp((int8_t*)fname, (int8_t*)dentry->name, NAME_MAX) == 0) {
+            if(dentry->type == DENTRY_FILE) {
+                inode = efs_block(dentry->inode);
+            }
+            restore_interrupts(flags);
+            return inode;
+        }
+    }
+    inode = efs_create(root, fname);
+    restore_interrupts(flags);
+    return inode;
+}
+
 /* Read data
- * Reads (length) bytes from the file with inode index (inode) starting from (offset)
- *   bytes. The data is copied into (buf), a string pointer.
+ * Reads (length) bytes from the file with inode pointer (inode) starting from (offset)
+ *   bytes. The data is copied into (buf), a string pointer, which may be a
+ *   user buffer.
  *
  * Returns the number of bytes read, -1 on failure
  */
@@ -92,15 +236,11 @@ int32_t efs_read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length
     uint32_t cur_block;
     uint32_t bytes_left_in_block;
     uint32_t n;
+    uint32_t flags;
     file_length = inode_ptr->length;
-    // check that file isn't too long to be stored in the inode's data_blocks
-    if (file_length / 4096 > 1023)
-    {
-        return -1;
-    }
     // if offset is longer than file, then there is nothing to read
     // (better to get this out of the way, to remove 'negative' cases)
-    if(offset > file_length)
+    if(offset > file_length || length <= 0)
     {
         return 0;
     }
@@ -109,131 +249,372 @@ int32_t efs_read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length
     {
         length = file_length - offset;
     }
-    // length- amount of bytes left to read
-    // offset- current position in file
-    // cur_block- current block that offset is within
-    // byte_ptr- pointer to the first byte to copy in this iteration
-    // bytes_left_in_block- how many bytes are left in current block
-    // n- number of bytes to copy in this iteration
+    block_interrupts(&flags);
     while(length > 0)
     {
-        cur_block = offset / 4096;
-        // check if current block is within the valid range for the
-        //   whole file system. if not, there is a serious problem.
-        if(inode_ptr->data_blocks[cur_block] >= efs_num_data_blocks())
+        cur_block = offset / EFS_BLOCK_SIZE;
+        byte_ptr = efs_data_block(inode_ptr->data_blocks[cur_block]);
+        // a block outside the file system, or one the floppy could not read
+        if(byte_ptr == NULL)
         {
+            restore_interrupts(flags);
             return -1;
         }
-        byte_ptr = (uint8_t*) &efs_blocks[inode_ptr->data_blocks[cur_block]]
-            + (offset % 4096);
-        bytes_left_in_block = 4096 - (offset % 4096);
-        // if there are more bytes to copy than there are bytes left in the
-        //   block, than just copy what's left in the block.
-        // else copy remainder of (length)
+        byte_ptr += offset % EFS_BLOCK_SIZE;
+        bytes_left_in_block = EFS_BLOCK_SIZE - (offset % EFS_BLOCK_SIZE);
         n = (length > bytes_left_in_block)?bytes_left_in_block:length;
-        memcpy(buf, byte_ptr, n); 
-        // update the amount of bytes left to copy
+        if(copy_to_user(buf, byte_ptr, n) != 0)
+        {
+            restore_interrupts(flags);
+            return -1;
+        }
         length -= n;
-        // update the total amount of bytes copied
         copied_length += n;
-        // update the position of the buffer (which is copied to)
         buf += n;
-        // update the current offset into the file
         offset += n;
     }
+    restore_interrupts(flags);
     return copied_length;
 }
 
 /* Write data
- * Writes (length) bytes from the file with inode pointer (inode) starting
- *   from (offset) bytes. The data is copied into (buf), a string pointer.
+ * Writes (length) bytes to the file with inode pointer (inode) starting
+ *   from (offset) bytes. The data is copied from (buf), which may be a user
+ *   buffer. Writing past the end extends the file (with zeros up to
+ *   (offset), if it is past the end).
  *
  * Returns the number of bytes written, -1 on failure
  */
-int32_t efs_write_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length)
+int32_t efs_write_data(void* inode, uint32_t offset, const uint8_t* buf,
+        int32_t length)
 {
     inode_t* inode_ptr = (inode_t*) inode;
     uint8_t* byte_ptr;
-    uint32_t file_length;
     uint32_t copied_length = 0;
     uint32_t cur_block;
     uint32_t bytes_left_in_block;
     uint32_t n;
-    file_length = inode_ptr->length;
-    // check that file isn't too long to be stored in the inode's data_blocks
-    if (file_length / 4096 > 1023)
+    uint32_t flags;
+    if(length <= 0)
     {
-        return -1;
+        return 0;
     }
-    // if offset is longer than file, then there is nothing to write
-    // (better to get this out of the way, to remove 'negative' cases)
-    if(offset > file_length)
+    // the file has to fit in the blocks an inode can list
+    if(offset > INODE_MAX_BLOCKS * EFS_BLOCK_SIZE ||
+            length > INODE_MAX_BLOCKS * EFS_BLOCK_SIZE - offset)
     {
-        return 0;
+        return -1;
     }
-    // update length to represent actual amount of bytes to write
-    if(length > file_length - offset)
+    block_interrupts(&flags);
+    if(offset + length > inode_ptr->length &&
+            efs_reserve(inode_ptr, offset + length) != 0)
     {
-        length = file_length - offset;
+        restore_interrupts(flags);
+        return -1;
     }
-    // length- amount of bytes left to write
-    // offset- current position in file
-    // cur_block- current block that offset is within
-    // byte_ptr- pointer to the first byte to copy in this iteration
-    // bytes_left_in_block- how many bytes are left in current block
-    // n- number of bytes to copy in this iteration
     while(length > 0)
     {
-        cur_block = offset / 4096;
-        // check if current block is within the valid range for the
-        //   whole file system. if not, there is a serious problem.
-        if(inode_ptr->data_blocks[cur_block] >= efs_num_data_blocks())
+        cur_block = offset / EFS_BLOCK_SIZE;
+        byte_ptr = efs_data_block(inode_ptr->data_blocks[cur_block]);
+        if(byte_ptr == NULL)
         {
-            return -1;
+            break;
         }
-        byte_ptr = (uint8_t*) &efs_blocks[inode_ptr->data_blocks[cur_block]]
-            + (offset % 4096);
-        bytes_left_in_block = 4096 - (offset % 4096);
-        // if there are more bytes to copy than there are bytes left in the
-        //   block, than just copy what's left in the block.
-        // else copy remainder of (length)
+        bytes_left_in_block = EFS_BLOCK_SIZE - (offset % EFS_BLOCK_SIZE);
         n = (length > bytes_left_in_block)?bytes_left_in_block:length;
-        memcpy(buf, byte_ptr, n); 
-        // update the amount of bytes left to copy
+        if(copy_from_user(byte_ptr + offset % EFS_BLOCK_SIZE, buf, n) != 0)
+        {
+            break;
+        }
+        efs_dirty(byte_ptr);
         length -= n;
-        // update the total amount of bytes copied
         copied_length += n;
-        // update the position of the buffer (which is copied to)
         buf += n;
-        // update the current offset into the file
         offset += n;
     }
-    return copied_length;
+    // offset only moved past the end if something was written there
+    if(copied_length > 0 && offset > inode_ptr->length)
+    {
+        inode_ptr->length = offset;
+        efs_dirty(inode_ptr);
+    }
+    // give back blocks reserved for what could not be written
+    efs_release(inode_ptr, inode_ptr->length);
+    restore_interrupts(flags);
+    return (copied_length > 0) ? copied_length : -1;
+}
+
+/* Make a file (length) bytes long, cutting it off or extending it with
+ * zeros.
+ *
+ * Returns 0 on success, -1 if there is no room
+ */
+int32_t efs_truncate(inode_t* inode, uint32_t length) {
+    uint8_t* byte_ptr;
+    uint32_t flags;
+    uint32_t tail;
+    if(length > INODE_MAX_BLOCKS * EFS_BLOCK_SIZE) {
+        return -1;
+    }
+    block_interrupts(&flags);
+    if(length > inode->length) {
+        if(efs_reserve(inode, length) != 0) {
+            restore_interrupts(flags);
+            return -1;
+        }
+    } else {
+        // what is cut off the last block reads as zeros if the file grows
+        tail = length % EFS_BLOCK_SIZE;
+        if(tail != 0) {
+            byte_ptr = efs_data_block(inode->data_blocks[length / EFS_BLOCK_SIZE]);
+            if(byte_ptr != NULL) {
+                memset(byte_ptr + tail, 0, EFS_BLOCK_SIZE - tail);
+                efs_dirty(byte_ptr);
+            }
+        }
+        efs_release(inode, length);
+    }
+    inode->length = length;
+    efs_dirty(inode);
+    restore_interrupts(flags);
+    return 0;
+}
+
+int32_t efs_file_read(file_info_t* file, uint8_t* buf, int32_t length) {
+    int32_t bytes_read = efs_read_data(file->inode_ptr, file->pos, buf, length);
+    if(bytes_read > 0) {
+        file->pos += bytes_read;
+    }
+    return bytes_read;
+}
+
+int32_t efs_file_write(file_info_t* file, const int8_t* buf, int32_t length) {
+    int32_t bytes_written = efs_write_data(file->inode_ptr, file->pos,
+            (const uint8_t*)buf, length);
+    if(bytes_written > 0) {
+        file->pos += bytes_written;
+    }
+    return bytes_written;
+}
+
+/* Read the name of the next entry of the root directory into (buf), padded
+ * with zeros up to (length); buf may be a user buffer.
+ *
+ * Returns the length of the name, 0 past the last entry, -1 on failure
+ */
+int32_t efs_directory_read(file_info_t* file, uint8_t* buf, int32_t length) {
+    dentry_block_t* root = efs_get_root_dentry_block();
+    uint8_t* name;
+    int32_t bytes_read = 0;
+    if(root == NULL) {
+        return -1;
+    }
+    if(file->pos >= root->master_entry.num_dentries) {
+        return 0;
+    }
+    name = root->dentry[file->pos].name;
+    while(bytes_read < NAME_MAX && bytes_read < length && name[bytes_read]) {
+        bytes_read++;
+    }
+    if(copy_to_user(buf, name, bytes_read) != 0 ||
+            clear_user(buf + bytes_read, length - bytes_read) != 0) {
+        return -1;
+    }
+    file->pos++;
+    return bytes_read;
+}
+
+/* Write every change to the EFS back to the floppy now.
+ *
+ * Returns 0 on success (or if the EFS is in memory only), -1 on failure
+ */
+int32_t efs_sync(void) {
+    if(!efs_on_floppy) {
+        return 0;
+    }
+    return fdc_cache_sync();
 }
 
+/* Allocate a block: the first free one in the bitmap, starting from the
+ * word of the last allocation.
+ *
+ * Returns the block, -1 if there is none free
+ */
 int32_t efs_get_new_block(void) {
     super_block_t* super_block;
-    uint32_t i;
-    uint8_t* block_map;
-    super_block = (super_block_t*) &efs_blocks[0];
-    block_map = super_block->block_map;
-    for(i = 1; i < 4092; i++) {
-        if(block_map[i] == 0) {
-            break;
+    uint32_t words = (efs_num_blocks + 31) / 32;
+    uint32_t i, word;
+    super_block = efs_block(EFS_SUPER_BLOCK);
+    if(super_block == NULL || super_block->free_blocks == 0) {
+        return -1;
+    }
+    for(i = 0; i < words; i++) {
+        word = (alloc_hint + i) % words;
+        if(super_block->block_map[word] != 0xFFFFFFFF) {
+            alloc_hint = word;
+            i = efs_first_zero(super_block->block_map[word]);
+            super_block->block_map[word] |= 1 << i;
+            super_block->free_blocks--;
+            efs_dirty(super_block);
+            return word * 32 + i;
         }
     }
-    if(i > 4092) {
-        return -1;
+    return -1;
+}
+
+void efs_free_block(uint32_t index) {
+    super_block_t* super_block = efs_block(EFS_SUPER_BLOCK);
+    if(super_block == NULL || index <= EFS_ROOT_BLOCK ||
+            index >= efs_num_blocks) {
+        return;
     }
-    block_map[i] = 1;
-    super_block->num_blocks++;
-    return i;
+    super_block->block_map[index / 32] &= ~(1 << (index % 32));
+    super_block->free_blocks++;
+    efs_dirty(super_block);
 }
 
 dentry_block_t* efs_get_root_dentry_block(void) {
-    return (dentry_block_t*) &efs_blocks[1];
+    return efs_block(EFS_ROOT_BLOCK);
 }
 
 int32_t efs_num_data_blocks() {
-	return 0;
+	return efs_num_blocks;
+}
+
+/* Returns a block of the EFS, read from the floppy if it is not in memory
+ * yet; NULL if there is no such block or it could not be read
+ */
+static void* efs_block(uint32_t index) {
+    if(efs_blocks == NULL || index >= efs_num_blocks) {
+        return NULL;
+    }
+    if(efs_on_floppy &&
+            fdc_cache_load(index * EFS_BLOCK_SIZE, EFS_BLOCK_SIZE) != 0) {
+        return NULL;
+    }
+    return &efs_blocks[index];
+}
+
+/* Returns 1 if the blocks the super block and root directory go in are all
+ * zeros (a blank disk), 0 if they hold anything or could not be read
+ */
+static int32_t efs_blank(void) {
+    uint32_t* word;
+    uint32_t i, j;
+    for(i = EFS_SUPER_BLOCK; i <= EFS_ROOT_BLOCK; i++) {
+        word = efs_block(i);
+        if(word == NULL) {
+            return 0;
+        }
+        for(j = 0; j < EFS_BLOCK_SIZE / sizeof(uint32_t); j++) {
+            if(word[j] != 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Returns a block that can hold file data (not the super block or the root
+ * directory), or NULL like efs_block
+ */
+static uint8_t* efs_data_block(uint32_t index) {
+    if(index <= EFS_ROOT_BLOCK) {
+        return NULL;
+    }
+    return efs_block(index);
+}
+
+/* Mark a block (or something in it) as changed, so it is written back.
+ */
+static void efs_dirty(void* block) {
+    uint32_t index = ((uint32_t)block - (uint32_t)efs_blocks) / EFS_BLOCK_SIZE;
+    if(efs_on_floppy) {
+        fdc_cache_dirty(index * EFS_BLOCK_SIZE, EFS_BLOCK_SIZE);
+    }
+}
+
+/* Add a file to a directory, with an empty inode.
+ *
+ * Returns the file's inode, NULL if there is no room
+ */
+static inode_t* efs_create(dentry_block_t* dentry_block, const uint8_t* fname) {
+    dentry_t* dentry;
+    inode_t* inode;
+    int32_t index;
+    if(dentry_block->master_entry.num_dentries >= MAX_DENTRIES) {
+        return NULL;
+    }
+    index = efs_get_new_block();
+    if(index < 0) {
+        return NULL;
+    }
+    inode = efs_block(index);
+    if(inode == NULL) {
+        efs_free_block(index);
+        return NULL;
+    }
+    memset(inode, 0, EFS_BLOCK_SIZE);
+    efs_dirty(inode);
+
+    dentry = &dentry_block->dentry[dentry_block->master_entry.num_dentries];
+    memset(dentry, 0, sizeof(dentry_t));
+    strncpy((int8_t*)dentry->name, (int8_t*)fname, NAME_MAX);
+    dentry->type = DENTRY_FILE;
+    dentry->inode = index;
+    dentry_block->master_entry.num_dentries++;
+    efs_dirty(dentry_block);
+    return inode;
+}
+
+/* Give a file zeroed blocks up to (length) bytes; its length is left alone.
+ *
+ * Returns 0 on success, -1 (having given the new blocks back) if there is
+ * no room
+ */
+static int32_t efs_reserve(inode_t* inode, uint32_t length) {
+    uint32_t blocks = (length + EFS_BLOCK_SIZE - 1) / EFS_BLOCK_SIZE;
+    uint8_t* byte_ptr;
+    int32_t index;
+    uint32_t i;
+    for(i = (inode->length + EFS_BLOCK_SIZE - 1) / EFS_BLOCK_SIZE;
+            i < blocks; i++) {
+        if(inode->data_blocks[i] != 0) {
+            continue;
+        }
+        index = efs_get_new_block();
+        byte_ptr = (index < 0) ? NULL : efs_block(index);
+        if(byte_ptr == NULL) {
+            if(index >= 0) {
+                efs_free_block(index);
+            }
+            efs_release(inode, inode->length);
+            return -1;
+        }
+        memset(byte_ptr, 0, EFS_BLOCK_SIZE);
+        efs_dirty(byte_ptr);
+        inode->data_blocks[i] = index;
+        efs_dirty(inode);
+    }
+    return 0;
+}
+
+/* Free the blocks of a file past the first (length) bytes.
+ */
+static void efs_release(inode_t* inode, uint32_t length) {
+    uint32_t i;
+    for(i = (length + EFS_BLOCK_SIZE - 1) / EFS_BLOCK_SIZE;
+            i < INODE_MAX_BLOCKS && inode->data_blocks[i] != 0; i++) {
+        efs_free_block(inode->data_blocks[i]);
+        inode->data_blocks[i] = 0;
+        efs_dirty(inode);
+    }
+}
+
+/* Returns the index of the lowest clear bit of (word), which has one
+ */
+static int32_t efs_first_zero(uint32_t word) {
+    int32_t bit;
+    asm ("bsfl %1, %0" : "=r"(bit) : "rm"(~word) : "cc");
+    return bit;
 }
@@ -2,55 +2,52 @@
 #define _EFS_H
 
 #include "types.h"
-
-#define NAME_MAX 32
-
-#define DENTRY_RTC 0
-#define DENTRY_DIRECTORY 1
-#define DENTRY_FILE 2
-
-typedef struct block {
-    uint8_t reserved[1024];
-} block_t;
+#include "fs.h"
+
+// blocks have the size of the read-only file system's; directories have the
+// layout of its boot block, and inodes and data blocks are the same
+#define EFS_BLOCK_SIZE sizeof(data_block_t)
+typedef bootblock_t dentry_block_t;
+
+// marks a formatted EFS in its super block
+#define EFS_MAGIC 0x45465331
+// the super block, and the root directory after it
+#define EFS_SUPER_BLOCK 0
+#define EFS_ROOT_BLOCK 1
+// size of an EFS that is not on the floppy
+#define EFS_MEMORY_SIZE KB(512)
+// what file names under the EFS start with, and the EFS root's own name
+#define EFS_PREFIX "/efs/"
+#define EFS_ROOT "/efs"
+
+// words of the free block bitmap
+#define EFS_BITMAP_WORDS ((EFS_BLOCK_SIZE - 3 * sizeof(uint32_t)) / \
+        sizeof(uint32_t))
 
 typedef struct super_block {
+    uint32_t magic;
     uint32_t num_blocks;
-    uint8_t block_map[4092];
+    uint32_t free_blocks;
+    // a bit per block, set if the block is in use
+    uint32_t block_map[EFS_BITMAP_WORDS];
 } super_block_t;
 
-typedef struct master_entry {
-    uint32_t num_dentries;
-    uint32_t num_inodes;
-    uint32_t num_data_blocks;
-    uint8_t reserved[48];
-} master_entry_t;
-
-typedef struct inode {
-    uint32_t length;
-    uint32_t data_blocks[1023];
-} inode_t;
-
-typedef struct data_block {
-    uint8_t data[1024];
-} data_block_t;
-
-typedef struct dentry {
-    uint8_t name[NAME_MAX];
-    uint32_t type;
-    uint32_t block_index;
-    uint8_t reserved[24];
-} dentry_t;
-
-typedef struct dentry_block {
-    master_entry_t master_entry;
-    dentry_t dentry[63];
-} dentry_block_t;
-
+int32_t init_efs(int32_t on_floppy);
 void efs_set_start(void* address);
+void efs_new(uint32_t num_blocks);
 int32_t efs_mkdir(uint32_t parent_index);
 int32_t efs_read_dentry_by_index(dentry_block_t* dentry_block, uint32_t index,
 		dentry_t* dentry);
 int32_t efs_read_dentry_by_name(dentry_block_t* dentry_block, const uint8_t*
 		fname, dentry_t* dentry);
+inode_t* efs_open(const uint8_t* fname);
+int32_t efs_read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length);
+int32_t efs_write_data(void* inode, uint32_t offset, const uint8_t* buf,
+		int32_t length);
+int32_t efs_truncate(inode_t* inode, uint32_t length);
+int32_t efs_file_read(file_info_t* file, uint8_t* buf, int32_t length);
+int32_t efs_file_write(file_info_t* file, const int8_t* buf, int32_t length);
+int32_t efs_directory_read(file_info_t* file, uint8_t* buf, int32_t length);
+int32_t efs_sync(void);
 
 #endif
@@ -4,6 +4,9 @@
 #include "fdc.h"
 #include "lib.h"
 #include "i8259.h"
+#include "mem.h"
+#include "frame.h"
+#include "spinlock.h"
 
 /* Floppy structure:
  * - 512B per sector
@@ -19,13 +22,28 @@
  *   http://www.isdaman.com/alsos/hardware/fdc/floppy.htm
  */
 
-//buffer is equal to 1 cylinder (18,432B)
-static uint8_t fdc_dmabuffer[FDC_BUFFER_SIZE] __attribute__((aligned(0x8000)));
+//buffer is equal to 1 cylinder (18,432B), allocated by fdc_init
+static uint8_t *fdc_dmabuffer = NULL;
 
 static volatile fdc_motor_state_t motor_state = MOTOR_OFF;
 static volatile uint32_t fdc_interrupt_occurred = 0;
 static volatile int32_t fdc_drive = -1;
 
+//the track cache: a copy of the disk that cylinders are read into on first
+//  access (fdc_cache_load) or when the system is idle (fdc_cache_idle).
+//  Cylinders changed in the cache (fdc_cache_dirty) are written back when
+//  the system is idle, or by fdc_cache_sync.
+static uint8_t *cache_buffer = NULL;
+static uint32_t cache_size = 0;
+static uint8_t cylinder_loaded[FDC_CYLINDERS];
+static uint8_t cylinder_dirty[FDC_CYLINDERS];
+//cleared if the disk turns out to be write protected
+static uint32_t cache_writable = 0;
+//where fdc_cache_idle looks for the next cylinder to read
+static uint32_t prefetch_cylinder = 0;
+//set while a cylinder is being read
+static volatile uint32_t cache_busy = 0;
+
 static const int8_t* drive_types[8] = {
     "none",
     "360kB 5.25\"",
@@ -51,12 +69,19 @@ int32_t fdc_do_track(uint32_t cylinder, fdc_direction_t dir);
 int32_t fdc_check_error(void);
 void fdc_motor(fdc_motor_state_t set_state);
 int32_t fdc_reset(uint32_t drive);
+int32_t fdc_cache_cylinder(uint32_t cylinder, fdc_direction_t dir);
 
 int32_t fdc_init(uint32_t drive) {
     int32_t ret;
     if(drive > 1) {
         return -1;
     }
+    if(fdc_dmabuffer == NULL) {
+        fdc_dmabuffer = kmalloc_dma(FDC_BUFFER_SIZE);
+        if(fdc_dmabuffer == NULL) {
+            return -1;
+        }
+    }
     //set the current drive number
     fdc_drive = (int32_t) drive;
 
@@ -286,7 +311,7 @@ void fdc_dma_init(fdc_direction_t dir) {
         uint32_t l;   //1 long
     } a, c; //address and count
 
-    a.l = (uint32_t) &fdc_dmabuffer;
+    a.l = virt_to_phys(fdc_dmabuffer);
     c.l = (uint32_t) FDC_BUFFER_SIZE - 1; // -1 for DMA counting
 
     if((a.l >> 24) || (c.l >> 16) || (((a.l & 0xffff) + c.l) >> 16)) {
@@ -476,7 +501,7 @@ int32_t fdc_disk_write(uint8_t* buffer, uint32_t bytes) {
         if(remaining < FDC_BUFFER_SIZE) {
             copy_this_iter = remaining;
         }
-        memcpy(&fdc_dmabuffer, buffer + pos, copy_this_iter);
+        memcpy(fdc_dmabuffer, buffer + pos, copy_this_iter);
         ret = fdc_do_track(cylinder, FDC_WRITE);
         if(ret != 0) {
             return ret;
@@ -511,10 +536,150 @@ int32_t fdc_disk_read(uint8_t* buffer, uint32_t bytes) {
         if(ret != 0) {
             return ret;
         }
-        memcpy(buffer + pos, &fdc_dmabuffer, copy_this_iter);
+        memcpy(buffer + pos, fdc_dmabuffer, copy_this_iter);
         pos += copy_this_iter;
         remaining -= copy_this_iter;
         cylinder++;
     }
     return 0;
 }
+
+/* Set up the track cache over (buffer), which is (bytes) long; nothing is
+ * read from the disk until it is asked for.
+ */
+void fdc_cache_init(uint8_t* buffer, uint32_t bytes) {
+    cache_buffer = buffer;
+    cache_size = (bytes > FDC_MAX_SIZE) ? FDC_MAX_SIZE : bytes;
+    memset(cylinder_loaded, 0, sizeof(cylinder_loaded));
+    memset(cylinder_dirty, 0, sizeof(cylinder_dirty));
+    cache_writable = 1;
+    prefetch_cylinder = 0;
+}
+
+/* Make sure (length) bytes of the disk from (offset) are in the track cache,
+ * reading the cylinders that are not yet.
+ *
+ * Returns 0 on success, -1 if the range is past the cache or a read failed
+ */
+int32_t fdc_cache_load(uint32_t offset, uint32_t length) {
+    uint32_t cylinder, last;
+    if(cache_buffer == NULL || offset >= cache_size ||
+            length > cache_size - offset) {
+        return -1;
+    }
+    if(length == 0) {
+        return 0;
+    }
+    last = (offset + length - 1) / FDC_BUFFER_SIZE;
+    for(cylinder = offset / FDC_BUFFER_SIZE; cylinder <= last; cylinder++) {
+        if(!cylinder_loaded[cylinder] &&
+                fdc_cache_cylinder(cylinder, FDC_READ) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Mark (length) bytes of the disk from (offset), which are in the track
+ * cache, as changed there, so they are written back to the disk.
+ */
+void fdc_cache_dirty(uint32_t offset, uint32_t length) {
+    uint32_t cylinder, last;
+    if(cache_buffer == NULL || offset >= cache_size || length == 0 ||
+            length > cache_size - offset) {
+        return;
+    }
+    last = (offset + length - 1) / FDC_BUFFER_SIZE;
+    for(cylinder = offset / FDC_BUFFER_SIZE; cylinder <= last; cylinder++) {
+        if(cylinder_loaded[cylinder]) {
+            cylinder_dirty[cylinder] = 1;
+        }
+    }
+}
+
+/* Write every changed cylinder of the track cache back to the disk.
+ *
+ * Returns 0 on success, -1 if a write failed
+ */
+int32_t fdc_cache_sync(void) {
+    uint32_t cylinder;
+    for(cylinder = 0; cylinder < FDC_CYLINDERS; cylinder++) {
+        if(cylinder_dirty[cylinder] &&
+                fdc_cache_cylinder(cylinder, FDC_WRITE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write back one changed cylinder of the track cache, or else read one more
+ * cylinder that is not in it yet; called when nothing else can run.
+ */
+void fdc_cache_idle(void) {
+    uint32_t cylinders = (cache_size + FDC_BUFFER_SIZE - 1) / FDC_BUFFER_SIZE;
+    uint32_t cylinder;
+    for(cylinder = 0; cylinder < cylinders; cylinder++) {
+        if(cylinder_dirty[cylinder]) {
+            fdc_cache_cylinder(cylinder, FDC_WRITE);
+            return;
+        }
+    }
+    while(prefetch_cylinder < cylinders) {
+        if(!cylinder_loaded[prefetch_cylinder]) {
+            //try again next time if it failed
+            fdc_cache_cylinder(prefetch_cylinder, FDC_READ);
+            return;
+        }
+        prefetch_cylinder++;
+    }
+}
+
+/* Read a cylinder into the track cache, or write it back from there.
+ * This keeps the scheduler (PIT) masked while it waits for the controller,
+ * so no other process can start a transfer in the middle; one started from
+ * an interrupt handler meanwhile fails instead of waiting. The keyboard stays
+ * live, since a read ahead from the idle loop takes a good part of a second.
+ * If the disk is write protected, changes stay in the cache only.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int32_t fdc_cache_cylinder(uint32_t cylinder, fdc_direction_t dir) {
+    uint32_t flags, pos, n;
+    int32_t ret;
+    block_interrupts(&flags);
+    if(cache_busy || fdc_drive < 0) {
+        restore_interrupts(flags);
+        return -1;
+    }
+    if(dir == FDC_WRITE && !cache_writable) {
+        cylinder_dirty[cylinder] = 0;
+        restore_interrupts(flags);
+        return -1;
+    }
+    cache_busy = 1;
+    disable_irq(0);
+    pos = cylinder * FDC_BUFFER_SIZE;
+    n = (cache_size - pos > FDC_BUFFER_SIZE) ?
+        FDC_BUFFER_SIZE : cache_size - pos;
+    if(dir == FDC_WRITE) {
+        memcpy(fdc_dmabuffer, cache_buffer + pos, n);
+        ret = fdc_do_track(cylinder, FDC_WRITE);
+        if(ret == 0) {
+            cylinder_dirty[cylinder] = 0;
+        } else if(ret == -2) {
+            printf("Floppy is write protected; changes are kept in memory\n");
+            cache_writable = 0;
+            memset(cylinder_dirty, 0, sizeof(cylinder_dirty));
+        }
+    } else {
+        ret = fdc_do_track(cylinder, FDC_READ);
+        if(ret == 0) {
+            memcpy(cache_buffer + pos, fdc_dmabuffer, n);
+            cylinder_loaded[cylinder] = 1;
+        }
+    }
+    enable_irq(0);
+    cache_busy = 0;
+    restore_interrupts(flags);
+    return (ret == 0) ? 0 : -1;
+}
@@ -6,6 +6,8 @@
 
 #define FDC_MAX_SIZE 1474560
 #define FDC_BUFFER_SIZE 0x4800
+// cylinders on a disk; each is read whole, into FDC_BUFFER_SIZE bytes
+#define FDC_CYLINDERS (FDC_MAX_SIZE / FDC_BUFFER_SIZE)
 #define FDC_REG_BASE 0x3f0
 #define FDC_IRQ 6
 
@@ -169,6 +171,11 @@ typedef struct CCR_byte {
 int32_t fdc_init(uint32_t drive);
 int32_t fdc_disk_write(uint8_t* buffer, uint32_t bytes);
 int32_t fdc_disk_read(uint8_t* buffer, uint32_t bytes);
+void fdc_cache_init(uint8_t* buffer, uint32_t bytes);
+int32_t fdc_cache_load(uint32_t offset, uint32_t length);
+void fdc_cache_dirty(uint32_t offset, uint32_t length);
+int32_t fdc_cache_sync(void);
+void fdc_cache_idle(void);
 void fdc_detect_drives(void);
 void fdc_handler(void);
 
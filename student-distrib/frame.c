@@ -0,0 +1,566 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "frame.h"
+#include "x86_desc.h"
+#include "paging.h"
+#include "spinlock.h"
+
+/**
+ * @file frame.c
+ *
+ * @brief physical page frame allocator
+ *
+ * Buddy allocator over the usable RAM reported by the multiboot memory map.
+ * Memory is handed out in blocks of 2^order 4KB frames, from a single frame up
+ * to a 4MB frame that can back a large page. A free block is kept on the list
+ * for its order, linked through its own first bytes (reached through the
+ * physmap), and when it is freed it is merged with its buddy as long as the
+ * buddy is free too.
+ *
+ * Frames below FRAME_DMA_LIMIT form a separate zone with its own free lists,
+ * kept for ISA DMA buffers: frame_alloc_dma only takes from it, and
+ * frame_alloc only when the rest of memory has run out. Since blocks are
+ * aligned to their size, the zone boundary never splits one.
+ *
+ * Allocated blocks are reference counted so they can be shared (by several
+ * address spaces mapping the same page, say): frame_ref takes another
+ * reference and frame_free drops one, freeing the block with the last.
+ *
+ * The per-frame bookkeeping array is sized to the memory actually present and
+ * placed in the first usable memory that is large enough.
+ */
+
+// frame_t flags
+// the frame heads a free block of frame_t.order
+#define FRAME_FREE 0x1
+
+// most ranges (kernel, modules, bookkeeping) kept out of the allocator
+#define MAX_RESERVED 16
+
+// the multiboot memory map type for usable RAM
+#define MMAP_AVAILABLE 1
+
+// zones of physical memory, with separate free lists
+#define ZONE_DMA 0
+#define ZONE_NORMAL 1
+#define NUM_ZONES 2
+#define frame_zone(index) \
+    (((index) << FRAME_SHIFT) < FRAME_DMA_LIMIT ? ZONE_DMA : ZONE_NORMAL)
+
+typedef struct frame {
+    uint8_t flags;
+    uint8_t order;
+    // references to an allocated block, kept in its first frame
+    uint16_t refs;
+    // recent use of a frame mapped into user space, most recent in the top
+    // bit (see frame_age)
+    uint8_t age;
+} frame_t;
+
+// a free block, as seen through the physmap
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+// bookkeeping for every frame below the top of usable memory
+static frame_t *frames;
+static uint32_t num_frames;
+static uint32_t num_free;
+static uint32_t num_usable;
+
+// heads of the free lists for each zone and order
+static free_block_t *free_lists[NUM_ZONES][FRAME_MAX_ORDER + 1];
+
+// physical ranges that must never be handed out
+static uint32_t reserved_start[MAX_RESERVED];
+static uint32_t reserved_end[MAX_RESERVED];
+static uint32_t num_reserved;
+
+// Forward declarations
+static int32_t mmap_next(multiboot_info_t *mbi, uint32_t *pos, uint32_t *start,
+        uint32_t *end);
+static uint32_t frame_alloc_zone(uint32_t order, uint32_t zone);
+static int32_t reserve_range(uint32_t start, uint32_t end);
+static uint32_t find_range(multiboot_info_t *mbi, uint32_t size);
+static void free_mmap_range(multiboot_info_t *mbi, uint32_t limit,
+        uint32_t start, uint32_t end);
+static void free_range(uint32_t start, uint32_t end);
+static void release_block(uint32_t index, uint32_t order);
+static void free_list_push(uint32_t index, uint32_t order);
+static void free_list_remove(uint32_t index, uint32_t order);
+
+/**
+ * initialize the frame allocator from the multiboot information
+ *
+ * uses the memory map if the bootloader provided one, and mem_upper
+ * otherwise; memory past PHYSMAP_SIZE is ignored. The kernel, the multiboot
+ * modules and the allocator's own bookkeeping are kept out of the free lists.
+ *
+ * must be called with paging enabled, since it maps the physmap
+ *
+ * @param mbi multiboot information from the bootloader
+ * @return 0 on success, -1 if no usable memory was found or there were too
+ * many separate ranges to keep out
+ */
+int32_t init_frames(multiboot_info_t *mbi) {
+    uint32_t pos, start, end;
+    uint32_t top = 0;
+    uint32_t meta_size, meta;
+    uint32_t i, j;
+    module_t *mod;
+
+    for (i = 0; i < NUM_ZONES; i++) {
+        for (j = 0; j <= FRAME_MAX_ORDER; j++) {
+            free_lists[i][j] = NULL;
+        }
+    }
+    num_reserved = 0;
+    num_free = 0;
+    num_usable = 0;
+
+    pos = 0;
+    while (mmap_next(mbi, &pos, &start, &end) == 0) {
+        if (end > top) {
+            top = end;
+        }
+    }
+    if (top <= FRAME_RESERVED_END) {
+        return -1;
+    }
+    num_frames = top >> FRAME_SHIFT;
+    map_physmap(top);
+
+    if (reserve_range(0, FRAME_RESERVED_END) != 0) {
+        return -1;
+    }
+    if (mbi->flags & MULTIBOOT_INFO_MODS) {
+        mod = (module_t*) mbi->mods_addr;
+        for (i = 0; i < mbi->mods_count; i++) {
+            if (reserve_range(mod[i].mod_start, mod[i].mod_end) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    meta_size = num_frames * sizeof(frame_t);
+    meta = find_range(mbi, meta_size);
+    if (meta == 0 || reserve_range(meta, meta + meta_size) != 0) {
+        return -1;
+    }
+    frames = phys_to_virt(meta);
+    for (i = 0; i < num_frames; i++) {
+        frames[i].flags = 0;
+        frames[i].order = 0;
+        frames[i].refs = 0;
+        frames[i].age = 0;
+    }
+
+    pos = 0;
+    while (mmap_next(mbi, &pos, &start, &end) == 0) {
+        free_mmap_range(mbi, pos, start, end);
+    }
+    num_usable = num_free;
+    return 0;
+}
+
+/**
+ * allocate a block of 2^order physically contiguous frames
+ *
+ * the block is aligned to its own size; its contents are undefined. The DMA
+ * zone is only used once the rest of memory is exhausted.
+ *
+ * @param order log2 of the number of frames
+ * @return physical address of the block, or 0 if out of memory
+ */
+uint32_t frame_alloc(uint32_t order) {
+    uint32_t addr = frame_alloc_zone(order, ZONE_NORMAL);
+    if (addr == 0) {
+        addr = frame_alloc_zone(order, ZONE_DMA);
+    }
+    return addr;
+}
+
+/**
+ * allocate a block of 2^order physically contiguous frames below
+ * FRAME_DMA_LIMIT
+ *
+ * like frame_alloc, the block is aligned to its own size, so a block of up to
+ * 64KB never crosses a 64KB boundary
+ *
+ * @param order log2 of the number of frames
+ * @return physical address of the block, or 0 if the DMA zone is exhausted
+ */
+uint32_t frame_alloc_dma(uint32_t order) {
+    return frame_alloc_zone(order, ZONE_DMA);
+}
+
+/**
+ * drop a reference to a block previously returned by frame_alloc, freeing it
+ * if that was the last one
+ *
+ * does nothing for addresses the allocator does not manage, blocks that are
+ * not allocated (including ones already free, and frames in the middle of a
+ * block) or an order other than the one the block was allocated with
+ *
+ * @param addr physical address of the block
+ * @param order the order it was allocated with
+ */
+void frame_free(uint32_t addr, uint32_t order) {
+    uint32_t flags;
+    uint32_t index = addr >> FRAME_SHIFT;
+
+    if (order > FRAME_MAX_ORDER || (index & ((1 << order) - 1)) != 0 ||
+            index + (1 << order) > num_frames) {
+        return;
+    }
+    block_interrupts(&flags);
+    // only the first frame of an allocated block has references
+    if ((frames[index].flags & FRAME_FREE) || frames[index].refs == 0 ||
+            frames[index].order != order) {
+        restore_interrupts(flags);
+        return;
+    }
+    if (frames[index].refs > 1) {
+        frames[index].refs--;
+        restore_interrupts(flags);
+        return;
+    }
+    release_block(index, order);
+    restore_interrupts(flags);
+}
+
+/**
+ * take another reference to an allocated block, so that it stays allocated
+ * until frame_free has been called once more
+ *
+ * @param addr physical address of the block
+ */
+void frame_ref(uint32_t addr) {
+    uint32_t flags;
+    uint32_t index = addr >> FRAME_SHIFT;
+
+    if (index >= num_frames || (frames[index].flags & FRAME_FREE)) {
+        return;
+    }
+    block_interrupts(&flags);
+    frames[index].refs++;
+    restore_interrupts(flags);
+}
+
+/**
+ * @param addr physical address of an allocated block
+ * @return number of references to it, 0 if it is not allocated
+ */
+uint32_t frame_refs(uint32_t addr) {
+    uint32_t index = addr >> FRAME_SHIFT;
+
+    if (index >= num_frames || (frames[index].flags & FRAME_FREE)) {
+        return 0;
+    }
+    return frames[index].refs;
+}
+
+/**
+ * age a frame's use history by one step, shifting in whether it was used
+ * since the last step
+ *
+ * after eight steps without use the age reaches 0, making the frame the
+ * first to be swapped out (see swap.c)
+ *
+ * @param addr physical address of an allocated frame
+ * @param used whether the frame was used (its accessed bit was set)
+ * @return the new age
+ */
+uint32_t frame_age(uint32_t addr, uint32_t used) {
+    uint32_t index = addr >> FRAME_SHIFT;
+
+    if (index >= num_frames) {
+        return 0;
+    }
+    frames[index].age = (frames[index].age >> 1) | (used ? FRAME_AGE_NEW : 0);
+    return frames[index].age;
+}
+
+/**
+ * @return number of free 4KB frames
+ */
+uint32_t frames_free(void) {
+    return num_free;
+}
+
+/**
+ * @return number of 4KB frames the allocator manages
+ */
+uint32_t frames_total(void) {
+    return num_usable;
+}
+
+/**
+ * allocate a block from one zone, splitting a larger one if needed
+ *
+ * @return physical address of the block, or 0 if the zone has none
+ */
+static uint32_t frame_alloc_zone(uint32_t order, uint32_t zone) {
+    uint32_t flags;
+    uint32_t current;
+    uint32_t index;
+
+    if (order > FRAME_MAX_ORDER) {
+        return 0;
+    }
+    block_interrupts(&flags);
+    for (current = order; current <= FRAME_MAX_ORDER; current++) {
+        if (free_lists[zone][current] != NULL) {
+            break;
+        }
+    }
+    if (current > FRAME_MAX_ORDER) {
+        restore_interrupts(flags);
+        return 0;
+    }
+    index = virt_to_phys(free_lists[zone][current]) >> FRAME_SHIFT;
+    free_list_remove(index, current);
+
+    // give back the upper half of the block until it is the right size
+    while (current > order) {
+        current--;
+        free_list_push(index + (1 << current), current);
+    }
+    frames[index].order = order;
+    frames[index].refs = 1;
+    frames[index].age = FRAME_AGE_NEW;
+    num_free -= 1 << order;
+    restore_interrupts(flags);
+
+    return index << FRAME_SHIFT;
+}
+
+/**
+ * step through the usable memory ranges the bootloader reported
+ *
+ * ranges are clipped to whole frames below PHYSMAP_SIZE
+ *
+ * @param pos iterator state, 0 to start
+ * @param start start of the next range out
+ * @param end end (exclusive) of the next range out
+ * @return 0 if a range was found, -1 when there are no more
+ */
+static int32_t mmap_next(multiboot_info_t *mbi, uint32_t *pos, uint32_t *start,
+        uint32_t *end) {
+    memory_map_t *mmap;
+    uint32_t base, length;
+
+    if (!(mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        // no memory map; fall back on the size of upper memory
+        if (*pos != 0 || !(mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+            return -1;
+        }
+        *pos = 1;
+        *start = MB(1);
+        if (mbi->mem_upper >= (PHYSMAP_SIZE - MB(1)) / KB(1)) {
+            *end = PHYSMAP_SIZE;
+        } else {
+            *end = MB(1) + (mbi->mem_upper * KB(1) & ~(FRAME_SIZE - 1));
+        }
+        return 0;
+    }
+
+    while (*pos < mbi->mmap_length) {
+        mmap = (memory_map_t*) (mbi->mmap_addr + *pos);
+        *pos += mmap->size + sizeof(mmap->size);
+
+        base = mmap->base_addr_low;
+        length = mmap->length_low;
+        if (mmap->type != MMAP_AVAILABLE || mmap->base_addr_high != 0 ||
+                base >= PHYSMAP_SIZE) {
+            continue;
+        }
+        if (mmap->length_high != 0 || length > PHYSMAP_SIZE - base) {
+            length = PHYSMAP_SIZE - base;
+        }
+        *start = (base + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+        *end = (base + length) & ~(FRAME_SIZE - 1);
+        if (*start < *end) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * keep a range of physical memory out of the allocator
+ *
+ * a range that overlaps or touches one already kept out is merged into it,
+ * so modules loaded back to back take one slot
+ *
+ * @return 0 on success, -1 if MAX_RESERVED separate ranges are kept out
+ */
+static int32_t reserve_range(uint32_t start, uint32_t end) {
+    uint32_t i;
+
+    start &= ~(FRAME_SIZE - 1);
+    end = (end + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    for (i = 0; i < num_reserved; i++) {
+        if (start <= reserved_end[i] && reserved_start[i] <= end) {
+            if (start < reserved_start[i]) {
+                reserved_start[i] = start;
+            }
+            if (end > reserved_end[i]) {
+                reserved_end[i] = end;
+            }
+            return 0;
+        }
+    }
+    if (num_reserved == MAX_RESERVED) {
+        return -1;
+    }
+    reserved_start[num_reserved] = start;
+    reserved_end[num_reserved] = end;
+    num_reserved++;
+    return 0;
+}
+
+/**
+ * find size bytes of usable memory that overlap no reserved range
+ *
+ * @return physical address of the range, or 0 if there is none
+ */
+static uint32_t find_range(multiboot_info_t *mbi, uint32_t size) {
+    uint32_t pos = 0;
+    uint32_t start, end;
+    uint32_t i;
+    int32_t moved;
+
+    size = (size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    while (mmap_next(mbi, &pos, &start, &end) == 0) {
+        // skip past reserved ranges until nothing overlaps
+        do {
+            moved = 0;
+            for (i = 0; i < num_reserved; i++) {
+                if (start < reserved_end[i] && reserved_start[i] < start + size) {
+                    start = reserved_end[i];
+                    moved = 1;
+                }
+            }
+        } while (moved && start < end);
+        if (start < end && size <= end - start) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+/**
+ * hand a range from the memory map to the allocator, minus the parts that an
+ * earlier range already covered, since memory map entries may overlap
+ *
+ * @param limit mmap_next's position just past this range; ranges it returns
+ * before reaching limit are the earlier ones
+ */
+static void free_mmap_range(multiboot_info_t *mbi, uint32_t limit,
+        uint32_t start, uint32_t end) {
+    uint32_t pos = 0;
+    uint32_t prev_start, prev_end;
+
+    while (mmap_next(mbi, &pos, &prev_start, &prev_end) == 0 && pos < limit) {
+        if (start < prev_end && prev_start < end) {
+            if (start < prev_start) {
+                free_mmap_range(mbi, limit, start, prev_start);
+            }
+            if (prev_end < end) {
+                free_mmap_range(mbi, limit, prev_end, end);
+            }
+            return;
+        }
+    }
+    free_range(start, end);
+}
+
+/**
+ * hand a range of usable memory to the allocator, minus any reserved parts
+ *
+ * the range is split into the largest naturally aligned blocks that fit
+ */
+static void free_range(uint32_t start, uint32_t end) {
+    uint32_t i;
+    uint32_t order;
+
+    for (i = 0; i < num_reserved; i++) {
+        if (start < reserved_end[i] && reserved_start[i] < end) {
+            if (start < reserved_start[i]) {
+                free_range(start, reserved_start[i]);
+            }
+            if (reserved_end[i] < end) {
+                free_range(reserved_end[i], end);
+            }
+            return;
+        }
+    }
+
+    while (start < end) {
+        order = FRAME_MAX_ORDER;
+        while ((start & ((FRAME_SIZE << order) - 1)) != 0 ||
+                (FRAME_SIZE << order) > end - start) {
+            order--;
+        }
+        release_block(start >> FRAME_SHIFT, order);
+        start += FRAME_SIZE << order;
+    }
+}
+
+/**
+ * mark a block free and put it on the list for its zone and order
+ */
+static void free_list_push(uint32_t index, uint32_t order) {
+    free_block_t *block = phys_to_virt(index << FRAME_SHIFT);
+    free_block_t **list = &free_lists[frame_zone(index)][order];
+
+    frames[index].flags |= FRAME_FREE;
+    frames[index].order = order;
+    block->prev = NULL;
+    block->next = *list;
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    *list = block;
+}
+
+/**
+ * give a block back to the free lists, merging it with its buddy for as long
+ * as the buddy is free and whole
+ */
+static void release_block(uint32_t index, uint32_t order) {
+    uint32_t buddy;
+
+    frames[index].refs = 0;
+    num_free += 1 << order;
+    while (order < FRAME_MAX_ORDER) {
+        buddy = index ^ (1 << order);
+        if (buddy + (1 << order) > num_frames ||
+                !(frames[buddy].flags & FRAME_FREE) ||
+                frames[buddy].order != order) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        index &= ~(1 << order);
+        order++;
+    }
+    free_list_push(index, order);
+}
+
+/**
+ * take a free block off the list for its zone and order
+ */
+static void free_list_remove(uint32_t index, uint32_t order) {
+    free_block_t *block = phys_to_virt(index << FRAME_SHIFT);
+
+    frames[index].flags &= ~FRAME_FREE;
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[frame_zone(index)][order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+}
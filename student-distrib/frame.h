@@ -0,0 +1,47 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include "types.h"
+#include "lib.h"
+#include "multiboot.h"
+
+// physical memory is mapped linearly into every address space from here
+#define PHYSMAP_BASE 0xC0000000
+// the most physical memory the physmap (and so the frame allocator) covers
+#define PHYSMAP_SIZE MB(1024)
+
+#define FRAME_SHIFT 12
+#define FRAME_SIZE (1 << FRAME_SHIFT)
+
+// blocks of 2^order frames are handed out; 4MB is the largest
+#define FRAME_ORDER_4KB 0
+#define FRAME_ORDER_4MB 10
+#define FRAME_MAX_ORDER FRAME_ORDER_4MB
+
+// everything below this (kernel image, and the kernel's own PCB and stack) is never
+// handed out
+#define FRAME_RESERVED_END MB(8)
+
+// ISA DMA can only reach memory below this; frames under it make up the DMA
+// zone, which other allocations only fall back on
+#define FRAME_DMA_LIMIT MB(16)
+
+// age of a frame that was just allocated or used (see frame_age)
+#define FRAME_AGE_NEW 0x80
+
+// convert between physical addresses and their physmap addresses
+#define phys_to_virt(addr) ((void*) ((uint32_t) (addr) + PHYSMAP_BASE))
+#define virt_to_phys(addr) ((uint32_t) (addr) - PHYSMAP_BASE)
+
+int32_t init_frames(multiboot_info_t *mbi);
+uint32_t frame_alloc(uint32_t order);
+uint32_t frame_alloc_dma(uint32_t order);
+void frame_free(uint32_t addr, uint32_t order);
+void frame_ref(uint32_t addr);
+uint32_t frame_refs(uint32_t addr);
+uint32_t frame_age(uint32_t addr, uint32_t used);
+uint32_t frames_free(void);
+uint32_t frames_total(void);
+
+#endif /* _FRAME_H */
@@ -5,6 +5,8 @@
 #include "lib.h"
 #include "fs.h"
 #include "mem.h"
+#include "uaccess.h"
+#include "spinlock.h"
 
 uint32_t get_num_dentries(void);
 uint32_t get_num_inodes(void);
@@ -17,21 +19,208 @@ static inode_t *inodes;
 static dentry_t *dentries;
 static data_block_t *data_blocks;
 
+// the filename index: chains of dentry indices by the hash of their names,
+// linked through dentry_next and ending in -1
+static int16_t dentry_buckets[DENTRY_HASH_SIZE];
+static int16_t dentry_next[MAX_DENTRIES];
+
+/**
+ * a run of a file's blocks that are also next to each other in the file
+ * system
+ */
+typedef struct extent {
+    // index of the first block in the file
+    uint32_t file_block;
+    // the data block it is stored in
+    uint32_t data_block;
+    uint32_t count;
+} extent_t;
+
+/**
+ * a file's blocks, validated and collapsed into extents
+ */
+typedef struct extent_map {
+    // blocks from the start of the file that are valid; reads past them fail
+    uint32_t valid_blocks;
+    uint32_t num_extents;
+    extent_t extents[0];
+} extent_map_t;
+
+// brings in data blocks that are not in memory yet; NULL if all of them are
+static fs_loader_t fs_loader;
+
+// extent maps by inode index, built on the first read of each file
+static extent_map_t **extent_maps;
+static uint32_t num_extent_maps;
+
+static uint32_t hash_name(const uint8_t *name);
+static void dentry_index_add(uint32_t index);
+static int32_t load(const void *addr, uint32_t length);
+static extent_map_t *get_extent_map(inode_t *inode);
+static uint32_t collect_extents(inode_t *inode, extent_t *extents,
+        uint32_t *valid_blocks);
+static const extent_t *find_extent(const extent_map_t *map, uint32_t block);
+
+// NUL-terminated names handed out by get_executables
+kmem_cache_t *filename_cache;
+
+/**
+ * Check file system image
+ * Used before mounting an image of (size) bytes at (addr), such as a module
+ *   from the boot loader: the boot block, inodes and data blocks it claims
+ *   have to fit.
+ *
+ * Returns 0 if the image looks valid, -1 otherwise
+ */
+int32_t fs_image_valid(uint32_t addr, uint32_t size)
+{
+    master_entry_t *master_entry = (master_entry_t*)addr;
+    uint32_t blocks = size / sizeof(data_block_t);
+
+    // every image has at least its "." entry
+    if(size < sizeof(bootblock_t) || master_entry->num_dentries == 0 ||
+            master_entry->num_dentries > MAX_DENTRIES ||
+            master_entry->num_inodes >= blocks ||
+            master_entry->num_data_blocks >= blocks ||
+            1 + master_entry->num_inodes + master_entry->num_data_blocks > blocks)
+    {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Set file system starting address
  * Used for setting the start of the file system in memory.
- * This exists because we load the fs as a module in GRUB.
+ * This exists because we load the fs as a module in GRUB (or read it from
+ *   the floppy when there is no module).
  */
 void set_fs_start(uint32_t addr)
 {
+    uint32_t num_dentries;
+    uint32_t i;
+
     fs_start = addr;
+    fs_loader = NULL;
     inodes = (inode_t*) (fs_start + sizeof(bootblock_t));
     dentries = (dentry_t*) (fs_start + sizeof(master_entry_t));
     data_blocks = (data_block_t*) (fs_start + sizeof(bootblock_t) +
             get_num_inodes() * sizeof(inode_t));
+    if (filename_cache == NULL) {
+        filename_cache = kmem_cache_create("filename", NAME_MAX + 1, NULL);
+    }
+
+    // maps of the previous file system, if any, no longer apply
+    for (i = 0; i < num_extent_maps; i++) {
+        if (extent_maps[i] != NULL) {
+            kfree(extent_maps[i]);
+        }
+    }
+    if (extent_maps != NULL) {
+        kfree(extent_maps);
+    }
+    num_extent_maps = get_num_inodes();
+    extent_maps = kzalloc(num_extent_maps * sizeof(extent_map_t *));
+    if (extent_maps == NULL) {
+        num_extent_maps = 0;
+    }
+
+    for (i = 0; i < DENTRY_HASH_SIZE; i++) {
+        dentry_buckets[i] = -1;
+    }
+    num_dentries = get_num_dentries();
+    if (num_dentries > MAX_DENTRIES) {
+        num_dentries = MAX_DENTRIES;
+    }
+    // add them backwards, so the first of any duplicate names is found first
+    for (i = num_dentries; i > 0; i--) {
+        dentry_index_add(i - 1);
+    }
     return;
 }
 
+/**
+ * Set file system loader
+ * Used when only the metadata of the file system (the boot block and the
+ *   inodes) is in memory after set_fs_start; data blocks are brought in
+ *   through the loader before they are read or mapped.
+ */
+void set_fs_loader(fs_loader_t loader)
+{
+    fs_loader = loader;
+}
+
+/**
+ * Load file
+ * Brings every data block of a file into memory, for readers that cannot
+ *   wait for them later (such as an interrupt handler).
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int32_t fs_load_file(inode_t *inode)
+{
+    const extent_map_t *map;
+    uint32_t i;
+
+    if(inode == NULL || (map = get_extent_map(inode)) == NULL)
+    {
+        return -1;
+    }
+    for(i = 0; i < map->num_extents; i++)
+    {
+        if(load(&data_blocks[map->extents[i].data_block],
+                    map->extents[i].count * sizeof(data_block_t)) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * bring part of the file system image into memory through the loader
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int32_t load(const void *addr, uint32_t length)
+{
+    if(fs_loader == NULL)
+    {
+        return 0;
+    }
+    return fs_loader((uint32_t)addr - fs_start, length);
+}
+
+/**
+ * add a dentry to the filename index, which set_fs_start builds once; the
+ * image is read-only, so it never changes after that
+ *
+ * @param index index of the dentry
+ */
+static void dentry_index_add(uint32_t index)
+{
+    uint32_t bucket = hash_name(dentries[index].name);
+
+    dentry_next[index] = dentry_buckets[bucket];
+    dentry_buckets[bucket] = index;
+}
+
+/**
+ * FNV-1a hash of a filename, which ends at a NUL or after NAME_MAX bytes
+ *
+ * @return a bucket of the filename index
+ */
+static uint32_t hash_name(const uint8_t *name)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < NAME_MAX && name[i] != '\0'; i++) {
+        hash = (hash ^ name[i]) * 16777619u;
+    }
+    return hash & (DENTRY_HASH_SIZE - 1);
+}
+
 inode_t *get_inode_ptr(uint32_t inode) {
     return inodes + inode;
 }
@@ -55,37 +244,51 @@ int32_t fs_write(file_info_t *file, const int8_t* buf, int32_t nbytes)
 }
 
 /**
- * Read dentry by name
- * Takes a file name (fname) and finds the dentry with that name.
- *   The dentry is copied into the dentry passed by pointer.
+ * Find dentry
+ * Takes a file name (fname) and looks up the dentry with that name in the
+ *   filename index.
  *
- * Returns 0 on success, -1 on failure
+ * Returns a pointer to the dentry, NULL if there is none
  */
-int32_t read_dentry_by_name(const uint8_t* fname, dentry_t* dentry)
+const dentry_t *find_dentry(const uint8_t* fname)
 {
-    dentry_t tmp_dentry;
-    uint32_t num_dentries = get_num_dentries();
-    uint32_t i;
-    uint32_t bucket;
-    
+    uint32_t length;
+    int16_t i;
+
     //check for valid file name size
-    bucket = strlen((int8_t*)fname);
-    if(bucket < 1 || bucket > NAME_MAX)
+    length = strlen((int8_t*)fname);
+    if(length < 1 || length > NAME_MAX)
     {
-        return -1;
+        return NULL;
     }
 
-    //check if file with fname exists
-    for(i = 0; i < num_dentries; i++)
+    for(i = dentry_buckets[hash_name(fname)]; i != -1; i = dentry_next[(uint32_t)i])
     {
-        bucket = read_dentry_by_index(i, &tmp_dentry);
-        if(strncmp((int8_t*)fname, (int8_t*)tmp_dentry.name, NAME_MAX) == 0)
+        if(strncmp((int8_t*)fname, (int8_t*)dentries[(uint32_t)i].name, NAME_MAX) == 0)
         {
-            *dentry = tmp_dentry;
-            return 0;
+            return &dentries[(uint32_t)i];
         }
     }
-    return -1;
+    return NULL;
+}
+
+/**
+ * Read dentry by name
+ * Takes a file name (fname) and finds the dentry with that name.
+ *   The dentry is copied into the dentry passed by pointer.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int32_t read_dentry_by_name(const uint8_t* fname, dentry_t* dentry)
+{
+    const dentry_t *found = find_dentry(fname);
+
+    if(found == NULL)
+    {
+        return -1;
+    }
+    *dentry = *found;
+    return 0;
 }
 
 /**
@@ -107,28 +310,27 @@ int32_t read_dentry_by_index(uint32_t index, dentry_t* dentry)
 /**
  * Read data
  * Reads (length) bytes from the file with inode index (inode) starting from (offset)
- *   bytes. The data is copied into (buf), a string pointer.
+ *   bytes. The data is copied into (buf), a string pointer, which may be a
+ *   user buffer, with one copy per extent of contiguous blocks.
  *
- * Returns the number of bytes read, -1 on failure
+ * Returns the number of bytes read, -1 on failure (including a bad buf, and
+ *   a range that reaches a block outside the file system)
  */
 int32_t read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length)
 {
     inode_t* inode_ptr = (inode_t*) inode;
+    const extent_map_t *map;
+    const extent_t *extent;
     uint8_t* byte_ptr;
     uint32_t file_length;
     uint32_t copied_length = 0;
     uint32_t cur_block;
-    uint32_t bytes_left_in_block;
+    uint32_t extent_end;
     uint32_t n;
     file_length = inode_ptr->length;
-    // check that file isn't too long to be stored in the inode's data_blocks
-    if (file_length / 4096 > 1023)
-    {
-        return -1;
-    }
     // if offset is longer than file, then there is nothing to read
     // (better to get this out of the way, to remove 'negative' cases)
-    if(offset > file_length)
+    if(offset > file_length || length <= 0)
     {
         return 0;
     }
@@ -137,49 +339,167 @@ int32_t read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length)
     {
         length = file_length - offset;
     }
-    // length- amount of bytes left to read
-    // offset- current position in file
-    // cur_block- current block that offset is within
-    // byte_ptr- pointer to the first byte to copy in this iteration
-    // bytes_left_in_block- how many bytes are left in current block
-    // n- number of bytes to copy in this iteration
+    if(length == 0)
+    {
+        return 0;
+    }
+    // every block of the range has to be within the file system
+    map = get_extent_map(inode_ptr);
+    if(map == NULL || (offset + length - 1) / 4096 >= map->valid_blocks)
+    {
+        return -1;
+    }
+
+    cur_block = offset / 4096;
+    extent = find_extent(map, cur_block);
     while(length > 0)
     {
-        cur_block = offset / 4096;
-        // check if current block is within the valid range for the
-        //   whole file system. if not, there is a serious problem.
-        if(inode_ptr->data_blocks[cur_block] >= get_num_data_blocks())
+        byte_ptr = (uint8_t*) &data_blocks[extent->data_block +
+            (cur_block - extent->file_block)] + (offset % 4096);
+        // copy up to the end of the extent
+        extent_end = (extent->file_block + extent->count) * 4096;
+        n = (length > extent_end - offset) ? extent_end - offset : length;
+        if(load(byte_ptr, n) != 0 || copy_to_user(buf, byte_ptr, n) != 0)
         {
             return -1;
         }
-        byte_ptr = (uint8_t*) &data_blocks[inode_ptr->data_blocks[cur_block]]
-            + (offset % 4096);
-        bytes_left_in_block = 4096 - (offset % 4096);
-        // if there are more bytes to copy than there are bytes left in the
-        //   block, than just copy what's left in the block.
-        // else copy remainder of (length)
-        n = (length > bytes_left_in_block)?bytes_left_in_block:length;
-        memcpy(buf, byte_ptr, n); 
-        // update the amount of bytes left to copy
         length -= n;
-        // update the total amount of bytes copied
         copied_length += n;
-        // update the position of the buffer (which is copied to)
         buf += n;
-        // update the current offset into the file
         offset += n;
+        cur_block = offset / 4096;
+        extent++;
     }
     return copied_length;
 }
 
+/**
+ * Get extent map
+ * Finds the extent map of a file, building it on first use. The image is
+ *   read-only, so a map stays valid until set_fs_start mounts another one.
+ *
+ * Returns the map, NULL if the inode is not in the file system or memory
+ *   ran out
+ */
+static extent_map_t *get_extent_map(inode_t *inode)
+{
+    uint32_t index = inode - inodes;
+    extent_map_t *map;
+    uint32_t num_extents;
+    uint32_t flags;
+
+    if(index >= num_extent_maps)
+    {
+        return NULL;
+    }
+    block_interrupts(&flags);
+    map = extent_maps[index];
+    if(map == NULL)
+    {
+        num_extents = collect_extents(inode, NULL, NULL);
+        map = kmalloc(sizeof(extent_map_t) + num_extents * sizeof(extent_t));
+        if(map != NULL)
+        {
+            map->num_extents = collect_extents(inode, map->extents,
+                    &map->valid_blocks);
+            extent_maps[index] = map;
+        }
+    }
+    restore_interrupts(flags);
+    return map;
+}
+
+/**
+ * Collect extents
+ * Walks the block list of a file up to its first block outside the file
+ *   system, and collapses runs of consecutive data blocks into extents.
+ *
+ * Returns the number of extents; fills in extents and valid_blocks unless
+ *   they are NULL
+ */
+static uint32_t collect_extents(inode_t *inode, extent_t *extents,
+        uint32_t *valid_blocks)
+{
+    uint32_t num_data_blocks = get_num_data_blocks();
+    uint32_t num_blocks = (inode->length + 4095) / 4096;
+    uint32_t num_extents = 0;
+    uint32_t block;
+    uint32_t i;
+
+    if(num_blocks > INODE_MAX_BLOCKS)
+    {
+        num_blocks = INODE_MAX_BLOCKS;
+    }
+    for(i = 0; i < num_blocks; i++)
+    {
+        block = inode->data_blocks[i];
+        if(block >= num_data_blocks)
+        {
+            break;
+        }
+        if(i > 0 && block == inode->data_blocks[i - 1] + 1)
+        {
+            if(extents != NULL)
+            {
+                extents[num_extents - 1].count++;
+            }
+            continue;
+        }
+        if(extents != NULL)
+        {
+            extents[num_extents].file_block = i;
+            extents[num_extents].data_block = block;
+            extents[num_extents].count = 1;
+        }
+        num_extents++;
+    }
+    if(valid_blocks != NULL)
+    {
+        *valid_blocks = i;
+    }
+    return num_extents;
+}
+
+/**
+ * Find extent
+ * Binary search for the extent holding a block of a file, which has to be
+ *   one of its valid blocks.
+ */
+static const extent_t *find_extent(const extent_map_t *map, uint32_t block)
+{
+    uint32_t low = 0;
+    uint32_t high = map->num_extents - 1;
+    uint32_t mid;
+
+    while(low < high)
+    {
+        mid = (low + high + 1) / 2;
+        if(map->extents[mid].file_block <= block)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return &map->extents[low];
+}
+
 int32_t file_read(file_info_t *file, uint8_t *buf, int32_t length) {
     int32_t bytes_read = read_data(file->inode_ptr, file->pos, buf, length);
-    file->pos += bytes_read;
+    if (bytes_read > 0) {
+        file->pos += bytes_read;
+    }
     return bytes_read;
 }
 
 /**
  * read a filename by index from the directory
+ *
+ * the name is padded with zeros up to length; buf may be a user buffer
+ *
+ * @return length of the name, 0 past the last entry, -1 if buf is bad
  */
 int32_t read_directory_index(int32_t filenum, uint8_t* buf, int32_t length) {
     uint32_t num_dentries = get_num_dentries();
@@ -187,13 +507,14 @@ int32_t read_directory_index(int32_t filenum, uint8_t* buf, int32_t length) {
     if (filenum >= num_dentries) {
         return 0;
     }
-    int32_t i;
-    for (i = 0; dentries[filenum].name[i]; i++) {
-        buf[i] = dentries[filenum].name[i];
+    int32_t bytes_read = 0;
+    while (bytes_read < NAME_MAX && bytes_read < length &&
+            dentries[filenum].name[bytes_read]) {
+        bytes_read++;
     }
-    int32_t bytes_read = i;
-    while (i < length) {
-        buf[i++] = '\0';
+    if (copy_to_user(buf, dentries[filenum].name, bytes_read) != 0 ||
+            clear_user(buf + bytes_read, length - bytes_read) != 0) {
+        return -1;
     }
     return bytes_read;
 }
@@ -213,7 +534,9 @@ int32_t directory_read(file_info_t *file, uint8_t* buf, int32_t length)
 /**
  * get a list of executables in the directory
  *
- * allocates memory which the caller should free
+ * allocates the names from filename_cache, NUL-terminated even when a name
+ * takes up all NAME_MAX bytes of its dentry; the caller should give them back
+ * with kmem_cache_free
  *
  * @param dir an array of pointers which will be set to the file names
  * @num_files maximum number of files (ie, the size of dir)
@@ -223,17 +546,17 @@ int32_t get_executables(char** dir, int32_t num_files) {
     int filenum;
     int32_t bytes_read;
     for (filenum = 0; filenum < num_files; filenum++) {
-        dir[filenum] = kmalloc(NAME_MAX);
+        dir[filenum] = kmem_cache_alloc(filename_cache);
         if (dir[filenum] == NULL) {
-            filenum--;
             break;
         }
         bytes_read = read_directory_index(filenum, (uint8_t*) dir[filenum], NAME_MAX);
-        if (bytes_read == 0) {
-            kfree(dir[filenum]);
+        if (bytes_read <= 0) {
+            kmem_cache_free(filename_cache, dir[filenum]);
             dir[filenum] = NULL;
             break;
         }
+        dir[filenum][bytes_read] = '\0';
     }
     return filenum;
 }
@@ -284,6 +607,27 @@ uint32_t get_num_inodes(void)
  *
  * Returns number of data blocks
  */
+/**
+ * Get the data block holding part of a file
+ * Used to map file data in place instead of copying it.
+ *
+ * Returns a pointer to the data block with the given index in the file, or
+ * NULL if the file has no such block
+ */
+data_block_t *get_data_block(inode_t *inode, uint32_t index)
+{
+    if(index > 1022 || index >= (inode->length + 4095) / 4096 ||
+            inode->data_blocks[index] >= get_num_data_blocks())
+    {
+        return NULL;
+    }
+    if(load(&data_blocks[inode->data_blocks[index]], sizeof(data_block_t)) != 0)
+    {
+        return NULL;
+    }
+    return &data_blocks[inode->data_blocks[index]];
+}
+
 uint32_t get_num_data_blocks(void)
 {
     master_entry_t* bblock = get_master_entry_addr();
@@ -6,8 +6,15 @@
 #define __FS_H
 
 #include "types.h"
+#include "slab.h"
 
 #define NAME_MAX 32
+// dentries that fit in the boot block
+#define MAX_DENTRIES 63
+// buckets of the filename index; a power of two
+#define DENTRY_HASH_SIZE 64
+// data blocks an inode can list
+#define INODE_MAX_BLOCKS 1023
 
 typedef struct master_entry {
     uint32_t num_dentries;
@@ -25,7 +32,7 @@ typedef struct dentry {
 
 typedef struct inode {
     uint32_t length;
-    uint32_t data_blocks[1023];
+    uint32_t data_blocks[INODE_MAX_BLOCKS];
 } inode_t;
 
 typedef struct data_block {
@@ -34,7 +41,7 @@ typedef struct data_block {
 
 typedef struct bootblock {
     master_entry_t master_entry;
-    dentry_t dentry[63];
+    dentry_t dentry[MAX_DENTRIES];
 } bootblock_t;
 
 
@@ -43,6 +50,7 @@ enum file_type {
     FileTerminal = 1,
     FileRegular = 2,
     FileDirectory = 3,
+    FileEFS = 4,
 };
 
 #define DENTRY_RTC 0
@@ -51,6 +59,12 @@ enum file_type {
 
 struct file_info;
 
+/**
+ * brings bytes of the file system image, from an offset, into memory if they
+ * are not there yet; returns 0 on success, -1 on failure
+ */
+typedef int32_t (*fs_loader_t)(uint32_t offset, uint32_t length);
+
 typedef struct file_ops {
     int32_t (*read_func)(struct file_info *, uint8_t*, int32_t);
     int32_t (*write_func)(struct file_info *, const int8_t*, int32_t);
@@ -76,6 +90,7 @@ typedef struct file_info {
 } file_info_t;
 
 
+const dentry_t *find_dentry(const uint8_t* fname);
 int32_t read_dentry_by_name(const uint8_t* fname, dentry_t* dentry);
 int32_t read_dentry_by_index(uint32_t index, dentry_t* dentry);
 int32_t read_data(void* inode, uint32_t offset, uint8_t* buf, int32_t length);
@@ -83,8 +98,13 @@ int32_t read_directory_index(int32_t filenum, uint8_t* buf, int32_t length);
 int32_t file_read(file_info_t *file, uint8_t *buf, int32_t length);
 int32_t directory_read(file_info_t *file, uint8_t* buf, int32_t length);
 int32_t get_executables(char** dir, int32_t num_files);
+extern kmem_cache_t *filename_cache;
+int32_t fs_image_valid(uint32_t addr, uint32_t size);
 void set_fs_start(uint32_t addr);
+void set_fs_loader(fs_loader_t loader);
+int32_t fs_load_file(inode_t *inode);
 inode_t * get_inode_ptr(uint32_t inode);
+data_block_t *get_data_block(inode_t *inode, uint32_t index);
 int32_t fs_open(void);
 int32_t fs_close(file_info_t *file);
 int32_t fs_write(file_info_t*, const int8_t*, int32_t);
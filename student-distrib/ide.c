@@ -0,0 +1,206 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "ide.h"
+#include "lib.h"
+
+/**
+ * @file ide.c
+ *
+ * @brief polled ATA driver for a drive on the primary IDE bus
+ *
+ * Sectors are moved with PIO and 28-bit LBA addressing, and the driver waits
+ * on the status register rather than IRQ 14, so it can be used with
+ * interrupts off (from the page fault handler, say). Only one drive is used
+ * at a time: the one given to ide_init.
+ */
+
+// status register bits
+#define STATUS_ERR 0x01
+#define STATUS_DRQ 0x08
+#define STATUS_DF 0x20
+#define STATUS_BSY 0x80
+
+// device control register: no interrupts from the drive
+#define CTRL_NIEN 0x02
+
+// drive register: LBA addressing, and the drive select bit
+#define DRIVE_LBA 0xE0
+#define DRIVE_SLAVE 0x10
+
+// the most sectors one command moves (a count of 0 means 256)
+#define MAX_SECTORS_PER_CMD 256
+
+// words of IDENTIFY data holding the number of LBA28 sectors
+#define IDENTIFY_SECTORS 60
+
+// the drive in use, or -1 if none was found
+static int32_t ide_drive = -1;
+static uint32_t ide_num_sectors;
+
+// Forward declarations
+static int32_t ide_wait(uint32_t drq);
+static void ide_select(uint32_t lba, uint32_t count);
+
+/**
+ * find a drive on the primary bus and get its size
+ *
+ * @param drive IDE_MASTER or IDE_SLAVE
+ * @return 0 on success, -1 if there is no ATA drive there
+ */
+int32_t ide_init(uint32_t drive) {
+    uint16_t identify[IDE_SECTOR_SIZE / 2];
+    uint32_t i;
+
+    ide_drive = -1;
+    outb(CTRL_NIEN, IDE_CTRL);
+    outb(DRIVE_LBA | (drive == IDE_SLAVE ? DRIVE_SLAVE : 0),
+            IDE_REG_BASE + IDE_DRIVE);
+    outb(0, IDE_REG_BASE + IDE_SECTOR_COUNT);
+    outb(0, IDE_REG_BASE + IDE_LBA_LOW);
+    outb(0, IDE_REG_BASE + IDE_LBA_MID);
+    outb(0, IDE_REG_BASE + IDE_LBA_HIGH);
+    outb(IDE_CMD_IDENTIFY, IDE_REG_BASE + IDE_COMMAND);
+
+    // a status of 0 (or a floating bus) means nothing is attached
+    if (inb(IDE_REG_BASE + IDE_STATUS) == 0 ||
+            inb(IDE_REG_BASE + IDE_STATUS) == 0xFF) {
+        return -1;
+    }
+    while (inb(IDE_REG_BASE + IDE_STATUS) & STATUS_BSY) {}
+    // ATAPI and SATA devices answer with a signature here
+    if (inb(IDE_REG_BASE + IDE_LBA_MID) != 0 ||
+            inb(IDE_REG_BASE + IDE_LBA_HIGH) != 0) {
+        return -1;
+    }
+    if (ide_wait(1) != 0) {
+        return -1;
+    }
+    for (i = 0; i < IDE_SECTOR_SIZE / 2; i++) {
+        identify[i] = inw(IDE_REG_BASE + IDE_DATA);
+    }
+
+    ide_num_sectors = identify[IDENTIFY_SECTORS] |
+        (identify[IDENTIFY_SECTORS + 1] << 16);
+    if (ide_num_sectors == 0) {
+        return -1;
+    }
+    ide_drive = drive;
+    return 0;
+}
+
+/**
+ * @return the size of the drive in sectors, 0 if there is none
+ */
+uint32_t ide_sectors(void) {
+    return ide_drive < 0 ? 0 : ide_num_sectors;
+}
+
+/**
+ * read sectors from the drive
+ *
+ * @param lba first sector
+ * @param buf where to put them
+ * @param count number of sectors
+ * @return 0 on success, -1 if there is no drive, the range is past its end or
+ * the drive reported an error
+ */
+int32_t ide_read(uint32_t lba, uint8_t *buf, uint32_t count) {
+    uint16_t *words = (uint16_t*) buf;
+    uint32_t n, i, j;
+
+    if (ide_drive < 0 || lba + count > ide_num_sectors || lba + count < lba) {
+        return -1;
+    }
+    while (count > 0) {
+        n = count < MAX_SECTORS_PER_CMD ? count : MAX_SECTORS_PER_CMD;
+        ide_select(lba, n);
+        outb(IDE_CMD_READ_SECTORS, IDE_REG_BASE + IDE_COMMAND);
+        for (i = 0; i < n; i++) {
+            if (ide_wait(1) != 0) {
+                return -1;
+            }
+            for (j = 0; j < IDE_SECTOR_SIZE / 2; j++) {
+                *words++ = inw(IDE_REG_BASE + IDE_DATA);
+            }
+        }
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/**
+ * write sectors to the drive, returning once they are on the disk
+ *
+ * @param lba first sector
+ * @param buf what to write
+ * @param count number of sectors
+ * @return 0 on success, -1 if there is no drive, the range is past its end or
+ * the drive reported an error
+ */
+int32_t ide_write(uint32_t lba, const uint8_t *buf, uint32_t count) {
+    const uint16_t *words = (const uint16_t*) buf;
+    uint32_t n, i, j;
+
+    if (ide_drive < 0 || lba + count > ide_num_sectors || lba + count < lba) {
+        return -1;
+    }
+    while (count > 0) {
+        n = count < MAX_SECTORS_PER_CMD ? count : MAX_SECTORS_PER_CMD;
+        ide_select(lba, n);
+        outb(IDE_CMD_WRITE_SECTORS, IDE_REG_BASE + IDE_COMMAND);
+        for (i = 0; i < n; i++) {
+            if (ide_wait(1) != 0) {
+                return -1;
+            }
+            for (j = 0; j < IDE_SECTOR_SIZE / 2; j++) {
+                outw(*words++, IDE_REG_BASE + IDE_DATA);
+            }
+        }
+        lba += n;
+        count -= n;
+    }
+    outb(IDE_CMD_FLUSH_CACHE, IDE_REG_BASE + IDE_COMMAND);
+    return ide_wait(0);
+}
+
+/**
+ * wait for the drive to finish what it is doing
+ *
+ * @param drq whether to also wait for it to be ready to move data
+ * @return 0 on success, -1 if it reported an error
+ */
+static int32_t ide_wait(uint32_t drq) {
+    uint32_t status;
+
+    // reading the alternate status first gives the drive its 400ns
+    inb(IDE_CTRL);
+    inb(IDE_CTRL);
+    inb(IDE_CTRL);
+    inb(IDE_CTRL);
+    while (1) {
+        status = inb(IDE_REG_BASE + IDE_STATUS);
+        // the other bits mean nothing while the drive is busy
+        if (status & STATUS_BSY) {
+            continue;
+        }
+        if (status & (STATUS_ERR | STATUS_DF)) {
+            return -1;
+        }
+        if (!drq || (status & STATUS_DRQ)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * load the drive, address and count registers for a read or write
+ */
+static void ide_select(uint32_t lba, uint32_t count) {
+    outb(DRIVE_LBA | (ide_drive == IDE_SLAVE ? DRIVE_SLAVE : 0) |
+            ((lba >> 24) & 0x0F), IDE_REG_BASE + IDE_DRIVE);
+    // a count of 0 asks for MAX_SECTORS_PER_CMD
+    outb(count & 0xFF, IDE_REG_BASE + IDE_SECTOR_COUNT);
+    outb(lba & 0xFF, IDE_REG_BASE + IDE_LBA_LOW);
+    outb((lba >> 8) & 0xFF, IDE_REG_BASE + IDE_LBA_MID);
+    outb((lba >> 16) & 0xFF, IDE_REG_BASE + IDE_LBA_HIGH);
+}
@@ -0,0 +1,42 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _IDE_H
+#define _IDE_H
+
+#include "types.h"
+
+// ports of the primary ATA bus
+#define IDE_REG_BASE 0x1F0
+#define IDE_CTRL 0x3F6
+
+#define IDE_SECTOR_SIZE 512
+
+// registers, as offsets from IDE_REG_BASE
+enum ide_registers {
+    IDE_DATA = 0,
+    IDE_ERROR = 1,
+    IDE_SECTOR_COUNT = 2,
+    IDE_LBA_LOW = 3,
+    IDE_LBA_MID = 4,
+    IDE_LBA_HIGH = 5,
+    IDE_DRIVE = 6,
+    IDE_STATUS = 7,
+    IDE_COMMAND = 7
+};
+
+enum ide_commands {
+    IDE_CMD_READ_SECTORS = 0x20,
+    IDE_CMD_WRITE_SECTORS = 0x30,
+    IDE_CMD_FLUSH_CACHE = 0xE7,
+    IDE_CMD_IDENTIFY = 0xEC
+};
+
+// drives on the bus
+#define IDE_MASTER 0
+#define IDE_SLAVE 1
+
+int32_t ide_init(uint32_t drive);
+uint32_t ide_sectors(void);
+int32_t ide_read(uint32_t lba, uint8_t *buf, uint32_t count);
+int32_t ide_write(uint32_t lba, const uint8_t *buf, uint32_t count);
+
+#endif /* _IDE_H */
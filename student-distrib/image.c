@@ -0,0 +1,337 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "image.h"
+#include "x86_desc.h"
+#include "paging.h"
+#include "frame.h"
+#include "mem.h"
+#include "spinlock.h"
+#include "swap.h"
+
+/**
+ * @file image.c
+ *
+ * @brief executables shared between the processes running them
+ *
+ * The first process to run a file parses its ELF program headers into an
+ * image_t; later ones find it on the list of open images and take another
+ * reference. The whole file is read into memory when it is opened, so the
+ * page fault handler (image_page_in), which brings the pages in, never waits
+ * for the disk. A page that only holds read-only segments is copied from the
+ * file the first time any process touches it and then mapped read-only into
+ * every process that touches it later, with a frame reference per mapping.
+ * Pages holding writable data get a private copy in each process.
+ *
+ * The user runtime (the support library and system call wrappers, see
+ * syscalls/Makefile) is an image too. It is linked to run below where
+ * programs start, opened once at boot, and paged into every process the same
+ * way, so its code is shared by all of them.
+ */
+
+// size of the ELF header
+#define ELF_HEADER_SIZE 52
+// magic number at the start of the ELF header
+#define ELF_MAGIC 0x464c457f
+// fields of the ELF header
+#define ELF_ENTRY 24
+#define ELF_PHOFF 28
+#define ELF_PHENTSIZE 42
+#define ELF_PHNUM 44
+// fields of an ELF program header
+#define ELF_PH_TYPE 0
+#define ELF_PH_OFFSET 4
+#define ELF_PH_VADDR 8
+#define ELF_PH_FILESZ 16
+#define ELF_PH_MEMSZ 20
+#define ELF_PH_FLAGS 24
+#define ELF_PH_SIZE 32
+// program header type of a loadable segment, and its writable flag
+#define ELF_PT_LOAD 1
+#define ELF_PF_W 0x2
+
+// the user runtime, and the end of the room it has below programs, which
+// are linked to start at 0x08048000
+#define RUNTIME_FILE "libece391"
+#define RUNTIME_LIMIT (USER_BASE + KB(288))
+
+// images in use by at least one process
+static image_t *images = NULL;
+
+// the user runtime, or NULL if the file system has none
+image_t *runtime_image = NULL;
+
+// Forward declarations
+static int32_t image_parse(image_t *image);
+static int32_t image_fill(image_t *image, uint8_t *buf, uint32_t page);
+
+/**
+ * open the user runtime, which stays open for good
+ *
+ * @return 0 on success, -1 if there is no valid runtime below RUNTIME_LIMIT
+ * (programs then have to carry their own copy of the library)
+ */
+int32_t init_runtime(void) {
+    const dentry_t *dentry = find_dentry((uint8_t*) RUNTIME_FILE);
+    image_t *image;
+
+    if (dentry == NULL || dentry->type != DENTRY_FILE) {
+        return -1;
+    }
+    image = image_open(get_inode_ptr(dentry->inode));
+    if (image == NULL) {
+        return -1;
+    }
+    if (image->end > RUNTIME_LIMIT) {
+        image_close(image);
+        return -1;
+    }
+    runtime_image = image;
+    return 0;
+}
+
+/**
+ * get the image of an executable, parsing it if no process is running it yet
+ *
+ * @param inode the executable's file
+ * @return the image, with a reference for the caller, or NULL if the file is
+ * not a valid executable, could not be read, or memory ran out
+ */
+image_t *image_open(inode_t *inode) {
+    image_t *image;
+    uint32_t flags;
+
+    // bring in every block of the file now, while waiting is allowed
+    if (fs_load_file(inode) != 0) {
+        return NULL;
+    }
+    block_interrupts(&flags);
+    for (image = images; image != NULL; image = image->next) {
+        if (image->inode == inode) {
+            image->refs++;
+            restore_interrupts(flags);
+            return image;
+        }
+    }
+
+    image = kzalloc(sizeof(image_t));
+    if (image == NULL) {
+        restore_interrupts(flags);
+        return NULL;
+    }
+    image->inode = inode;
+    image->refs = 1;
+    if (image_parse(image) != 0) {
+        kfree(image);
+        restore_interrupts(flags);
+        return NULL;
+    }
+    image->frames = kzalloc((image->end - image->start) / KB(4) *
+            sizeof(uint32_t));
+    if (image->frames == NULL) {
+        kfree(image);
+        restore_interrupts(flags);
+        return NULL;
+    }
+    image->next = images;
+    images = image;
+    restore_interrupts(flags);
+
+    return image;
+}
+
+/**
+ * drop a reference to an image, freeing it and its shared pages with the last
+ *
+ * @param image image returned by image_open; NULL is ignored
+ */
+void image_close(image_t *image) {
+    image_t **link;
+    uint32_t flags;
+    uint32_t i;
+
+    if (image == NULL) {
+        return;
+    }
+    block_interrupts(&flags);
+    if (--image->refs > 0) {
+        restore_interrupts(flags);
+        return;
+    }
+    for (link = &images; *link != NULL; link = &(*link)->next) {
+        if (*link == image) {
+            *link = image->next;
+            break;
+        }
+    }
+    restore_interrupts(flags);
+
+    // processes that mapped the pages hold their own references
+    for (i = 0; i < (image->end - image->start) / KB(4); i++) {
+        if (image->frames[i] != 0) {
+            frame_free(image->frames[i], FRAME_ORDER_4KB);
+        }
+    }
+    kfree(image->frames);
+    kfree(image);
+}
+
+/**
+ * map a page of an image into a process
+ *
+ * read-only pages are shared with every other process running the image;
+ * writable ones are private copies
+ *
+ * @param image the image the process is running
+ * @param pid the process
+ * @param page page-aligned virtual address
+ * @return 0 on success, -1 if no segment covers the page or memory ran out
+ */
+int32_t image_page_in(image_t *image, uint32_t pid, uint32_t page) {
+    image_segment_t *seg;
+    uint32_t covered = 0;
+    uint32_t writable = 0;
+    uint32_t frame;
+    uint32_t index;
+    uint32_t i;
+
+    if (page < image->start || page >= image->end) {
+        return -1;
+    }
+    for (i = 0; i < image->num_segments; i++) {
+        seg = &image->segments[i];
+        if (seg->vaddr < page + KB(4) && page < seg->vaddr + seg->memsz) {
+            covered = 1;
+            writable |= seg->writable;
+        }
+    }
+    if (!covered) {
+        return -1;
+    }
+
+    if (writable) {
+        frame = swap_frame_alloc();
+        if (frame == 0) {
+            return -1;
+        }
+        if (image_fill(image, phys_to_virt(frame), page) != 0) {
+            frame_free(frame, FRAME_ORDER_4KB);
+            return -1;
+        }
+        map_user_page(frame, page, pid, PAGE_WRITE);
+        return 0;
+    }
+
+    index = (page - image->start) / KB(4);
+    frame = image->frames[index];
+    if (frame == 0) {
+        frame = swap_frame_alloc();
+        if (frame == 0) {
+            return -1;
+        }
+        if (image_fill(image, phys_to_virt(frame), page) != 0) {
+            frame_free(frame, FRAME_ORDER_4KB);
+            return -1;
+        }
+        image->frames[index] = frame;
+    }
+    frame_ref(frame);
+    map_user_page(frame, page, pid, 0);
+    return 0;
+}
+
+/**
+ * read an executable's ELF header and loadable segments into its image
+ *
+ * @return 0 on success, -1 if the file is not a valid executable
+ */
+static int32_t image_parse(image_t *image) {
+    uint8_t header[ELF_HEADER_SIZE];
+    uint8_t ph[ELF_PH_SIZE];
+    uint32_t ph_offset, ph_num, ph_size;
+    image_segment_t *seg;
+    uint32_t i;
+
+    if (read_data(image->inode, 0, header, ELF_HEADER_SIZE) < ELF_HEADER_SIZE
+            || *((uint32_t*)header) != ELF_MAGIC) {
+        return -1;
+    }
+    image->entry = *((void**)(header + ELF_ENTRY));
+    image->start = USER_LIMIT;
+    image->end = USER_BASE;
+    image->num_segments = 0;
+
+    ph_offset = *((uint32_t*)(header + ELF_PHOFF));
+    ph_num = *((uint16_t*)(header + ELF_PHNUM));
+    ph_size = *((uint16_t*)(header + ELF_PHENTSIZE));
+    if (ph_size < ELF_PH_SIZE) {
+        return -1;
+    }
+    for (i = 0; i < ph_num; i++) {
+        if (read_data(image->inode, ph_offset + i * ph_size, ph, ELF_PH_SIZE)
+                < ELF_PH_SIZE) {
+            return -1;
+        }
+        if (*((uint32_t*)(ph + ELF_PH_TYPE)) != ELF_PT_LOAD) {
+            continue;
+        }
+        if (image->num_segments == IMAGE_MAX_SEGMENTS) {
+            return -1;
+        }
+        seg = &image->segments[image->num_segments];
+        seg->vaddr = *((uint32_t*)(ph + ELF_PH_VADDR));
+        seg->memsz = *((uint32_t*)(ph + ELF_PH_MEMSZ));
+        seg->offset = *((uint32_t*)(ph + ELF_PH_OFFSET));
+        seg->filesz = *((uint32_t*)(ph + ELF_PH_FILESZ));
+        seg->writable = (*((uint32_t*)(ph + ELF_PH_FLAGS)) & ELF_PF_W) != 0;
+        if (seg->vaddr < USER_BASE || seg->memsz > USER_LIMIT - seg->vaddr ||
+                seg->filesz > seg->memsz) {
+            return -1;
+        }
+        if (seg->memsz == 0) {
+            continue;
+        }
+        image->num_segments++;
+
+        if ((seg->vaddr & ~(KB(4) - 1)) < image->start) {
+            image->start = seg->vaddr & ~(KB(4) - 1);
+        }
+        if (((seg->vaddr + seg->memsz + KB(4) - 1) & ~(KB(4) - 1)) >
+                image->end) {
+            image->end = (seg->vaddr + seg->memsz + KB(4) - 1) & ~(KB(4) - 1);
+        }
+    }
+    if (image->num_segments == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * fill a page with what the image's segments put there
+ *
+ * @param buf where to write the page (a kernel address)
+ * @param page page-aligned virtual address the contents are for
+ * @return 0 on success, -1 if the file could not be read
+ */
+static int32_t image_fill(image_t *image, uint8_t *buf, uint32_t page) {
+    image_segment_t *seg;
+    uint32_t lo, hi;
+    uint32_t i;
+
+    memset(buf, 0, KB(4));
+    for (i = 0; i < image->num_segments; i++) {
+        seg = &image->segments[i];
+        lo = seg->vaddr > page ? seg->vaddr : page;
+        hi = seg->vaddr + seg->filesz;
+        if (hi > page + KB(4)) {
+            hi = page + KB(4);
+        }
+        if (lo >= hi) {
+            continue;
+        }
+        if (read_data(image->inode, seg->offset + (lo - seg->vaddr),
+                    buf + (lo - page), hi - lo) < (int32_t) (hi - lo)) {
+            return -1;
+        }
+    }
+    return 0;
+}
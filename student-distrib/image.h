@@ -0,0 +1,54 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "types.h"
+#include "fs.h"
+
+// most loadable segments an executable may have
+#define IMAGE_MAX_SEGMENTS 4
+
+/**
+ * a loadable segment of an executable
+ */
+typedef struct image_segment {
+    // where the segment goes in memory, and its size there
+    uint32_t vaddr;
+    uint32_t memsz;
+    // where its contents are in the file, and how many bytes there are (the
+    // rest of memsz is bss)
+    uint32_t offset;
+    uint32_t filesz;
+    uint32_t writable;
+} image_segment_t;
+
+/**
+ * an executable, as shared by every process running it
+ *
+ * pages that only hold read-only segments are read from the file once and
+ * mapped into every process; pages with writable segments are copied for each
+ * process
+ */
+typedef struct image {
+    inode_t *inode;
+    // number of processes running the image
+    uint32_t refs;
+    void *entry;
+    // page-aligned start and end of all the segments in memory
+    uint32_t start;
+    uint32_t end;
+    image_segment_t segments[IMAGE_MAX_SEGMENTS];
+    uint32_t num_segments;
+    // frames of the read-only pages read in so far, 0 for the others
+    uint32_t *frames;
+    struct image *next;
+} image_t;
+
+extern image_t *runtime_image;
+
+int32_t init_runtime(void);
+image_t *image_open(inode_t *inode);
+void image_close(image_t *image);
+int32_t image_page_in(image_t *image, uint32_t pid, uint32_t page);
+
+#endif /* _IMAGE_H */
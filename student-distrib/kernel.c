@@ -22,13 +22,64 @@
 #include "status.h"
 #include "sb16.h"
 #include "fdc.h"
+#include "swap.h"
+#include "image.h"
+#include "frame.h"
+#include "efs.h"
 
 /* Macros. */
 /* Check if the bit BIT in FLAGS is set. */
 #define CHECK_FLAG(flags,bit)   ((flags) & (1 << (bit)))
 
+/* Name of the multiboot module with the filesystem (the GRUB module line, or
+ * the QEMU -initrd argument) */
+#define FS_MODULE_NAME "filesys_img"
+
+/* Order of the frames the RAM disk takes when the heap has no room for it:
+ * 2MB, the smallest buddy block that holds a whole floppy */
+#define RAM_DISK_ORDER 9
+
 #define DEBUG_FS 0
 
+/* Find the filesystem among the multiboot modules: the first that is named
+ * FS_MODULE_NAME (or has no name) and holds a valid image. The modules are
+ * page-aligned (MULTIBOOT_HEADER_FLAGS) and reserved by init_frames, so the
+ * image is used where it is, without a copy.
+ *
+ * Returns the address of the image, or 0 if there is none
+ */
+static uint32_t find_fs_module(multiboot_info_t *mbi) {
+    module_t *mod;
+    int8_t *name;
+    uint32_t i, j, base;
+    if(!CHECK_FLAG(mbi->flags, 3)) {
+        return 0;
+    }
+    mod = (module_t*)mbi->mods_addr;
+    for(i = 0; i < mbi->mods_count; i++) {
+        if(mod[i].string != 0) {
+            // the name may be a path, and may be followed by arguments
+            name = phys_to_virt(mod[i].string);
+            base = 0;
+            for(j = 0; name[j] != '\0' && name[j] != ' '; j++) {
+                if(name[j] == '/') {
+                    base = j + 1;
+                }
+            }
+            if(j - base != strlen(FS_MODULE_NAME) ||
+                    strncmp(name + base, FS_MODULE_NAME, j - base) != 0) {
+                continue;
+            }
+        }
+        if(mod[i].mod_end > mod[i].mod_start &&
+                fs_image_valid((uint32_t)phys_to_virt(mod[i].mod_start),
+                    mod[i].mod_end - mod[i].mod_start) == 0) {
+            return (uint32_t)phys_to_virt(mod[i].mod_start);
+        }
+    }
+    return 0;
+}
+
 void left_click(int32_t x, int32_t y) {
     printf("clicked at %d, %d\n", x, y);
 }
@@ -38,11 +89,18 @@ void left_click(int32_t x, int32_t y) {
     void
 entry (unsigned long magic, unsigned long addr)
 {
-    multiboot_info_t *mbi;
+    multiboot_info_t *mbi = (multiboot_info_t *) addr;
 
-    init_mem();
     init_paging();
     enable_paging();
+    /* The heap and process images come out of the memory the bootloader
+     * reports, so there is nothing else to do without it (not even print,
+     * since the terminals live on the heap). */
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || init_frames(mbi) != 0 ||
+            init_mem() != 0)
+    {
+        return;
+    }
 	init_mouse();
     init_terminals();
     init_status();
@@ -60,8 +118,7 @@ entry (unsigned long magic, unsigned long addr)
         return;
     }
 
-    /* Set MBI to the address of the Multiboot information structure. */
-    mbi = (multiboot_info_t *) addr;
+    printf ("%u of %u frames free\n", frames_free(), frames_total());
 
     /* Print out the flags. */
     printf ("flags = 0x%#x\n", (unsigned) mbi->flags);
@@ -174,14 +231,33 @@ entry (unsigned long magic, unsigned long addr)
         ltr(KERNEL_TSS);
     }
 
-    /* Make room for the filesystem 'RAM disk' */
-    uint8_t *ram_disk = kmalloc(FDC_MAX_SIZE);
+    /* Use the filesystem in place if the boot loader loaded it as a module,
+     * or else make room for a 'RAM disk' to read the floppy into */
+    uint32_t fs_image = find_fs_module(mbi);
+    uint8_t *ram_disk = NULL;
+    if(fs_image == 0) {
+        // page-aligned, so file data blocks can be mapped into user space
+        ram_disk = kmalloc_aligned(FDC_MAX_SIZE, KB(4));
+        if(ram_disk == NULL) {
+            uint32_t frame = frame_alloc(RAM_DISK_ORDER);
+            if(frame != 0) {
+                ram_disk = phys_to_virt(frame);
+            }
+        }
+        if(ram_disk == NULL) {
+            // there is no filesystem to run anything from
+            printf("Out of memory for the RAM disk; halting\n");
+            while(1) {
+                asm volatile("hlt");
+            }
+        }
+    }
 
     init_interrupts();
     // the kernel process should not be active
     idle_task(current_process->task);
 
-    /* Load the filesystem into the RAM disk */
+    /* Reset the floppy controller */
     // disable scheduling (PIT interrupt)
     disable_irq(0);
     // disable keyboard interrupts
@@ -189,18 +265,53 @@ entry (unsigned long magic, unsigned long addr)
     sti();
     int32_t fdc_error;
     fdc_error = fdc_init(0);
-    //if(fdc_write(moyd->mod_start, FDC_MAX_SIZE) == 0) {
-    if((fdc_error |= fdc_disk_read(ram_disk, FDC_MAX_SIZE)) == 0) {
-        printf("Filesystem loaded into RAM disk\n");
-    } else {
-        printf("Floppy load error\n");
-    }
     cli();
     // re-enable
     enable_irq(0);
     enable_irq(1);
 
-    set_fs_start((uint32_t)ram_disk);
+    if(fs_image != 0) {
+        printf("Filesystem mounted from a multiboot module\n");
+    } else {
+        /* Mount the filesystem from the floppy through a track cache */
+        // read only the boot block and the inodes now; data blocks are read
+        // on first access, and the rest of the disk once the shells are idle
+        fdc_cache_init(ram_disk, FDC_MAX_SIZE);
+        if(fdc_error == 0 && fdc_cache_load(0, sizeof(bootblock_t)) == 0 &&
+                fdc_cache_load(0, sizeof(bootblock_t) + sizeof(inode_t) *
+                    ((bootblock_t*)ram_disk)->master_entry.num_inodes) == 0) {
+            printf("Filesystem metadata loaded into RAM disk\n");
+        } else {
+            printf("Floppy load error\n");
+        }
+        fs_image = (uint32_t)ram_disk;
+    }
+
+    /* Swap to the second IDE drive, if there is one */
+    if(init_swap() == 0) {
+        printf("Swapping to %u pages on the IDE slave\n",
+                swap_stats.slots_total);
+    }
+
+    set_fs_start(fs_image);
+    if(ram_disk != NULL) {
+        set_fs_loader(fdc_cache_load);
+    }
+
+    /* Mount the writable filesystem, on the floppy if it is free */
+    switch(init_efs(ram_disk == NULL && fdc_error == 0)) {
+        case 1:
+            printf("Writable filesystem on the floppy under %s\n", EFS_ROOT);
+            break;
+        case 0:
+            printf("Writable filesystem in memory under %s\n", EFS_ROOT);
+            break;
+        default:
+            printf("No writable filesystem\n");
+    }
+
+    /* Open the user runtime that programs link against */
+    init_runtime();
 
     clear();
 
@@ -7,10 +7,14 @@
 #include "keyboard.h"
 #include "mem.h"
 #include "paging.h"
+#include "frame.h"
 #include "spinlock.h"
 #include "lib.h"
 #include "status.h"
 #include "mouse.h"
+#include "uaccess.h"
+#include "dedup.h"
+#include "fdc.h"
 
 // temporary, until common interrupt handling is separated
 #include "i8259.h"
@@ -53,6 +57,9 @@
 //
 #define MAX_SCROLLBACK_OFFSET 5
 
+// bytes of a write copied in from the caller at a time
+#define WRITE_CHUNK_SIZE 128
+
 // Arrays to hold the list of printable keyboard characters.
 static uint8_t keyboard_char[64] = {
     '\0', '\0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\0', '\0',
@@ -93,6 +100,8 @@ terminal_info_t* current_terminal;
 
 // Forward declarations.
 static void clear_buffer(void *buffer, uint32_t size);
+static void scroll_hidden(terminal_info_t *terminal);
+static void show_vga_page(uint32_t page);
 
 // External declarations.
 extern uint8_t cursor_on;
@@ -631,7 +640,7 @@ void tab_complete(void)
 				strncpy(cmd, dir[i], len);
 			}
 		}
-        kfree(dir[i]);
+        kmem_cache_free(filename_cache, dir[i]);
 	}
 	
 	//if a completion was found, replace text with it
@@ -672,31 +681,37 @@ int32_t keyboard_read(file_info_t *file, uint8_t* buf, int32_t nbytes)
     // Loop until we've read from the keyboard.
     sti();
     cli();
+    current_process->input_wait = 1;
     while( (current_terminal != current_process->terminal) ||
             (current_terminal->keyboard_read_flag == 0))
     {
         cli();
-        schedule();
+        if (!schedule()) {
+            // nothing else can run; use the time to clear freed memory,
+            // merge identical pages and write back to or read ahead from
+            // the floppy
+            kzero_idle();
+            dedup_idle();
+            fdc_cache_idle();
+        }
         sti();
     }
     cli();
+    current_process->input_wait = 0;
 
     // Basically, strncpy.
-    int32_t i = 0;
-    while(current_terminal->keyboard_read_buffer[i] != '\0' && i < nbytes) {
-        buf[i] = current_terminal->keyboard_read_buffer[i];
+    while(bytes_read < nbytes && bytes_read < BUFFER_SIZE &&
+            current_terminal->keyboard_read_buffer[bytes_read] != '\0') {
         bytes_read++;
-        i++;
-    }
-
-    while(i < nbytes) {
-        buf[i] = '\0';
-        i++;
     }
 
     // Reset the keyboard read flag.
     current_terminal->keyboard_read_flag = 0;
 
+    if(copy_to_user(buf, current_terminal->keyboard_read_buffer, bytes_read)
+            != 0 || clear_user(buf + bytes_read, nbytes - bytes_read) != 0) {
+        return -1;
+    }
     return bytes_read;
 }
 
@@ -710,12 +725,24 @@ int32_t keyboard_write(file_info_t *file, const int8_t* buf, int32_t nbytes)
 {
     int i;
     uint8_t theChar;
+    // the data is copied in a chunk at a time
+    int8_t chunk[WRITE_CHUNK_SIZE];
+    int32_t chunk_size;
     int32_t bytes_written = 0;
     coord_t *keyboard_start = &current_process->terminal->keyboard_start_coord;
 
     for(i = 0; i < nbytes; i++)
     {
-        theChar = buf[i];
+        if(i % WRITE_CHUNK_SIZE == 0)
+        {
+            chunk_size = nbytes - i < WRITE_CHUNK_SIZE ?
+                nbytes - i : WRITE_CHUNK_SIZE;
+            if(copy_from_user(chunk, buf + i, chunk_size) != 0)
+            {
+                break;
+            }
+        }
+        theChar = chunk[i % WRITE_CHUNK_SIZE];
         if(theChar != '\0') {
 			// If we're looking at this terminal, print the character.
             if(current_terminal == current_process->terminal)
@@ -773,6 +800,10 @@ void clear_terminal_backing_page(terminal_info_t *terminal)
 {
     int32_t blank = (current_attrib << 8) | ' ';
     memset_word(terminal->video_memory, blank, NUM_ROWS*NUM_COLS);
+    if(terminal->screen != NULL)
+    {
+        memset_word(terminal->screen, blank, NUM_ROWS*NUM_COLS);
+    }
     set_screen_coordinates(0, 0);
 }
 
@@ -807,7 +838,26 @@ void scroll_backing(terminal_info_t *terminal)
 }
 
 /**
- * Adds a character to the given backing page.
+ * Scroll the screen of a hidden terminal up, moving its top line into the
+ * scrollback buffer.
+ * @param terminal The terminal to scroll.
+ */
+static void scroll_hidden(terminal_info_t *terminal)
+{
+    if(terminal->screen == NULL)
+    {
+        scroll_backing(terminal);
+        return;
+    }
+    // The scrollback buffer ends with the screen, so scroll the two together.
+    memcpy(terminal->video_memory_base, terminal->screen, NUM_COLS * NUM_ROWS * 2);
+    scroll_backing(terminal);
+    memcpy(terminal->screen, terminal->video_memory_base, NUM_COLS * NUM_ROWS * 2);
+}
+
+/**
+ * Adds a character to the screen of a hidden terminal: its VGA page if it is
+ * resident, or else its backing page.
  * @param c The character to write.
  * @param terminal The terminal to use.
  */
@@ -824,15 +874,16 @@ putc_to_backing(uint8_t c, terminal_info_t *terminal)
 		// Scroll if necessary.
         if(*y >= NUM_ROWS)
         {
-            scroll_backing(terminal);
+            scroll_hidden(terminal);
             *y -= 1;
         }
         *x=0;
     }
     else 
     {
-		// Modify the backing page.
-        uint32_t base_addr = (uint32_t)terminal->video_memory_base;
+		// Modify the screen.
+        uint32_t base_addr = terminal->screen != NULL ?
+            (uint32_t)terminal->screen : (uint32_t)terminal->video_memory_base;
         *(uint8_t *)(base_addr + ((NUM_COLS* *y + *x) << 1)) = c;
         *(uint8_t *)(base_addr + ((NUM_COLS* *y + *x) << 1) + 1) =
             current_attrib;
@@ -841,7 +892,7 @@ putc_to_backing(uint8_t c, terminal_info_t *terminal)
     if(*x == NUM_COLS && *y == NUM_ROWS - 1)
     {
 		// Scroll if necessary.
-        scroll_backing(terminal);
+        scroll_hidden(terminal);
         *x = 0;
     }
 }
@@ -851,7 +902,7 @@ putc_to_backing(uint8_t c, terminal_info_t *terminal)
  */
 int32_t init_terminals()
 {
-    terminals = kmalloc((MAX_SCROLLBACK_OFFSET + 1) * NUM_TERMINALS * sizeof(terminal_info_t));
+    terminals = kzalloc((MAX_SCROLLBACK_OFFSET + 1) * NUM_TERMINALS * sizeof(terminal_info_t));
     current_terminal = terminals;
     int i, j;
     for(i = 0; i < NUM_TERMINALS; i++)
@@ -878,8 +929,9 @@ int32_t init_terminals()
         terminals[i].history_size = 0;
         terminals[i].history_curr = 0;
 
-        terminals[i].video_memory = kmalloc(2*NUM_COLS*NUM_ROWS*(MAX_SCROLLBACK_OFFSET + 1)) + 2*NUM_COLS*NUM_ROWS*MAX_SCROLLBACK_OFFSET;
+        terminals[i].video_memory = kzalloc(2*NUM_COLS*NUM_ROWS*(MAX_SCROLLBACK_OFFSET + 1)) + 2*NUM_COLS*NUM_ROWS*MAX_SCROLLBACK_OFFSET;
         terminals[i].video_memory_base = terminals[i].video_memory;
+        terminals[i].screen = i < RESIDENT_TERMINALS ? VGA_PAGE(i) : NULL;
         clear_terminal_backing_page(&terminals[i]);
     }
 	add_left_click(line_click);
@@ -905,8 +957,9 @@ int32_t keyboard_close(file_info_t *file)
 /**
  * Switches terminals to the specified terminal.
  *
- * Saves the current process's video memory and restores the new process's video memory
- * to/from backing pages.
+ * A resident terminal is shown by pointing the VGA start address at its page,
+ * without copying anything.  The others are copied from their backing pages
+ * into the shared VGA page, and back out when they are hidden again.
  * @param terminal The terminal to switch to.
  */
 void switch_terminals(terminal_info_t *terminal)
@@ -920,21 +973,30 @@ void switch_terminals(terminal_info_t *terminal)
         current_terminal = NULL;
     }
     if (current_terminal != NULL) {
+        // Put the screen back before it is hidden, since hidden terminals
+        // write straight to it.
+        if (scrollback_offset != 0) {
+            scrollback_offset = 0;
+            load_scrollback_page(0);
+        }
+
         // Save the coordinates of the current terminal so we can return to
         // something useful later.
         current_terminal->current_position = read_screen_coordinates();
 
-        // Remap the current terminal's (process's) video memory.
-        map_backing_page(current_terminal);
+        if (current_terminal->screen == NULL) {
+            // Remap the current terminal's (process's) video memory.
+            map_backing_page(current_terminal);
 
-        // If the current terminal had called vidmap, remap that page to the
-        // backing page as well.    
-        if(process_in_terminal[current_terminal->index] != NULL &&
-                process_in_terminal[current_terminal->index]->vidmap_flag == 1)
-        {
-            map_4kb_page((uint32_t) current_terminal->video_memory, MB(256),
-                    process_in_terminal[current_terminal->index]->pid,
-                    KernelPrivilege, 0);
+            // If the current terminal had called vidmap, remap that page to
+            // the backing page as well.
+            if(process_in_terminal[current_terminal->index] != NULL &&
+                    process_in_terminal[current_terminal->index]->vidmap_flag == 1)
+            {
+                map_4kb_page(virt_to_phys(current_terminal->video_memory), MB(256),
+                        process_in_terminal[current_terminal->index]->pid,
+                        UserPrivilege, VIDMAP_PT);
+            }
         }
 
         // restore this terminal's background
@@ -943,16 +1005,23 @@ void switch_terminals(terminal_info_t *terminal)
     // Switch to a new terminal.
     current_terminal = terminal;
 
-    // Unmap the new terminal's backing page.
-    unmap_backing_page(terminal);
+    if (terminal->screen != NULL) {
+        show_vga_page(terminal->index);
+    } else {
+        show_vga_page(SHARED_VGA_PAGE);
 
-    // If the current terminal had called vidmap, remap that page to the front as well.
-    if(process_in_terminal[current_terminal->index] != NULL &&
-            process_in_terminal[current_terminal->index]->vidmap_flag == 1)
-    {
-        map_4kb_page((uint32_t) VIDEO, MB(256),
-                process_in_terminal[current_terminal->index]->pid,
-                KernelPrivilege, 0);
+        // Unmap the new terminal's backing page.
+        unmap_backing_page(terminal);
+
+        // If the current terminal had called vidmap, remap that page to the
+        // front as well.
+        if(process_in_terminal[current_terminal->index] != NULL &&
+                process_in_terminal[current_terminal->index]->vidmap_flag == 1)
+        {
+            map_4kb_page((uint32_t) VGA_PAGE(SHARED_VGA_PAGE), MB(256),
+                    process_in_terminal[current_terminal->index]->pid,
+                    UserPrivilege, VIDMAP_PT);
+        }
     }
 
 	// Restore coordinates.
@@ -982,6 +1051,41 @@ terminal_info_t *new_terminal(void)
     return NULL;
 }
 
+/**
+ * Shows one of the pages of VGA memory, and sends the screen functions in
+ * lib.c there.  The CRTC latches the start address at vertical retrace, and
+ * the low byte is the same for every page, so the switch never tears.
+ * @param page The page to show.
+ */
+static void show_vga_page(uint32_t page)
+{
+    uint32_t start = page * VGA_PAGE_SIZE / 2;
+
+    real_vidmem = (uint8_t*)VGA_PAGE(page);
+    outb(0x0D, 0x3D4);
+    outb(start & 0xFF, 0x3D5);
+    outb(0x0C, 0x3D4);
+    outb((start >> 8) & 0xFF, 0x3D5);
+}
+
+/**
+ * Finds the physical page that vidmap should map for a terminal's process:
+ * the terminal's VGA page, or if it is not resident, the shared VGA page
+ * while it is shown and its backing page while it is hidden.
+ * @param terminal The relevant terminal.
+ * @return The physical address of the page.
+ */
+uint32_t terminal_video_page(terminal_info_t *terminal)
+{
+    if (terminal->screen != NULL) {
+        return (uint32_t) terminal->screen;
+    }
+    if (terminal == current_terminal) {
+        return (uint32_t) VGA_PAGE(SHARED_VGA_PAGE);
+    }
+    return virt_to_phys(terminal->video_memory);
+}
+
 /**
  * Copies all of the video memory from the current terminal into a backing page. 
  * @param terminal The relevant terminal.
@@ -989,7 +1093,7 @@ terminal_info_t *new_terminal(void)
 void map_backing_page(terminal_info_t *terminal)
 {
     // Copy all the data into the backing page.
-    memcpy(terminal->video_memory, (int8_t*)VIDEO, NUM_COLS * NUM_ROWS * 2);
+    memcpy(terminal->video_memory, (int8_t*)real_vidmem, NUM_COLS * NUM_ROWS * 2);
 }
 
 /**
@@ -999,19 +1103,19 @@ void map_backing_page(terminal_info_t *terminal)
 void unmap_backing_page(terminal_info_t *terminal)
 {
     // Copy the contents of the backing page into video memory.
-    memcpy((int8_t*)VIDEO, terminal->video_memory, NUM_COLS * NUM_ROWS * 2);
+    memcpy((int8_t*)real_vidmem, terminal->video_memory, NUM_COLS * NUM_ROWS * 2);
 }
 
 void map_base_page(terminal_info_t *terminal)
 {
     // Copy all the data into the backing page.
-    memcpy(terminal->video_memory_base, (int8_t*)VIDEO, NUM_COLS * NUM_ROWS * 2);
+    memcpy(terminal->video_memory_base, (int8_t*)real_vidmem, NUM_COLS * NUM_ROWS * 2);
 }
 
 void unmap_base_page(terminal_info_t *terminal)
 {
     // Copy the contents of the backing page into video memory.
-    memcpy((int8_t*)VIDEO, terminal->video_memory_base, NUM_COLS * NUM_ROWS * 2);
+    memcpy((int8_t*)real_vidmem, terminal->video_memory_base, NUM_COLS * NUM_ROWS * 2);
 }
 
 /**
@@ -16,6 +16,16 @@
 
 #define NO_TERMINAL -1
 #define VIDEO_ADDRESS(tid) (0x1000 * (tid+1))
+
+// VGA text memory (0xB8000-0xBFFFF) holds this many screens, one every
+// VGA_PAGE_SIZE bytes; which one is shown is picked with the CRTC start address
+#define VGA_PAGES 8
+#define VGA_PAGE_SIZE 0x1000
+#define VGA_PAGE(n) ((char*)(VIDEO + VGA_PAGE_SIZE * (n)))
+// terminals that keep their screen in their own VGA page; the others share
+// the last page, which is copied to and from their backing pages
+#define RESIDENT_TERMINALS (VGA_PAGES - 1)
+#define SHARED_VGA_PAGE (VGA_PAGES - 1)
 #define MAX_HISTORY_CMDS 16
 
 /**
@@ -54,6 +64,11 @@ typedef struct terminal_info {
 	// or a backing page.
     char* video_memory;
     char* video_memory_base;
+
+	// The terminal's own page of VGA memory, which always holds its screen
+	// (even while another terminal is shown), or NULL if the terminal is
+	// not resident and keeps its screen in video_memory_base while hidden.
+    char* screen;
     
 } terminal_info_t;
 
@@ -106,6 +121,7 @@ terminal_info_t *new_terminal(void);
 void switch_terminals(terminal_info_t *terminal);
 void unmap_backing_page(terminal_info_t *terminal);
 void map_backing_page(terminal_info_t *terminal);
+uint32_t terminal_video_page(terminal_info_t *terminal);
 
 // Scrollback buffer manipulation functions.
 void adjust_scrollback_page(int32_t offset);
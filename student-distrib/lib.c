@@ -6,6 +6,8 @@
 #include "syscall.h"
 #include "keyboard.h"
 #include "task.h"
+#include "paging.h"
+#include "uaccess.h"
 
 #include "colors.h"
 
@@ -829,15 +831,62 @@ void ex_gen_protection(void)
     printf("EXCEPTION 13: General Protection Fault\n");
     syscall_halt(-1);
 }
+// page fault error code: set if the page was present (a protection
+// violation), clear if it was not mapped
+#define PF_PROTECTION 0x1
+// page fault error code: set if the access was a write
+#define PF_WRITE 0x2
+
 void ex_page_fault(void)
 {
     //clear();
     //bsod();
+    registers_t regs;
     uint32_t paged_mem;
+    uint32_t error_code;
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t fixup;
+    save_regs(regs);
     //copy memory that caused ex into paged_mem;
     asm volatile ("         \
         movl %%CR2, %[addr]"
         :[addr]"=r"(paged_mem) /*output*/ );
+    //the error code sits where a return address would
+    asm volatile ("movl 4(%%ebp), %0" : "=r"(error_code));
+    asm volatile ("movl 8(%%ebp), %0" : "=r"(eip));
+    asm volatile ("movl 12(%%ebp), %0" : "=r"(cs));
+
+    //pages of a user program are brought in on first touch, and pages shared
+    //after fork are copied on the first write; on success, pop the error
+    //code and retry the access
+    if((!(error_code & PF_PROTECTION) && page_in(paged_mem) == 0) ||
+            ((error_code & PF_PROTECTION) && (error_code & PF_WRITE) &&
+             current_process != NULL &&
+             copy_on_write(current_process->pid, paged_mem) == 0)) {
+        restore_regs(regs);
+        asm volatile ("   \
+                leave       \n\
+                addl $4, %%esp \n\
+                iret"
+                :
+                :
+                :"memory" );
+    }
+    //a copy through a bad user pointer (see uaccess.c) resumes at its fixup,
+    //which fails the system call
+    fixup = ((cs & 0x3) == 0) ? search_fixup(eip) : 0;
+    if(fixup != 0) {
+        asm volatile ("movl %0, 8(%%ebp)" : : "r"(fixup) : "memory");
+        restore_regs(regs);
+        asm volatile ("   \
+                leave       \n\
+                addl $4, %%esp \n\
+                iret"
+                :
+                :
+                :"memory" );
+    }
     printf("EXCEPTION 14: Page Fault\nAttempted to Access Memory at: 0x%#x\n",paged_mem);
     syscall_halt(-1);
 }
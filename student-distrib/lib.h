@@ -24,6 +24,8 @@ void abort(char* exp, char* file, int line);
 
 extern uint8_t cursor_on;
 extern uint8_t current_attrib;
+// the VGA page the screen functions draw on, which is the one being shown
+extern uint8_t* real_vidmem;
 
 typedef struct{
     uint8_t x;
@@ -67,10 +69,6 @@ int8_t* strncpy(int8_t* dest, const int8_t*src, uint32_t n);
 
 void update_cursor(void);
 
-/* Userspace address-check functions */
-int32_t bad_userspace_addr(const void* addr, int32_t len);
-int32_t safe_strncpy(int8_t* dest, const int8_t* src, int32_t n);
-
 /* Port read functions */
 /* Inb reads a byte and returns its value as a zero-extended 32-bit
  * unsigned int */
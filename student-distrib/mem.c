@@ -1,258 +1,1018 @@
 #include "mem.h"
+#include "spinlock.h"
+#include "frame.h"
+#include "uaccess.h"
+#ifdef MEM_PROFILE
+#include "pit.h"
+#endif
 /**
  * @file mem.c
  *
  * @brief kernel memory allocator (kmalloc/kfree)
+ *
+ * Two-level segregated fit (TLSF) allocator. Free blocks are kept in a
+ * two-level array of lists: the first level splits sizes by power of two and
+ * the second level splits each power of two range linearly. Two bitmaps
+ * record which lists are non-empty, so finding a fitting block is a couple of
+ * bit scans rather than a list walk. Every block carries a boundary tag (a
+ * pointer to its physical predecessor), so kfree coalesces with both
+ * neighbours immediately and in constant time.
+ *
+ * The heap is made of pools, 4MB frames taken from the frame allocator. It
+ * starts out with one and grows by another whenever no free block is large
+ * enough. Each pool ends in a zero-sized allocated sentinel block, so blocks
+ * never coalesce across pools.
+ *
+ * With MEM_PROFILE defined, every block header also records who allocated it
+ * and when, and the heap keeps usage statistics; /dev/meminfo reports them
+ * (see meminfo_read). The rest of the memory system reports through
+ * /dev/vmstat in every build (see vmstat.c).
+ *
+ * Freed memory is not cleared. Each free block instead records how much of
+ * its payload may be dirty (everything past that mark is known to be zero),
+ * so kzalloc only clears what it has to, and kzero_idle cleans free blocks
+ * a little at a time while the machine has nothing else to do.
+ */
+
+// log2 of the number of second-level lists per first-level range
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+
+// all block sizes are a multiple of this
+#define ALIGN_SIZE_LOG2 3
+#define ALIGN_SIZE (1 << ALIGN_SIZE_LOG2)
+
+// blocks smaller than SMALL_BLOCK_SIZE all live in first-level list 0, which
+// is split linearly into SL_INDEX_COUNT lists
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+// largest first-level index; blocks must be smaller than 2^(FL_INDEX_MAX+1),
+// which leaves room for the rounding up of requests close to a whole pool
+#define FL_INDEX_MAX 22
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+
+// flags kept in the low bits of block_header_t.size
+#define BLOCK_FREE 0x1
+#define BLOCK_PREV_FREE 0x2
+#define BLOCK_FLAGS (BLOCK_FREE | BLOCK_PREV_FREE)
+
+// pools are frames of this order; their size bounds the largest allocation
+#define POOL_ORDER FRAME_ORDER_4MB
+#define POOL_BYTES (FRAME_SIZE << POOL_ORDER)
+// most pools the heap can grow to
+#define MAX_POOLS 64
+
+// bytes cleared and blocks looked at by each kzero_idle call
+#define IDLE_ZERO_BYTES KB(4)
+#define IDLE_ZERO_BLOCKS 64
+
+#ifdef MEM_PROFILE
+// where an allocated block came from
+typedef struct alloc_info {
+	// return address of the kmalloc call
+	void *caller;
+	// size asked for, before rounding
+	uint32_t requested;
+	// pit_ticks at the time of the allocation
+	uint32_t time;
+	// allocation number, counting from boot
+	uint32_t serial;
+} alloc_info_t;
+
+// size of the report /dev/meminfo serves
+#define MEMINFO_SIZE KB(16)
+#endif
+
+/*
+ * header in front of every block
+ *
+ * only prev_phys and size (and info, when profiling) are overhead for an
+ * allocated block; the free list links live in the first bytes of the payload
+ * and are only valid while the block is free
  */
+typedef struct block_header {
+	// the block physically before this one (boundary tag)
+	struct block_header *prev_phys;
+	// payload size in bytes, plus BLOCK_* flags in the low bits
+	uint32_t size;
+#ifdef MEM_PROFILE
+	alloc_info_t info;
+#endif
+	struct block_header *next_free;
+	struct block_header *prev_free;
+	// number of bytes at the start of the payload which may be non-zero
+	uint32_t dirty;
+} block_header_t;
+
+#define BLOCK_OVERHEAD ((uint32_t) &((block_header_t*) 0)->next_free)
+// payload bytes a free block uses for its links and dirty mark
+#define FREE_HEADER_BYTES (sizeof(block_header_t) - BLOCK_OVERHEAD)
+#define BLOCK_SIZE_MIN ((FREE_HEADER_BYTES + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1))
+#define BLOCK_SIZE_MAX (1 << (FL_INDEX_MAX + 1))
 
-// This limits how much fragmentation is allowed
-#define MAX_REGIONS 500
+// the frames backing the heap
+static uint8_t *pools[MAX_POOLS];
+static uint32_t num_pools;
 
-// represents a region of memory in a linked list
-typedef struct region {
-    uint8_t *ptr;
-    uint32_t size;
-    struct region *next;
-    struct region *prev;
-		int8_t in_use;
-} region_t;
+// bitmap of non-empty first-level ranges
+static uint32_t fl_bitmap;
+// for each first-level range, bitmap of non-empty second-level lists
+static uint32_t sl_bitmap[FL_INDEX_COUNT];
+// heads of the free lists
+static block_header_t *free_blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
 
-// static backing storage where memory is doled out from
-static uint8_t *storage = (uint8_t*) MB(192);
+// block (and its pool) the idle zeroing pass is working on
+static block_header_t *zero_cursor;
+static uint32_t zero_pool;
+// set while there may be dirty free blocks
+static uint32_t zero_pending;
+// cleared whenever the current pass over the heap finds dirty memory
+static uint32_t zero_lap_clean;
 
-static region_t regions[MAX_REGIONS];
+#ifdef MEM_PROFILE
+// heap usage, in payload bytes
+static struct {
+	uint32_t in_use;
+	uint32_t in_use_peak;
+	uint32_t requested;
+	uint32_t free;
+	uint32_t blocks;
+	uint32_t blocks_peak;
+	uint32_t allocs;
+	uint32_t frees;
+	// failures with too little free memory in total, and with enough free
+	// memory that was too fragmented
+	uint32_t failed_exhausted;
+	uint32_t failed_fragmented;
+} heap_stats;
 
-static region_t* free_regions;
-static region_t* allocated_regions;
+static int8_t meminfo[MEMINFO_SIZE];
+static uint32_t meminfo_len;
+
+static void profile_alloc(block_header_t *block, uint32_t requested, void *caller);
+static void profile_free(block_header_t *block);
+static void profile_fail(uint32_t size);
+#endif
 
 // Forward declarations
-region_t* add_region(region_t* new, region_t* list);
-region_t* new_region(void *ptr, uint32_t size);
-void remove(region_t *region);
-void* ltrim(region_t *region, uint32_t desired_size);
-int8_t are_adjacent(region_t *first, region_t *second);
-int8_t comp(void *left, void *right);
-int8_t in_region(void *ptr, region_t *region);
+static int32_t tlsf_fls(uint32_t word);
+static int32_t tlsf_ffs(uint32_t word);
+static uint32_t block_size(block_header_t *block);
+static block_header_t* block_next(block_header_t *block);
+static block_header_t* block_from_ptr(void *ptr);
+static void* block_to_ptr(block_header_t *block);
+static void mapping_insert(uint32_t size, int32_t *fli, int32_t *sli);
+static void mapping_search(uint32_t size, int32_t *fli, int32_t *sli);
+static block_header_t* find_free_block(uint32_t size);
+static int32_t heap_grow(void);
+static int32_t heap_contains(void *ptr);
+static int32_t block_valid(block_header_t *block);
+static block_header_t* search_suitable_block(int32_t *fli, int32_t *sli);
+static void insert_free_block(block_header_t *block);
+static void remove_free_block(block_header_t *block);
+static void block_split(block_header_t *block, uint32_t size);
+static block_header_t* block_merge_next(block_header_t *block);
+static void block_absorb(block_header_t *block, block_header_t *next);
+static void block_set_dirty(block_header_t *block, uint32_t dirty);
+static block_header_t* block_trim_front(block_header_t *block, uint32_t gap);
 
 /**
  * allocate a block of memory and reserve it
  *
+ * the returned memory is not cleared; use kzalloc if it has to be
+ *
  * @param size number of bytes to allocate
  * @return pointer to the allocated memory or NULL of no sufficiently large
- * free regions were found
+ * free block was found
  */
 void * kmalloc(uint32_t size) {
-	if (size == 0) {
+	block_header_t *block;
+#ifdef MEM_PROFILE
+	uint32_t requested = size;
+#endif
+
+	if (size == 0 || size >= BLOCK_SIZE_MAX) {
 		return NULL;
 	}
-	region_t *region = free_regions;
-	while (region != NULL) {
-		if (are_adjacent(region, region->next)) {
-			region->size += region->next->size;
-			remove(region->next);
-		}
-		if (region->size >= size) {
-			void *ptr = ltrim(region,size);
-			region_t *new = new_region(ptr, size);
-			add_region(new, allocated_regions);
-			return ptr;
-		}
-		region = region->next;
+	size = (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+	if (size < BLOCK_SIZE_MIN) {
+		size = BLOCK_SIZE_MIN;
 	}
 
-	return NULL;
+	block = find_free_block(size);
+	if (block == NULL) {
+#ifdef MEM_PROFILE
+		profile_fail(size);
+#endif
+		return NULL;
+	}
+	remove_free_block(block);
+	block_split(block, size);
+
+	block->size &= ~BLOCK_FREE;
+	block_next(block)->size &= ~BLOCK_PREV_FREE;
+#ifdef MEM_PROFILE
+	profile_alloc(block, requested, __builtin_return_address(0));
+#endif
+
+	return block_to_ptr(block);
+}
+
+/**
+ * allocate a zeroed block of memory
+ *
+ * only the part of the block that may still be dirty is cleared, so memory
+ * already cleaned by kzero_idle costs nothing
+ *
+ * @param size number of bytes to allocate
+ * @return pointer to the allocated memory or NULL if no sufficiently large
+ * free block was found
+ */
+void * kzalloc(uint32_t size) {
+	void *ptr = kmalloc(size);
+	if (ptr == NULL) {
+		return NULL;
+	}
+	// the dirty mark of the block we got is still intact
+	memset(ptr, 0, block_from_ptr(ptr)->dirty);
+#ifdef MEM_PROFILE
+	block_from_ptr(ptr)->info.caller = __builtin_return_address(0);
+#endif
+	return ptr;
+}
+
+/**
+ * allocate a block of memory whose address is a multiple of align
+ *
+ * the block is freed with kfree like any other; like kmalloc, the memory is
+ * not cleared
+ *
+ * @param size number of bytes to allocate
+ * @param align required alignment, a power of two
+ * @return pointer to the allocated memory or NULL if no sufficiently large
+ * free block was found
+ */
+void * kmalloc_aligned(uint32_t size, uint32_t align) {
+	block_header_t *block;
+	uint32_t ptr;
+	uint32_t gap;
+#ifdef MEM_PROFILE
+	uint32_t requested = size;
+#endif
+
+	if (align <= ALIGN_SIZE) {
+		return kmalloc(size);
+	}
+	if (size == 0 || size >= BLOCK_SIZE_MAX || align >= BLOCK_SIZE_MAX) {
+		return NULL;
+	}
+	size = (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+	if (size < BLOCK_SIZE_MIN) {
+		size = BLOCK_SIZE_MIN;
+	}
+
+	// leave room to carve a free block off the front to reach alignment
+	block = find_free_block(size + align + sizeof(block_header_t));
+	if (block == NULL) {
+#ifdef MEM_PROFILE
+		profile_fail(size + align);
+#endif
+		return NULL;
+	}
+	remove_free_block(block);
+
+	ptr = (uint32_t) block_to_ptr(block);
+	gap = ((ptr + align - 1) & ~(align - 1)) - ptr;
+	// the leftover in front has to be big enough to be a block itself
+	while (gap != 0 && gap < sizeof(block_header_t)) {
+		gap += align;
+	}
+	if (gap != 0) {
+		block = block_trim_front(block, gap);
+	}
+	block_split(block, size);
+
+	block->size &= ~BLOCK_FREE;
+	block_next(block)->size &= ~BLOCK_PREV_FREE;
+#ifdef MEM_PROFILE
+	profile_alloc(block, requested, __builtin_return_address(0));
+#endif
+
+	return block_to_ptr(block);
 }
 
 /**
  * free a block of memory previously allocated with kmalloc
  *
- * does nothing when trying to free NULL
- * does nothing if ptr was not allocated (including free'ing pointers in the
- * middle of a block)
+ * does nothing when trying to free NULL, a pointer outside the heap, a
+ * pointer that is not the start of a block, or a block that is already free
+ * (including one that has since been merged into a free neighbour)
+ *
+ * the block is immediately coalesced with any free neighbours; its contents
+ * are left for kzalloc or kzero_idle to clear
  *
  * @param ptr pointer returned by a previous kmalloc
  */
 void kfree(void *ptr) {
-	if (ptr == NULL) {
+	block_header_t *block;
+	block_header_t *prev;
+
+	if (!heap_contains(ptr)) {
 		return;
 	}
-	region_t *region = allocated_regions;
-	while (region != NULL) {
-		if (region->ptr == ptr) {
-			remove(region);
-			add_region(region, free_regions);
-			region->in_use = 1;
-			return;
-		}
+	block = block_from_ptr(ptr);
+	if ((block->size & BLOCK_FREE) || !block_valid(block)) {
+		return;
+	}
+#ifdef MEM_PROFILE
+	profile_free(block);
+#endif
+
+	block->size |= BLOCK_FREE;
+	block_next(block)->size |= BLOCK_PREV_FREE;
+	block->dirty = block_size(block);
 
-		region = region->next;
+	if (block->size & BLOCK_PREV_FREE) {
+		prev = block->prev_phys;
+		remove_free_block(prev);
+		block_absorb(prev, block);
+		block = prev;
 	}
+	block = block_merge_next(block);
+
+	insert_free_block(block);
+
+	zero_pending = 1;
+	zero_lap_clean = 0;
 }
 
 /**
- * add a region to a linked list
+ * allocate a buffer that ISA DMA can use
  *
- * keeps list sorted by ptr
+ * the buffer lies below FRAME_DMA_LIMIT and does not cross a 64KB boundary.
+ * It is made of whole frames from the DMA zone rather than the heap, so the
+ * size is rounded up to a power of two frames. Like kmalloc, the memory is not
+ * cleared.
  *
- * @param new pointer to new region, already initialized
- * @param list head of a list to insert into
- * @return the region pointer passed in (for chaining)
+ * @param size number of bytes, at most DMA_MAX_BYTES
+ * @return pointer to the buffer (use virt_to_phys for the address to give the
+ * DMA controller) or NULL if the DMA zone is exhausted
  */
-region_t* add_region(region_t* new, region_t* list) {
-	if (list == NULL) {
+void * kmalloc_dma(uint32_t size) {
+	uint32_t order = 0;
+	uint32_t addr;
+
+	if (size == 0 || size > DMA_MAX_BYTES) {
 		return NULL;
 	}
-	region_t* region = list;
-	region_t* prev_region = NULL;
-	while (region != NULL && comp(region->ptr, new->ptr)) {
-		prev_region = region;
-		region = region->next;
-	}
-	if (prev_region != NULL) {
-		prev_region->next = new;
+	while ((FRAME_SIZE << order) < size) {
+		order++;
 	}
-	new->prev = prev_region;
-	new->next = region;
-	if (region != NULL) {
-		region->prev = new;
+	addr = frame_alloc_dma(order);
+	if (addr == 0) {
+		return NULL;
 	}
+	return phys_to_virt(addr);
+}
 
-	return new;
+/**
+ * free a buffer allocated with kmalloc_dma
+ *
+ * @param ptr pointer returned by kmalloc_dma; NULL is ignored
+ * @param size the size it was allocated with
+ */
+void kfree_dma(void *ptr, uint32_t size) {
+	uint32_t order = 0;
+
+	if (ptr == NULL || size == 0 || size > DMA_MAX_BYTES) {
+		return;
+	}
+	while ((FRAME_SIZE << order) < size) {
+		order++;
+	}
+	frame_free(virt_to_phys(ptr), order);
 }
 
 /**
- * get a new region and initialize it from a pointer and size
+ * clear a little of the freed memory
  *
- * regions are retrieved from a static pile of them available to this function
- * 
- * @param ptr pointer this region refers to
- * @param size number of bytes this region covers
- * @return the new region
+ * meant to be called repeatedly while no task is runnable; each call clears
+ * at most IDLE_ZERO_BYTES, continuing where the last call stopped, and
+ * returns at once when there is nothing left to clear
  */
-region_t* new_region(void *ptr, uint32_t size) {
-	int i;
-	for (i = 0; i < MAX_REGIONS; i++) {
-		if (regions[i].in_use == 0) {
-			regions[i].ptr = ptr;
-			regions[i].size = size;
-			regions[i].next = NULL;
-			regions[i].prev = NULL;
-			regions[i].in_use = 1;
-			return &regions[i];
+void kzero_idle() {
+	uint32_t flags;
+	uint32_t budget = IDLE_ZERO_BYTES;
+	uint32_t visited;
+	uint32_t len;
+	block_header_t *block;
+
+	if (!zero_pending) {
+		return;
+	}
+	block_interrupts(&flags);
+	for (visited = 0; visited < IDLE_ZERO_BLOCKS && budget > 0; visited++) {
+		block = zero_cursor;
+		if ((block->size & BLOCK_FREE) && block->dirty > FREE_HEADER_BYTES) {
+			// clear from the end of the dirty part so the mark stays valid
+			len = block->dirty - FREE_HEADER_BYTES;
+			if (len > budget) {
+				len = budget;
+			}
+			memset((uint8_t*) block_to_ptr(block) + block->dirty - len, 0, len);
+			block->dirty -= len;
+			budget -= len;
+			zero_lap_clean = 0;
+			if (block->dirty > FREE_HEADER_BYTES) {
+				continue;
+			}
+		}
+
+		zero_cursor = block_next(block);
+		if (block_size(zero_cursor) == 0) {
+			// reached the sentinel, go on to the next pool
+			zero_pool++;
+			if (zero_pool == num_pools) {
+				// a whole pass without finding anything dirty means the
+				// heap is clean
+				zero_pool = 0;
+				if (zero_lap_clean) {
+					zero_pending = 0;
+				}
+				zero_lap_clean = 1;
+			}
+			zero_cursor = (block_header_t*) pools[zero_pool];
+			if (!zero_pending) {
+				break;
+			}
 		}
 	}
-	return NULL;
+	restore_interrupts(flags);
 }
 
 /**
- * reduce the size of a region from the left
+ * find last (most significant) set bit
  *
- * makes a region smaller and returns a pointer to a block with a desired size
- * available will fail (and return NULL) if that region doesn't actually have
- * enough space
+ * @return bit index, or -1 if word is 0
+ */
+static int32_t tlsf_fls(uint32_t word) {
+	int32_t bit;
+	if (word == 0) {
+		return -1;
+	}
+	asm ("bsrl %1, %0" : "=r"(bit) : "rm"(word) : "cc");
+	return bit;
+}
+
+/**
+ * find first (least significant) set bit
  *
- * @param region the region to get space from
- * @param desired_size the number of bytes to trim from the left
- * @return a pointer to a block of desired_size bytes
+ * @return bit index, or -1 if word is 0
  */
-void* ltrim(region_t *region, uint32_t desired_size) {
-	if (region->size < desired_size) {
+static int32_t tlsf_ffs(uint32_t word) {
+	int32_t bit;
+	if (word == 0) {
+		return -1;
+	}
+	asm ("bsfl %1, %0" : "=r"(bit) : "rm"(word) : "cc");
+	return bit;
+}
+
+/**
+ * payload size of a block, without flags
+ */
+static uint32_t block_size(block_header_t *block) {
+	return block->size & ~BLOCK_FLAGS;
+}
+
+/**
+ * the block physically following this one
+ */
+static block_header_t* block_next(block_header_t *block) {
+	return (block_header_t*) ((uint8_t*) block_to_ptr(block) + block_size(block));
+}
+
+static block_header_t* block_from_ptr(void *ptr) {
+	return (block_header_t*) ((uint8_t*) ptr - BLOCK_OVERHEAD);
+}
+
+static void* block_to_ptr(block_header_t *block) {
+	return (uint8_t*) block + BLOCK_OVERHEAD;
+}
+
+/**
+ * compute the free list a block of a given size belongs in
+ *
+ * @param size block size
+ * @param fli first-level index out
+ * @param sli second-level index out
+ */
+static void mapping_insert(uint32_t size, int32_t *fli, int32_t *sli) {
+	int32_t fl, sl;
+	if (size < SMALL_BLOCK_SIZE) {
+		fl = 0;
+		sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+	} else {
+		fl = tlsf_fls(size);
+		sl = (size >> (fl - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+		fl -= FL_INDEX_SHIFT - 1;
+	}
+	*fli = fl;
+	*sli = sl;
+}
+
+/**
+ * compute the first free list whose blocks are all at least size bytes
+ *
+ * rounds size up to the next list boundary so that any block found is big
+ * enough without having to look at it
+ */
+static void mapping_search(uint32_t size, int32_t *fli, int32_t *sli) {
+	if (size >= SMALL_BLOCK_SIZE) {
+		size += (1 << (tlsf_fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+	}
+	mapping_insert(size, fli, sli);
+}
+
+/**
+ * find a non-empty free list at or above (fli, sli)
+ *
+ * @return head of that list, or NULL if memory is exhausted; fli and sli are
+ * updated to the list found
+ */
+static block_header_t* search_suitable_block(int32_t *fli, int32_t *sli) {
+	int32_t fl = *fli;
+	int32_t sl;
+	uint32_t sl_map;
+	uint32_t fl_map;
+
+	if (fl >= FL_INDEX_COUNT) {
 		return NULL;
 	}
-	void *oldptr = region->ptr;
-	if (region->size == desired_size) {
-		// need to claim entire region
-		remove(region);
+	sl_map = sl_bitmap[fl] & (~0U << *sli);
+	if (sl_map == 0) {
+		// nothing in this range; go to the next non-empty range
+		fl_map = fl_bitmap & (~0U << (fl + 1));
+		if (fl_map == 0) {
+			return NULL;
+		}
+		fl = tlsf_ffs(fl_map);
+		sl_map = sl_bitmap[fl];
+	}
+	sl = tlsf_ffs(sl_map);
+	*fli = fl;
+	*sli = sl;
+	return free_blocks[fl][sl];
+}
+
+/**
+ * push a free block onto the head of its free list
+ */
+static void insert_free_block(block_header_t *block) {
+	int32_t fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	block->prev_free = NULL;
+	block->next_free = free_blocks[fl][sl];
+	if (block->next_free != NULL) {
+		block->next_free->prev_free = block;
+	}
+	free_blocks[fl][sl] = block;
+	fl_bitmap |= 1 << fl;
+	sl_bitmap[fl] |= 1 << sl;
+#ifdef MEM_PROFILE
+	heap_stats.free += block_size(block);
+#endif
+}
+
+/**
+ * unlink a free block from its free list
+ */
+static void remove_free_block(block_header_t *block) {
+	int32_t fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	if (block->prev_free != NULL) {
+		block->prev_free->next_free = block->next_free;
 	} else {
-		// just reduce this region and give back a ptr for only part of it
-		region->size -= desired_size;
-		region->ptr += desired_size;
+		free_blocks[fl][sl] = block->next_free;
+	}
+	if (block->next_free != NULL) {
+		block->next_free->prev_free = block->prev_free;
 	}
-	return oldptr;
+	if (free_blocks[fl][sl] == NULL) {
+		sl_bitmap[fl] &= ~(1 << sl);
+		if (sl_bitmap[fl] == 0) {
+			fl_bitmap &= ~(1 << fl);
+		}
+	}
+	block->next_free = NULL;
+	block->prev_free = NULL;
+#ifdef MEM_PROFILE
+	heap_stats.free -= block_size(block);
+#endif
 }
 
 /**
- * checks if two regions are adjacent
+ * trim a (removed from its list) free block down to size bytes
  *
- * specifically reports if the first region ends at the start of the second region
+ * if the leftover space can hold a block of its own it becomes a new free
+ * block; otherwise the block is left as is
+ */
+static void block_split(block_header_t *block, uint32_t size) {
+	block_header_t *remaining;
+	uint32_t remaining_size;
+	uint32_t dirty = block->dirty;
+
+	if (block_size(block) < size + sizeof(block_header_t)) {
+		return;
+	}
+	remaining_size = block_size(block) - size - BLOCK_OVERHEAD;
+	remaining = (block_header_t*) ((uint8_t*) block_to_ptr(block) + size);
+	remaining->prev_phys = block;
+	remaining->size = remaining_size | BLOCK_FREE;
+	block->size = size | (block->size & BLOCK_FLAGS);
+	block_next(remaining)->prev_phys = remaining;
+	block_next(remaining)->size |= BLOCK_PREV_FREE;
+	block_set_dirty(remaining, dirty > size + BLOCK_OVERHEAD ?
+			dirty - size - BLOCK_OVERHEAD : 0);
+	block_set_dirty(block, dirty);
+	insert_free_block(remaining);
+}
+
+/**
+ * absorb the next physical block into this one if it is free
  *
- * @return 0 if regions are not adjacent or either is invalid, 1 if regions are
- * adjacent
+ * @return the (possibly larger) block
  */
-int8_t are_adjacent(region_t* first, region_t* second) {
-	if (first == NULL || second == NULL) {
-		return 0;
+static block_header_t* block_merge_next(block_header_t *block) {
+	block_header_t *next = block_next(block);
+	if (next->size & BLOCK_FREE) {
+		remove_free_block(next);
+		block_absorb(block, next);
 	}
-	if (first->ptr + first->size == second->ptr) {
-		return 1;
+	return block;
+}
+
+/**
+ * grow a free block over the free block physically following it
+ *
+ * neither block may be on a free list
+ */
+static void block_absorb(block_header_t *block, block_header_t *next) {
+	// next's header and links are now in the middle of block's payload
+	block->dirty = block_size(block) + BLOCK_OVERHEAD + next->dirty;
+	block->size += BLOCK_OVERHEAD + block_size(next);
+	block_next(block)->prev_phys = block;
+	if (zero_cursor == next) {
+		zero_cursor = block;
 	}
-	return 0;
 }
 
 /**
- * remove a region from its list
+ * set how much of a block's payload may be dirty
  *
- * also marks the region free so that it can be re-used when memory is further fragmented
+ * the mark never covers less than the free list links or more than the block
+ */
+static void block_set_dirty(block_header_t *block, uint32_t dirty) {
+	if (dirty < FREE_HEADER_BYTES) {
+		dirty = FREE_HEADER_BYTES;
+	}
+	if (dirty > block_size(block)) {
+		dirty = block_size(block);
+	}
+	block->dirty = dirty;
+}
+
+/**
+ * split gap bytes off the front of a (removed from its list) free block
  *
- * clears out the storage memory so that allocated memory is always clean
+ * the front part goes back on the free lists
  *
- * @param region the region to free
+ * @return the block that now starts gap bytes further on
  */
-void remove(region_t *region) {
-	region->prev->next = region->next;
-	if (region->next != NULL) {
-		region->next->prev = region->prev;
+static block_header_t* block_trim_front(block_header_t *block, uint32_t gap) {
+	block_header_t *rest;
+	uint32_t dirty = block->dirty;
+
+	rest = (block_header_t*) ((uint8_t*) block + gap);
+	rest->prev_phys = block;
+	rest->size = (block_size(block) - gap) | BLOCK_FREE | BLOCK_PREV_FREE;
+	block->size = (gap - BLOCK_OVERHEAD) | (block->size & BLOCK_FLAGS);
+	block_next(rest)->prev_phys = rest;
+	block_set_dirty(rest, dirty > gap ? dirty - gap : 0);
+	block_set_dirty(block, dirty);
+	insert_free_block(block);
+	return rest;
+}
+
+/**
+ * find a free block of at least size bytes, growing the heap if there is none
+ *
+ * @return the block, still on its free list, or NULL if out of memory
+ */
+static block_header_t* find_free_block(uint32_t size) {
+	int32_t fli, sli;
+	block_header_t *block;
+
+	mapping_search(size, &fli, &sli);
+	block = search_suitable_block(&fli, &sli);
+	// only grow if a new pool would actually help
+	if (block == NULL && size <= POOL_BYTES - 2 * BLOCK_OVERHEAD &&
+			heap_grow() == 0) {
+		mapping_search(size, &fli, &sli);
+		block = search_suitable_block(&fli, &sli);
 	}
-	memset(region->ptr, 0, region->size);
-	region->in_use = 0;
+	return block;
 }
 
 /**
- * helper to compare pointers
+ * add a pool to the heap
+ *
+ * takes a frame from the frame allocator and turns it into a single free
+ * block, followed by a zero-sized allocated sentinel so that the last block
+ * always has a successor
  *
- * returns true if left pointer comes before right
+ * the frame is not cleared here; the whole block starts out dirty
+ *
+ * @return 0 on success, -1 if there are no frames (or pool slots) left
  */
-int8_t comp(void *left, void *right) {
-	return (uint32_t) left < (uint32_t) right;
+static int32_t heap_grow(void) {
+	block_header_t *block;
+	block_header_t *sentinel;
+	uint32_t frame;
+
+	if (num_pools == MAX_POOLS) {
+		return -1;
+	}
+	frame = frame_alloc(POOL_ORDER);
+	if (frame == 0) {
+		return -1;
+	}
+	pools[num_pools] = phys_to_virt(frame);
+
+	block = (block_header_t*) pools[num_pools];
+	block->prev_phys = NULL;
+	block->size = (POOL_BYTES - 2 * BLOCK_OVERHEAD) | BLOCK_FREE;
+	block->dirty = block_size(block);
+
+	sentinel = block_next(block);
+	sentinel->prev_phys = block;
+	sentinel->size = BLOCK_PREV_FREE;
+
+	insert_free_block(block);
+	num_pools++;
+
+	zero_pending = 1;
+	zero_lap_clean = 0;
+	return 0;
 }
 
 /**
- * helper to check if a pointer is in a region
+ * check whether a pointer could have come from kmalloc
  */
-int8_t in_region(void *ptr, region_t *region) {
-	return (comp(region->ptr, ptr) && comp(ptr, region->ptr + region->size));
+static int32_t heap_contains(void *ptr) {
+	uint32_t i;
+	for (i = 0; i < num_pools; i++) {
+		if ((uint8_t*) ptr >= pools[i] + BLOCK_OVERHEAD &&
+				(uint8_t*) ptr < pools[i] + POOL_BYTES) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * check that a block header (of a pointer heap_contains accepted) is one the
+ * heap knows about
+ *
+ * a header merged into a free neighbour is left behind in that neighbour's
+ * payload, where it may since have been cleared or overwritten; a live
+ * block is non-empty, lies within its pool, and is its successor's
+ * prev_phys
+ */
+static int32_t block_valid(block_header_t *block) {
+	block_header_t *next;
+	uint32_t i;
+
+	if ((uint32_t) block & (ALIGN_SIZE - 1) || block_size(block) == 0) {
+		return 0;
+	}
+	for (i = 0; i < num_pools; i++) {
+		if ((uint8_t*) block >= pools[i] &&
+				(uint8_t*) block < pools[i] + POOL_BYTES) {
+			break;
+		}
+	}
+	if (i == num_pools || block_size(block) > POOL_BYTES - 2 * BLOCK_OVERHEAD) {
+		return 0;
+	}
+	next = block_next(block);
+	if ((uint8_t*) next < (uint8_t*) block ||
+			(uint8_t*) next > pools[i] + POOL_BYTES - BLOCK_OVERHEAD) {
+		return 0;
+	}
+	return next->prev_phys == block;
 }
 
 /**
  * initialize the memory system
  *
- * sets up a sentinel for the free and allocated region lists and clears the
- * storage memory
+ * must be called after init_frames, since the heap is built from frames
+ *
+ * @return 0 on success, -1 if not even one pool could be allocated
+ */
+int32_t init_mem() {
+	int32_t i, j;
+
+	fl_bitmap = 0;
+	for (i = 0; i < FL_INDEX_COUNT; i++) {
+		sl_bitmap[i] = 0;
+		for (j = 0; j < SL_INDEX_COUNT; j++) {
+			free_blocks[i][j] = NULL;
+		}
+	}
+
+	num_pools = 0;
+	if (heap_grow() == -1) {
+		return -1;
+	}
+	zero_cursor = (block_header_t*) pools[0];
+	zero_pool = 0;
+	return 0;
+}
+
+#ifdef MEM_PROFILE
+/**
+ * record a new allocation
+ */
+static void profile_alloc(block_header_t *block, uint32_t requested, void *caller) {
+	block->info.caller = caller;
+	block->info.requested = requested;
+	block->info.time = pit_ticks;
+	block->info.serial = heap_stats.allocs++;
+
+	heap_stats.in_use += block_size(block);
+	heap_stats.requested += requested;
+	heap_stats.blocks++;
+	if (heap_stats.in_use > heap_stats.in_use_peak) {
+		heap_stats.in_use_peak = heap_stats.in_use;
+	}
+	if (heap_stats.blocks > heap_stats.blocks_peak) {
+		heap_stats.blocks_peak = heap_stats.blocks;
+	}
+}
+
+/**
+ * record a block being freed
+ */
+static void profile_free(block_header_t *block) {
+	heap_stats.in_use -= block_size(block);
+	heap_stats.requested -= block->info.requested;
+	heap_stats.blocks--;
+	heap_stats.frees++;
+}
+
+/**
+ * record a failed allocation, telling exhaustion from fragmentation
  */
-void init_mem() {
-	// sentinel for free regions
-	regions[0].ptr = NULL;
-	regions[0].size = 0;
-	regions[0].next = &regions[1];
-	regions[0].prev = NULL;
-	regions[0].in_use = 1;
+static void profile_fail(uint32_t size) {
+	if (heap_stats.free >= size) {
+		heap_stats.failed_fragmented++;
+	} else {
+		heap_stats.failed_exhausted++;
+	}
+}
 
-	regions[1].ptr = storage;
-	regions[1].size = STORAGE_BYTES;
-	regions[1].next = NULL;
-	regions[1].prev = &regions[0];
-	regions[1].in_use = 1;
+static void meminfo_str(const int8_t *str) {
+	while (*str != '\0' && meminfo_len < MEMINFO_SIZE - 1) {
+		meminfo[meminfo_len++] = *str++;
+	}
+	meminfo[meminfo_len] = '\0';
+}
 
-	free_regions = &regions[0];
+static void meminfo_num(uint32_t num, int32_t radix) {
+	int8_t buf[16];
+	itoa(num, buf, radix);
+	meminfo_str(buf);
+}
 
-	// sentinel for allocated regions
-	regions[2].ptr = NULL;
-	regions[2].size = 0;
-	regions[2].next = NULL;
-	regions[2].prev = NULL;
-	regions[2].in_use = 1;
-	allocated_regions = &regions[2];
+/**
+ * write a report on the heap into meminfo
+ *
+ * usage totals and peaks, failed allocations, a histogram of free block
+ * sizes (one bucket per power of two), the largest free block, and every
+ * live allocation with its caller
+ */
+static void meminfo_render(void) {
+	block_header_t *block;
+	uint32_t fl, sl;
+	uint32_t count;
+	uint32_t largest = 0;
+	uint32_t i;
+
+	meminfo_len = 0;
+	meminfo_str("heap: ");
+	meminfo_num(num_pools * POOL_BYTES / KB(1), 10);
+	meminfo_str("KB in ");
+	meminfo_num(num_pools, 10);
+	meminfo_str(" pools\nin use: ");
+	meminfo_num(heap_stats.in_use, 10);
+	meminfo_str(" bytes in ");
+	meminfo_num(heap_stats.blocks, 10);
+	meminfo_str(" blocks (");
+	meminfo_num(heap_stats.requested, 10);
+	meminfo_str(" requested)\npeak: ");
+	meminfo_num(heap_stats.in_use_peak, 10);
+	meminfo_str(" bytes, ");
+	meminfo_num(heap_stats.blocks_peak, 10);
+	meminfo_str(" blocks\nallocations: ");
+	meminfo_num(heap_stats.allocs, 10);
+	meminfo_str(", frees: ");
+	meminfo_num(heap_stats.frees, 10);
+	meminfo_str("\nfailed: ");
+	meminfo_num(heap_stats.failed_exhausted, 10);
+	meminfo_str(" out of memory, ");
+	meminfo_num(heap_stats.failed_fragmented, 10);
+	meminfo_str(" fragmented\n");
 
-	memset(storage, 0, STORAGE_BYTES);
+	meminfo_str("free: ");
+	meminfo_num(heap_stats.free, 10);
+	meminfo_str(" bytes\n");
+	for (fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		count = 0;
+		for (sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			for (block = free_blocks[fl][sl]; block != NULL;
+					block = block->next_free) {
+				count++;
+				if (block_size(block) > largest) {
+					largest = block_size(block);
+				}
+			}
+		}
+		if (count == 0) {
+			continue;
+		}
+		meminfo_str("  < ");
+		meminfo_num(SMALL_BLOCK_SIZE << fl, 10);
+		meminfo_str(": ");
+		meminfo_num(count, 10);
+		meminfo_str("\n");
+	}
+	meminfo_str("largest free block: ");
+	meminfo_num(largest, 10);
+	meminfo_str(" bytes\n");
+
+	meminfo_str("live allocations (address size requested caller time serial):\n");
+	for (i = 0; i < num_pools; i++) {
+		block = (block_header_t*) pools[i];
+		for (; block_size(block) != 0; block = block_next(block)) {
+			if (block->size & BLOCK_FREE) {
+				continue;
+			}
+			meminfo_num((uint32_t) block_to_ptr(block), 16);
+			meminfo_str(" ");
+			meminfo_num(block_size(block), 10);
+			meminfo_str(" ");
+			meminfo_num(block->info.requested, 10);
+			meminfo_str(" ");
+			meminfo_num((uint32_t) block->info.caller, 16);
+			meminfo_str(" ");
+			meminfo_num(block->info.time, 10);
+			meminfo_str(" ");
+			meminfo_num(block->info.serial, 10);
+			meminfo_str("\n");
+		}
+	}
 }
 
+/**
+ * read handler for /dev/meminfo
+ *
+ * the report is taken when reading starts (at offset 0), so it stays
+ * consistent across reads
+ *
+ * @return number of bytes read, 0 at the end of the report
+ */
+int32_t meminfo_read(file_info_t *file, uint8_t *buf, int32_t length) {
+	uint32_t flags;
+	uint32_t count;
+
+	if (file->pos == 0) {
+		block_interrupts(&flags);
+		meminfo_render();
+		restore_interrupts(flags);
+	}
+	if (length <= 0 || file->pos >= meminfo_len) {
+		return 0;
+	}
+	count = meminfo_len - file->pos;
+	if (count > length) {
+		count = length;
+	}
+	if (copy_to_user(buf, meminfo + file->pos, count) != 0) {
+		return -1;
+	}
+	file->pos += count;
+	return count;
+}
+#endif
@@ -3,10 +3,26 @@
 
 #include "lib.h"
 
-#define STORAGE_BYTES MB(24)
+// largest buffer kmalloc_dma hands out, the most an ISA DMA transfer can cover
+#define DMA_MAX_BYTES KB(64)
+
+// MEM_PROFILE (make MEM_PROFILE=1) records allocation sites and heap
+// statistics, readable from /dev/meminfo; it is off by default
+
+#ifdef MEM_PROFILE
+#include "fs.h"
+#endif
 
 void *kmalloc(uint32_t size);
+void *kzalloc(uint32_t size);
+void *kmalloc_aligned(uint32_t size, uint32_t align);
 void kfree(void *ptr);
-void init_mem();
+void *kmalloc_dma(uint32_t size);
+void kfree_dma(void *ptr, uint32_t size);
+void kzero_idle();
+int32_t init_mem();
+#ifdef MEM_PROFILE
+int32_t meminfo_read(file_info_t *file, uint8_t *buf, int32_t length);
+#endif
 
 #endif
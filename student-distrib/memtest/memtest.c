@@ -0,0 +1,321 @@
+/**
+ * @file memtest.c
+ *
+ * @brief host stress test of the kernel allocator (mem.c)
+ *
+ * Runs the same randomized trace of kmalloc/kfree/realloc against the TLSF
+ * allocator and the region-list allocator it replaced (regions.c), timing
+ * both. Every live block is filled with a pattern that is checked before it
+ * is freed or moved, and no two live blocks may overlap. A second trace
+ * exercises the rest of the TLSF interface (kzalloc, kmalloc_aligned,
+ * double and interior frees, kzero_idle) and checks the heap's invariants
+ * as it goes (tlsf_check).
+ *
+ * usage: memtest [ops [seed]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// the kernel side, built without the host's headers
+void *kmalloc(unsigned int size);
+void *kzalloc(unsigned int size);
+void *kmalloc_aligned(unsigned int size, unsigned int align);
+void kfree(void *ptr);
+void kzero_idle(void);
+int init_mem(void);
+int tlsf_check(int full);
+unsigned int tlsf_empty_pools(void);
+unsigned int tlsf_pools(void);
+extern const char *tlsf_check_error;
+
+void *region_kmalloc(unsigned int size);
+void region_kfree(void *ptr);
+void region_init_mem(void);
+
+// blocks live at once; the region allocator runs out of region descriptors
+// (MAX_REGIONS) well before it runs out of memory, so this stays modest
+#define MAX_LIVE 128
+// ops between heap checks in the TLSF trace
+#define CHECK_EVERY 1000
+// kmalloc hands out blocks aligned to this
+#define TLSF_ALIGN 8
+
+typedef struct allocator {
+	const char *name;
+	void *(*alloc)(unsigned int size);
+	void (*free)(void *ptr);
+} allocator_t;
+
+typedef struct live {
+	unsigned char *ptr;
+	unsigned int size;
+	unsigned int tag;
+} live_t;
+
+static live_t live[MAX_LIVE];
+static unsigned int rng_state;
+static unsigned int next_tag;
+static int errors;
+
+static unsigned int rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/**
+ * a request size: mostly small objects, some buffers, a few large tables
+ */
+static unsigned int random_size(void) {
+	unsigned int r = rng() % 100;
+	if (r < 70) {
+		return 1 + rng() % 256;
+	}
+	if (r < 95) {
+		return 256 + rng() % 8192;
+	}
+	return 8192 + rng() % (256 * 1024);
+}
+
+static unsigned char pattern(unsigned int tag, unsigned int i) {
+	return (unsigned char) (tag * 31 + i * 7 + 1);
+}
+
+static void fail(const char *name, const char *what, unsigned int op) {
+	printf("%s: op %u: %s\n", name, op, what);
+	errors++;
+}
+
+static void fill(live_t *block, unsigned int from) {
+	unsigned int i;
+	for (i = from; i < block->size; i++) {
+		block->ptr[i] = pattern(block->tag, i);
+	}
+}
+
+static int intact(live_t *block, unsigned int length) {
+	unsigned int i;
+	for (i = 0; i < length; i++) {
+		if (block->ptr[i] != pattern(block->tag, i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @return whether [ptr, ptr + size) overlaps a live block other than skip
+ */
+static int overlaps(unsigned char *ptr, unsigned int size, live_t *skip) {
+	unsigned int i;
+	for (i = 0; i < MAX_LIVE; i++) {
+		if (&live[i] != skip && live[i].ptr != NULL &&
+				ptr < live[i].ptr + live[i].size && live[i].ptr < ptr + size) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * check a new block and start tracking it
+ */
+static void track(const char *name, live_t *block, unsigned char *ptr,
+		unsigned int size, unsigned int align, unsigned int op) {
+	if ((unsigned long) ptr % align != 0) {
+		fail(name, "block is misaligned", op);
+	}
+	if (overlaps(ptr, size, block)) {
+		fail(name, "block overlaps a live block", op);
+	}
+	block->ptr = ptr;
+	block->size = size;
+	block->tag = next_tag++;
+}
+
+/**
+ * run the common trace: allocate into empty slots, and free or reallocate
+ * (allocate, copy, free) full ones
+ *
+ * @return failed allocations
+ */
+static unsigned int run_trace(allocator_t *a, unsigned int ops,
+		unsigned int seed, unsigned int align) {
+	unsigned int failed = 0;
+	unsigned int op, size;
+	unsigned char *ptr;
+	live_t *block;
+	live_t moved;
+
+	rng_state = seed;
+	for (op = 0; op < ops; op++) {
+		block = &live[rng() % MAX_LIVE];
+		if (block->ptr == NULL) {
+			size = random_size();
+			ptr = a->alloc(size);
+			if (ptr == NULL) {
+				failed++;
+				continue;
+			}
+			track(a->name, block, ptr, size, align, op);
+			fill(block, 0);
+		} else if (!intact(block, block->size)) {
+			fail(a->name, "live block was overwritten", op);
+			block->ptr = NULL;
+		} else if (rng() % 100 < 60) {
+			a->free(block->ptr);
+			block->ptr = NULL;
+		} else {
+			size = random_size();
+			ptr = a->alloc(size);
+			if (ptr == NULL) {
+				failed++;
+				continue;
+			}
+			moved = *block;
+			memcpy(ptr, block->ptr, size < block->size ? size : block->size);
+			track(a->name, block, ptr, size, align, op);
+			block->tag = moved.tag;
+			if (!intact(block, size < moved.size ? size : moved.size)) {
+				fail(a->name, "realloc lost the contents", op);
+			}
+			fill(block, moved.size < size ? moved.size : size);
+			a->free(moved.ptr);
+		}
+	}
+	return failed;
+}
+
+/**
+ * free every live block, checking it on the way
+ */
+static void free_all(allocator_t *a, unsigned int op) {
+	unsigned int i;
+	for (i = 0; i < MAX_LIVE; i++) {
+		if (live[i].ptr == NULL) {
+			continue;
+		}
+		if (!intact(&live[i], live[i].size)) {
+			fail(a->name, "live block was overwritten", op);
+		}
+		a->free(live[i].ptr);
+		live[i].ptr = NULL;
+	}
+}
+
+static void check_heap(int full, unsigned int op) {
+	if (tlsf_check(full) != 0) {
+		fail("tlsf", tlsf_check_error, op);
+	}
+}
+
+/**
+ * the TLSF-only trace: the common operations plus kzalloc, kmalloc_aligned,
+ * frees that must be ignored, and idle-time zeroing, with the heap checked
+ * every CHECK_EVERY ops
+ */
+static void run_tlsf_trace(unsigned int ops, unsigned int seed) {
+	unsigned int op, size, align, i, r;
+	unsigned char *ptr;
+	unsigned char *stale;
+	live_t *block;
+
+	rng_state = seed;
+	for (op = 0; op < ops; op++) {
+		if (op % CHECK_EVERY == 0) {
+			check_heap(0, op);
+		}
+		block = &live[rng() % MAX_LIVE];
+		r = rng() % 100;
+		if (block->ptr == NULL) {
+			size = random_size();
+			align = TLSF_ALIGN;
+			if (r < 20) {
+				ptr = kzalloc(size);
+				for (i = 0; ptr != NULL && i < size; i++) {
+					if (ptr[i] != 0) {
+						fail("tlsf", "kzalloc block is not zeroed", op);
+						break;
+					}
+				}
+			} else if (r < 30) {
+				align = 16 << (rng() % 9);
+				ptr = kmalloc_aligned(size, align);
+			} else {
+				ptr = kmalloc(size);
+			}
+			if (ptr == NULL) {
+				continue;
+			}
+			track("tlsf", block, ptr, size, align, op);
+			fill(block, 0);
+		} else if (!intact(block, block->size)) {
+			fail("tlsf", "live block was overwritten", op);
+			block->ptr = NULL;
+		} else if (r < 50) {
+			// freeing the middle of a block is ignored
+			if (block->size > TLSF_ALIGN) {
+				kfree(block->ptr + TLSF_ALIGN);
+			}
+			stale = block->ptr;
+			kfree(stale);
+			block->ptr = NULL;
+			// and so is freeing it again, merged into a neighbour or not
+			kfree(stale);
+		} else if (r < 60) {
+			for (i = 0; i < 8; i++) {
+				kzero_idle();
+			}
+		}
+	}
+	free_all(&(allocator_t) {"tlsf", kmalloc, kfree}, op);
+	for (i = 0; i < 100000; i++) {
+		kzero_idle();
+	}
+	check_heap(1, op);
+}
+
+int main(int argc, char **argv) {
+	allocator_t allocators[] = {
+		{"tlsf", kmalloc, kfree},
+		{"regions", region_kmalloc, region_kfree},
+	};
+	unsigned int ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+	unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+	unsigned int failed;
+	unsigned int i;
+	clock_t start;
+
+	if (seed == 0) {
+		seed = 1;
+	}
+	if (init_mem() != 0) {
+		printf("tlsf: init_mem failed\n");
+		return 1;
+	}
+	region_init_mem();
+
+	for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		start = clock();
+		failed = run_trace(&allocators[i], ops, seed, i == 0 ? TLSF_ALIGN : 1);
+		printf("%-8s %u ops, %u failed allocations, %.0f ms\n",
+				allocators[i].name, ops, failed,
+				(clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+		free_all(&allocators[i], ops);
+	}
+
+	check_heap(1, ops);
+	if (tlsf_empty_pools() != tlsf_pools()) {
+		fail("tlsf", "heap did not coalesce back to whole pools", ops);
+	}
+	run_tlsf_trace(ops, seed + 1);
+	if (tlsf_empty_pools() != tlsf_pools()) {
+		fail("tlsf", "heap did not coalesce back to whole pools", ops);
+	}
+
+	printf(errors == 0 ? "memtest: ok\n" : "memtest: %d errors\n", errors);
+	return errors != 0;
+}
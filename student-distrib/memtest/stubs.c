@@ -0,0 +1,52 @@
+/**
+ * @file stubs.c
+ *
+ * @brief what the allocators need from the rest of the kernel, on the host
+ *
+ * Frames come from a static arena that stands in for physical memory: a
+ * "physical address" is the arena address minus PHYSMAP_BASE, so that
+ * phys_to_virt gives the arena address back. Interrupts have nothing to
+ * block.
+ */
+#include "../lib.h"
+#include "../spinlock.h"
+#include "../frame.h"
+
+// 4MB frames in the arena, as much memory as the old allocator's storage
+#define ARENA_FRAMES 6
+
+static uint8_t arena[ARENA_FRAMES][MB(4)] __attribute__((aligned(FRAME_SIZE)));
+static uint32_t arena_used;
+
+void* memset(void* s, int32_t c, uint32_t n) {
+	volatile uint8_t *p = s;
+	while (n-- > 0) {
+		*p++ = c;
+	}
+	return s;
+}
+
+void block_interrupts(uint32_t *flags) {
+	*flags = 0;
+}
+
+void restore_interrupts(uint32_t flags) {
+}
+
+/**
+ * hand out the next 4MB frame of the arena; the heap never gives its pools
+ * back, and only asks for 4MB frames
+ */
+uint32_t frame_alloc(uint32_t order) {
+	if (order != FRAME_ORDER_4MB || arena_used == ARENA_FRAMES) {
+		return 0;
+	}
+	return virt_to_phys(arena[arena_used++]);
+}
+
+uint32_t frame_alloc_dma(uint32_t order) {
+	return 0;
+}
+
+void frame_free(uint32_t addr, uint32_t order) {
+}
@@ -0,0 +1,161 @@
+/**
+ * @file tlsf.c
+ *
+ * @brief mem.c, built for the host, with a consistency check of its heap
+ *
+ * tlsf_check walks every pool block by block and every free list, and
+ * reports the first thing that does not add up.
+ */
+#include "../mem.c"
+
+int32_t tlsf_check(int32_t full);
+uint32_t tlsf_empty_pools(void);
+uint32_t tlsf_pools(void);
+
+// what the last failed tlsf_check found
+const int8_t *tlsf_check_error;
+
+/**
+ * check that a free block is on the free list its size belongs on
+ */
+static int32_t on_free_list(block_header_t *block) {
+	block_header_t *entry;
+	int32_t fl, sl;
+
+	mapping_insert(block_size(block), &fl, &sl);
+	for (entry = free_blocks[fl][sl]; entry != NULL; entry = entry->next_free) {
+		if (entry == block) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * check the heap's invariants
+ *
+ * - in every pool the blocks tile the pool up to its sentinel, and each is
+ *   its successor's prev_phys
+ * - BLOCK_PREV_FREE matches the predecessor, and no two free blocks are
+ *   neighbours (kfree coalesces at once)
+ * - every free block is on the right free list, every block on a free list
+ *   is free, and the bitmaps say which lists are non-empty
+ * - free blocks' dirty marks cover at least their links and at most the
+ *   block; with full set, everything past the mark is checked to be zero
+ *
+ * @return 0 if the heap is consistent, -1 with tlsf_check_error set if not
+ */
+int32_t tlsf_check(int32_t full) {
+	block_header_t *block;
+	block_header_t *prev;
+	uint32_t walked_free = 0;
+	uint32_t listed_free = 0;
+	uint32_t i, j;
+	int32_t fl, sl;
+	uint8_t *byte;
+
+	for (i = 0; i < num_pools; i++) {
+		prev = NULL;
+		block = (block_header_t*) pools[i];
+		while (1) {
+			if (block->prev_phys != prev) {
+				tlsf_check_error = "prev_phys does not point at the previous block";
+				return -1;
+			}
+			if (!(block->size & BLOCK_PREV_FREE) !=
+					!(prev != NULL && (prev->size & BLOCK_FREE))) {
+				tlsf_check_error = "BLOCK_PREV_FREE does not match the previous block";
+				return -1;
+			}
+			if (block_size(block) == 0) {
+				break;
+			}
+			if ((uint8_t*) block_next(block) > pools[i] + POOL_BYTES - BLOCK_OVERHEAD) {
+				tlsf_check_error = "block runs past the end of its pool";
+				return -1;
+			}
+			if (block->size & BLOCK_FREE) {
+				walked_free++;
+				if (block->size & BLOCK_PREV_FREE) {
+					tlsf_check_error = "two free blocks next to each other";
+					return -1;
+				}
+				if (!on_free_list(block)) {
+					tlsf_check_error = "free block missing from its free list";
+					return -1;
+				}
+				if (block->dirty < FREE_HEADER_BYTES ||
+						block->dirty > block_size(block)) {
+					tlsf_check_error = "dirty mark out of range";
+					return -1;
+				}
+				if (full) {
+					byte = (uint8_t*) block_to_ptr(block);
+					for (j = block->dirty; j < block_size(block); j++) {
+						if (byte[j] != 0) {
+							tlsf_check_error = "non-zero byte past the dirty mark";
+							return -1;
+						}
+					}
+				}
+			}
+			prev = block;
+			block = block_next(block);
+		}
+		if ((uint8_t*) block != pools[i] + POOL_BYTES - BLOCK_OVERHEAD) {
+			tlsf_check_error = "sentinel is not at the end of its pool";
+			return -1;
+		}
+	}
+
+	for (fl = 0; fl < FL_INDEX_COUNT; fl++) {
+		for (sl = 0; sl < SL_INDEX_COUNT; sl++) {
+			if (!(sl_bitmap[fl] & (1 << sl)) != (free_blocks[fl][sl] == NULL)) {
+				tlsf_check_error = "second-level bitmap does not match its list";
+				return -1;
+			}
+			for (block = free_blocks[fl][sl]; block != NULL;
+					block = block->next_free) {
+				listed_free++;
+				if (!(block->size & BLOCK_FREE)) {
+					tlsf_check_error = "allocated block on a free list";
+					return -1;
+				}
+			}
+		}
+		if (!(fl_bitmap & (1 << fl)) != (sl_bitmap[fl] == 0)) {
+			tlsf_check_error = "first-level bitmap does not match its lists";
+			return -1;
+		}
+	}
+	if (walked_free != listed_free) {
+		tlsf_check_error = "free lists hold blocks that are not in any pool";
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @return the number of pools that are one free block, all of their space
+ */
+uint32_t tlsf_empty_pools(void) {
+	block_header_t *block;
+	uint32_t count = 0;
+	uint32_t i;
+
+	for (i = 0; i < num_pools; i++) {
+		block = (block_header_t*) pools[i];
+		if ((block->size & BLOCK_FREE) &&
+				block_size(block) == POOL_BYTES - 2 * BLOCK_OVERHEAD) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/**
+ * @return the number of pools the heap has grown to
+ */
+uint32_t tlsf_pools(void) {
+	return num_pools;
+}
@@ -10,6 +10,11 @@
 #define MULTIBOOT_HEADER_MAGIC      0x1BADB002
 #define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
 
+/* Flags in multiboot_info.flags saying which fields are valid. */
+#define MULTIBOOT_INFO_MEMORY           0x00000001
+#define MULTIBOOT_INFO_MODS             0x00000008
+#define MULTIBOOT_INFO_MEM_MAP          0x00000040
+
 #ifndef ASM
 
 /* Types */
@@ -4,6 +4,8 @@
 #include "lib.h"
 #include "task.h"
 #include "mem.h"
+#include "frame.h"
+#include "swap.h"
 
 /**
  * @file paging.c
@@ -14,16 +16,28 @@
  * initialize them for processes.
  */
 
+// The kernel's page directory (process 0's), which every other directory
+// copies its kernel entries from, and the 0-4MB page table they all share.
+static page_dir_entry_t kernel_pd[1024] __attribute__((aligned(KB(4))));
+static page_table_entry_t kernel_pt[1024] __attribute__((aligned(KB(4))));
+
+// Unmapping more than this flushes the whole TLB instead of single pages.
+#define INVLPG_MAX_BYTES KB(64)
+
 // Local data structure to hold paging info/addresses used in functions.
-static page_data_t page_tables[MAX_PROCESSES] __attribute__((aligned(KB(4))));
+static page_data_t page_tables[MAX_PROCESSES];
 static uint32_t asm_address;
 
 // Local functions used for mapping.
 void set_pde(uint32_t index, uint32_t address, uint32_t flag, uint32_t pid);
 void set_pte(uint32_t index, uint32_t address, uint32_t flags, uint32_t pid, uint32_t pt_index);
+static uint32_t table_address(void *table);
+static void *alloc_table(void);
+static void load_cr3(uint32_t pid);
 
-// Global variable.
+// Global variables.
 uint32_t page_pid = 0;
+tlb_stats_t tlb_stats;
 
 /**
  * Function to initialize paging for the system.  Only needs to be called once.
@@ -35,7 +49,7 @@ void init_paging() {
     // enable bits 4 and 7, pse and pge
     asm volatile ("               \
             movl %%cr0, %%eax   \n\
-            orl $0x1000, %%eax  \n\
+            orl $0x10000, %%eax \n\
             movl %%eax, %%cr0   \n\
                                   \
             movl %%cr4, %%eax   \n\
@@ -46,57 +60,195 @@ void init_paging() {
             : "eax"
             );
 
-    int i, j;
+    int j;
+
+    page_tables[0].pd = kernel_pd;
+    page_tables[0].pt[KERNEL_PT] = kernel_pt;
+
+    // Map the first page table (kernel 0MB-4MB, except for the first 4KB).
+    // Other processes get the same table through their copy of the kernel's
+    // entries (see new_page_directory).
+    for(j = 1; j < 1024; j++)
+    {
+        map_4kb_page(j << 12, j << 12, 0, KernelPrivilege, KERNEL_PT);
+    }
+
+    //Lets all processes access 4-8MB kernel page.
+    map_4mb_page(MB(4), MB(4), 0, KernelPrivilege);
+
+    // Process images, the kernel heap and everything else allocated from the
+    // frame allocator are reached through the physmap (see map_physmap).
+
+	// Loads the page tables for process 0 (the kernel).
+    page_pid = 0;
+    load_cr3(0);
+}
+
+/**
+ * Function to map physical memory at PHYSMAP_BASE in the kernel's page
+ * directory, so the kernel can reach any frame.  Called once the amount of
+ * memory is known, before any other process exists.
+ * @param bytes The amount of physical memory (from address 0) to map.
+ */
+void map_physmap(uint32_t bytes)
+{
+    uint32_t addr;
+
+    for(addr = 0; addr < bytes && addr < PHYSMAP_SIZE; addr += MB(4))
+    {
+        map_4mb_page(addr, PHYSMAP_BASE + addr, 0, KernelPrivilege);
+    }
+}
+
+/**
+ * Function to give a process a page directory, with the kernel's entries
+ * (the shared 0-4MB page table, the 4-8MB kernel page and the physmap, which
+ * holds the kernel heap) and an empty user page table.
+ * @param pid The process ID that we want a page directory for.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int32_t new_page_directory(uint32_t pid)
+{
+    page_data_t *data = &page_tables[pid];
+    int i;
+
+    data->pd = alloc_table();
+    if(data->pd == NULL)
+    {
+        return -1;
+    }
+    data->pt[USER_PT] = alloc_table();
+    if(data->pt[USER_PT] == NULL)
+    {
+        frame_free(virt_to_phys(data->pd), FRAME_ORDER_4KB);
+        data->pd = NULL;
+        return -1;
+    }
+    data->pt[KERNEL_PT] = kernel_pt;
+    data->pt[VIDMAP_PT] = NULL;
 
-    for(i = 0; i < MAX_PROCESSES; i++)
+    for(i = 0; i < 1024; i++)
     {
-		// Map the first page table (kernel 0MB-4MB, except for the first 4KB). 
-        for(j = 1; j < 1024; j++)
+        if(i < USER_BASE / MB(4) || i >= PHYSMAP_BASE / MB(4))
         {
-            map_4kb_page(j << 12, j << 12, i, 0, KernelPrivilege);
+            data->pd[i] = kernel_pd[i];
         }
+    }
+    set_pde(USER_BASE / MB(4), table_address(data->pt[USER_PT]), 0x1F, pid);
+    return 0;
+}
 
-        //Lets all processes access 4-8MB kernel page.
-        map_4mb_page(MB(4), MB(4), i, KernelPrivilege);
+/**
+ * Function to free a process's page directory and page tables.  Its user
+ * pages must have been freed already (see free_user_pages), and the directory
+ * must not be loaded.
+ * @param pid The process ID whose page directory we want to free.
+ */
+void free_page_directory(uint32_t pid)
+{
+    page_data_t *data = &page_tables[pid];
 
-        // Map kmalloc region
-        int page_num;
-        int total_pages = STORAGE_BYTES/MB(4);
-        if (STORAGE_BYTES % MB(4) != 0) {
-            total_pages++;
-        }
-        for (page_num = 0; page_num < total_pages; page_num++) {
-            map_4mb_page(MB(192 + page_num * 4), MB(192 + page_num * 4), i, KernelPrivilege);
-        //    map_4mb_page(MB(192 + page_num * 4), MB(192 + page_num * 4), i, UserPrivilege);
-        }
+    if(data->pt[VIDMAP_PT] != NULL)
+    {
+        frame_free(virt_to_phys(data->pt[VIDMAP_PT]), FRAME_ORDER_4KB);
     }
+    if(data->pt[USER_PT] != NULL)
+    {
+        frame_free(virt_to_phys(data->pt[USER_PT]), FRAME_ORDER_4KB);
+    }
+    if(data->pd != NULL)
+    {
+        frame_free(virt_to_phys(data->pd), FRAME_ORDER_4KB);
+    }
+    data->pd = NULL;
+    data->pt[KERNEL_PT] = NULL;
+    data->pt[VIDMAP_PT] = NULL;
+    data->pt[USER_PT] = NULL;
+}
+
+/**
+ * Function to allocate a zeroed page directory or page table.
+ * @return Its physmap address, or NULL if memory ran out.
+ */
+static void *alloc_table(void)
+{
+    uint32_t frame = frame_alloc(FRAME_ORDER_4KB);
 
-    /** for each process (excluding kernel process case)
-     *     - gives kernel permission for current processes physical memory
-     *     - gives process permission for current processes physical memory at kernel priv
-     *     - gives process mapping to virtual 128MB at user priv
-     */
-    for(i = 1; i < MAX_PROCESSES; i++)
+    if(frame == 0)
     {
-        map_4mb_page(MB(4 + 4*i), MB(4 + 4*i), 0, KernelPrivilege);
-        map_4mb_page(MB(4 + 4*i), MB(4 + 4*i), i, KernelPrivilege);
-        map_4mb_page(MB(4 + 4*i), MB(128), i, UserPrivilege);
+        return NULL;
     }
+    memset(phys_to_virt(frame), 0, KB(4));
+    return phys_to_virt(frame);
+}
 
-	// Loads the page tables for process 0 (the kernel).
-    load_pages(0);
+/**
+ * Function to find the physical address of a page directory or page table,
+ * which is either in the kernel image (identity mapped) or in the physmap.
+ * @param table The table's kernel address.
+ * @return Its physical address.
+ */
+static uint32_t table_address(void *table)
+{
+    if((uint32_t)table >= PHYSMAP_BASE)
+    {
+        return virt_to_phys(table);
+    }
+    return (uint32_t)table;
 }
 
 /**
- * Function to switch page tables for a given process.
+ * Function to switch page tables for a given process.  Nothing is done if
+ * they are already loaded, so the TLB is only flushed on a real switch (and
+ * then only of user entries, since the kernel's are global).
  * @param pid The process ID whose page tables we want to load.
  */
 void load_pages(uint32_t pid)
 {
+    if(pid == page_pid)
+    {
+        tlb_stats.switches_skipped++;
+        return;
+    }
     page_pid = pid;
-	
+    load_cr3(pid);
+}
+
+/**
+ * Function to flush the non-global entries of the TLB, for when many
+ * mappings of the loaded page tables changed.
+ */
+void flush_tlb(void)
+{
+    load_cr3(page_pid);
+}
+
+/**
+ * Function to drop the TLB entry of one page, global or not.  Needed
+ * whenever a present mapping of the loaded page tables, or of the shared
+ * kernel page table, is changed.
+ * @param v_addr A virtual address in the page.
+ */
+void invalidate_page(uint32_t v_addr)
+{
+    tlb_stats.invlpgs++;
+    asm volatile ("invlpg (%0)"
+            : /* no outputs */
+            : "r" (v_addr)
+            : "memory"
+            );
+}
+
+/**
+ * Function to put a process's page directory in CR3, flushing the TLB.
+ * @param pid The process ID whose page tables we want to load.
+ */
+static void load_cr3(uint32_t pid)
+{
+    tlb_stats.cr3_loads++;
+
     // Determine the desired page table address.
-    asm_address = (uint32_t)&(page_tables[pid].pd);
+    asm_address = table_address(page_tables[pid].pd);
 
     // Put the address in CR3.
     asm volatile ("               \
@@ -148,10 +300,11 @@ void map_4mb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t pr
 	// Determine the correct index in the page directory.
     uint32_t index = v_addr / MB(4);
 	
-	// Set the entry.
+	// Set the entry.  Kernel pages are the same in every address space, so
+	// they are global and survive CR3 loads.
     if(privilege == KernelPrivilege)
     {
-        set_pde(index, p_addr, 0x09B, pid);
+        set_pde(index, p_addr, 0x09B | PAGE_GLOBAL, pid);
     }
     else
     {
@@ -165,23 +318,45 @@ void map_4mb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t pr
  * @param v_addr The virtual address that we want to map.
  * @param pid The process ID that we want to map the page in.
  * @param privilege The privelege that we want to use to map the process (user or kernel).
- * @param ptid The index of the page table that we want to modify. (0 is the 0-4MB kernel page, 1 is used for vidmap)
+ * @param ptid The index of the page table that we want to modify. (0 is the 0-4MB kernel page shared by every process, 1 is used for vidmap)
+ * @return 0 on success, -1 if the page table could not be allocated.
  */
-void map_4kb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t privilege, uint32_t ptid)
+int32_t map_4kb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t privilege, uint32_t ptid)
 {
 	// Determine relevant indices.
     uint32_t pt_addr;
     uint32_t pd_index = v_addr / MB(4);
     uint32_t pt_index = (v_addr % MB(4)) / KB(4);
+    uint32_t old_flags;
+
+    // Allocate the page table the first time it is used.
+    if(page_tables[pid].pt[ptid] == NULL)
+    {
+        page_tables[pid].pt[ptid] = alloc_table();
+        if(page_tables[pid].pt[ptid] == NULL)
+        {
+            return -1;
+        }
+    }
 
 	// Determine the address of the page table.
-    pt_addr = (uint32_t)&(page_tables[pid].pt[ptid]);
+    pt_addr = table_address(page_tables[pid].pt[ptid]);
 
     // Map the page table in the page directory.
     set_pde(pd_index, pt_addr, 0x1F, pid);
 
-    // Set the relevant page table entry.
-    set_pte(pt_index, p_addr, 0x1F, pid, ptid);
+    // Set the relevant page table entry.  The shared kernel table is the
+    // same everywhere, so its pages are global.
+    old_flags = page_tables[pid].pt[ptid][pt_index].flags;
+    set_pte(pt_index, p_addr, ptid == KERNEL_PT ? 0x1F | PAGE_GLOBAL : 0x1F,
+            pid, ptid);
+
+    // Drop a stale translation of a page that was already mapped.
+    if((old_flags & PAGE_PRESENT) && (ptid == KERNEL_PT || pid == page_pid))
+    {
+        invalidate_page(v_addr);
+    }
+    return 0;
 }
 
 /**
@@ -206,12 +381,17 @@ void remap_4kb_page(uint32_t new_p_addr, uint32_t new_v_addr, uint32_t pid, priv
 void clear_page_table(uint32_t pid, uint32_t ptid)
 {
     int i;
+
+    if(page_tables[pid].pt[ptid] == NULL)
+    {
+        return;
+    }
 	
 	// For every index in the page directory/table:
     for(i = 0; i < 1024; i++)
     {
         // If a page directory entry points to this page table, just remove it.
-        if(page_tables[pid].pd[i].addr_shifted<<12 == (uint32_t)page_tables[pid].pt[ptid])
+        if(page_tables[pid].pd[i].addr_shifted<<12 == table_address(page_tables[pid].pt[ptid]))
         {
             page_tables[pid].pd[i].addr = 0;
         }
@@ -219,6 +399,282 @@ void clear_page_table(uint32_t pid, uint32_t ptid)
         // Also, clear the entry in this page table.
         page_tables[pid].pt[ptid][i].addr = 0;
     }
+
+    if(pid == page_pid)
+    {
+        flush_tlb();
+    }
+}
+
+/**
+ * Function to map a 4KB page into a process's user address space.
+ * @param p_addr The physical address that we want to map.
+ * @param v_addr The virtual address that we want to map, in the user address
+ * space.
+ * @param pid The process ID that we want to map the page in (not the kernel).
+ * @param flags PAGE_WRITE for a writable page (it is read-only otherwise), and
+ * PAGE_FOREIGN if unmapping it should leave the frame alone.
+ */
+void map_user_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, uint32_t flags)
+{
+    uint32_t index = (v_addr - USER_BASE) / KB(4);
+    uint32_t old_flags = page_tables[pid].pt[USER_PT][index].flags;
+
+    set_pte(index, p_addr,
+            (0x1F & ~PAGE_WRITE) | (flags & (PAGE_WRITE | PAGE_FOREIGN)),
+            pid, USER_PT);
+
+    // Drop a stale translation of a page that was already mapped.
+    if((old_flags & PAGE_PRESENT) && pid == page_pid)
+    {
+        invalidate_page(v_addr);
+    }
+}
+
+/**
+ * Function to give a process fresh, zeroed 4KB pages over part of its user
+ * address space.  Pages that are already mapped are left as they are.
+ * @param pid The process ID that we want to map the pages in.
+ * @param start The start of the virtual range (rounded down to a page).
+ * @param end The end of the virtual range (exclusive).
+ * @return 0 on success, -1 if the range is outside the user address space or
+ * memory ran out (pages mapped before that stay mapped).
+ */
+int32_t map_user_pages(uint32_t pid, uint32_t start, uint32_t end)
+{
+    page_table_entry_t *pt = page_tables[pid].pt[USER_PT];
+    uint32_t addr;
+    uint32_t frame;
+
+    start &= ~(KB(4) - 1);
+    if(start < USER_BASE || end > USER_LIMIT)
+    {
+        return -1;
+    }
+
+    for(addr = start; addr < end; addr += KB(4))
+    {
+        if(pt[(addr - USER_BASE) / KB(4)].flags & (PAGE_PRESENT | PAGE_SWAPPED))
+        {
+            continue;
+        }
+        frame = swap_frame_alloc();
+        if(frame == 0)
+        {
+            return -1;
+        }
+        memset(phys_to_virt(frame), 0, KB(4));
+        map_user_page(frame, addr, pid, PAGE_WRITE);
+    }
+    return 0;
+}
+
+/**
+ * Function to unmap part of a process's user address space, dropping its
+ * references to the frames there.
+ * @param pid The process ID that we want to unmap the pages in.
+ * @param start The start of the virtual range (rounded down to a page).
+ * @param end The end of the virtual range (exclusive).
+ * @return The number of pages that were mapped (or swapped out).
+ */
+uint32_t unmap_user_pages(uint32_t pid, uint32_t start, uint32_t end)
+{
+    page_table_entry_t *pt = page_tables[pid].pt[USER_PT];
+    uint32_t addr;
+    uint32_t count = 0;
+    page_table_entry_t *pte;
+    // Whether to drop the stale translations one page at a time.
+    uint32_t invlpg = pid == page_pid && end - start <= INVLPG_MAX_BYTES;
+
+    start &= ~(KB(4) - 1);
+    if(start < USER_BASE || end > USER_LIMIT)
+    {
+        return 0;
+    }
+
+    for(addr = start; addr < end; addr += KB(4))
+    {
+        pte = &pt[(addr - USER_BASE) / KB(4)];
+        if(pte->flags & PAGE_SWAPPED)
+        {
+            swap_free(pte->addr_shifted);
+            count++;
+        }
+        if(!(pte->flags & PAGE_PRESENT))
+        {
+            pte->addr = 0;
+            continue;
+        }
+        if(!(pte->flags & PAGE_FOREIGN))
+        {
+            frame_free(pte->addr_shifted << 12, FRAME_ORDER_4KB);
+        }
+        count++;
+        pte->addr = 0;
+        if(invlpg)
+        {
+            invalidate_page(addr);
+        }
+    }
+
+    // Otherwise flush them all at once if these are the loaded page tables.
+    if(count != 0 && pid == page_pid && !invlpg)
+    {
+        flush_tlb();
+    }
+    return count;
+}
+
+/**
+ * Function to unmap a process's user pages and drop its references to their
+ * frames (which frees those that are not shared).
+ * The process's page directory must not be loaded.
+ * @param pid The process ID whose user pages we want to free.
+ */
+void free_user_pages(uint32_t pid)
+{
+    page_table_entry_t *pt = page_tables[pid].pt[USER_PT];
+    int i;
+
+    for(i = 0; i < 1024; i++)
+    {
+        if((pt[i].flags & PAGE_PRESENT) && !(pt[i].flags & PAGE_FOREIGN))
+        {
+            frame_free(pt[i].addr_shifted << 12, FRAME_ORDER_4KB);
+        }
+        else if(pt[i].flags & PAGE_SWAPPED)
+        {
+            swap_free(pt[i].addr_shifted);
+        }
+        pt[i].addr = 0;
+    }
+}
+
+/**
+ * Function to find the page table entry of a page in a process's user
+ * address space.
+ * @param pid The process ID.
+ * @param v_addr A virtual address in the user address space.
+ * @return The entry, or NULL if the address is outside the user address
+ * space or the process has no page tables.
+ */
+page_table_entry_t *get_user_pte(uint32_t pid, uint32_t v_addr)
+{
+    if(pid >= MAX_PROCESSES || page_tables[pid].pt[USER_PT] == NULL ||
+            v_addr < USER_BASE || v_addr >= USER_LIMIT)
+    {
+        return NULL;
+    }
+    return &page_tables[pid].pt[USER_PT][(v_addr - USER_BASE) / KB(4)];
+}
+
+/**
+ * Function to give a process a copy-on-write copy of another's user address
+ * space.  The frames are shared, and writable pages become read-only in both
+ * processes until one of them writes (see copy_on_write), except foreign
+ * pages, which stay shared as they are.  Swapped-out pages of the source are
+ * read back in first.
+ * @param from_pid The process ID to copy from, whose page tables are loaded.
+ * @param to_pid The process ID to copy to, whose user pages are all unmapped.
+ * @return 0 on success, -1 if memory ran out (pages copied before that stay
+ * mapped in to_pid).
+ */
+int32_t copy_user_pages(uint32_t from_pid, uint32_t to_pid)
+{
+    page_table_entry_t *from = page_tables[from_pid].pt[USER_PT];
+    page_table_entry_t *to = page_tables[to_pid].pt[USER_PT];
+    int i;
+
+    for(i = 0; i < 1024; i++)
+    {
+        if((from[i].flags & PAGE_SWAPPED) &&
+                swap_in(from_pid, USER_BASE + i * KB(4)) != 0)
+        {
+            flush_tlb();
+            return -1;
+        }
+        if(!(from[i].flags & PAGE_PRESENT))
+        {
+            continue;
+        }
+        if(!(from[i].flags & PAGE_FOREIGN))
+        {
+            frame_ref(from[i].addr_shifted << 12);
+            if(from[i].flags & PAGE_WRITE)
+            {
+                from[i].flags = (from[i].flags & ~PAGE_WRITE) | PAGE_COW;
+            }
+        }
+        to[i] = from[i];
+    }
+
+    // The source lost write access to its pages.
+    flush_tlb();
+    return 0;
+}
+
+/**
+ * Function to handle a write to a copy-on-write page: the process gets its
+ * own copy of the frame, or if no other process shares it any more, simply
+ * gets write access back.
+ * @param pid The process ID that wrote, whose page tables are loaded.
+ * @param v_addr The virtual address that was written.
+ * @return 0 on success, -1 if the page is not copy-on-write or memory ran
+ * out.
+ */
+int32_t copy_on_write(uint32_t pid, uint32_t v_addr)
+{
+    page_table_entry_t *pte = get_user_pte(pid, v_addr);
+    uint32_t page = v_addr & ~(KB(4) - 1);
+    uint32_t old_frame;
+    uint32_t frame;
+
+    if(pte == NULL || !(pte->flags & PAGE_PRESENT) || !(pte->flags & PAGE_COW))
+    {
+        return -1;
+    }
+    old_frame = pte->addr_shifted << 12;
+    if(frame_refs(old_frame) == 1)
+    {
+        map_user_page(old_frame, page, pid, PAGE_WRITE);
+        return 0;
+    }
+
+    frame = swap_frame_alloc();
+    if(frame == 0)
+    {
+        return -1;
+    }
+    copy_4kb_page(phys_to_virt(frame), phys_to_virt(old_frame));
+    map_user_page(frame, page, pid, PAGE_WRITE);
+    frame_free(old_frame, FRAME_ORDER_4KB);
+    return 0;
+}
+
+/**
+ * Function to make a present user page copy-on-write and point it at a frame
+ * with the same contents, freeing the frame it had.  Used to merge identical
+ * pages (see dedup.c).
+ * @param pid The process ID.
+ * @param v_addr The virtual address of the page.
+ * @param frame The frame to share, which already holds a reference for this
+ * mapping; it may be the page's own frame.
+ */
+void share_user_page(uint32_t pid, uint32_t v_addr, uint32_t frame)
+{
+    page_table_entry_t *pte = get_user_pte(pid, v_addr);
+    uint32_t old_frame = pte->addr_shifted << 12;
+
+    pte->flags = (pte->flags & ~PAGE_WRITE) | PAGE_COW;
+    pte->addr_shifted = frame >> 12;
+    if(pid == page_pid)
+    {
+        invalidate_page(v_addr);
+    }
+    if(old_frame != frame)
+    {
+        frame_free(old_frame, FRAME_ORDER_4KB);
+    }
 }
 
 /**
@@ -9,6 +9,38 @@
 #ifndef _PAGING_H
 #define _PAGING_H
 
+#include "types.h"
+#include "lib.h"
+
+// the user part of every address space; it is mapped with 4KB pages from
+// page table USER_PT
+#define USER_BASE MB(128)
+#define USER_LIMIT (USER_BASE + MB(4))
+
+// page tables of a process: the 0-4MB kernel table every process shares, the
+// vidmap table (allocated on first use) and the user table
+#define KERNEL_PT 0
+#define VIDMAP_PT 1
+#define USER_PT 2
+
+// page directory/table entry flags
+#define PAGE_PRESENT 0x1
+#define PAGE_WRITE 0x2
+// set by the processor when the page is used, and written to
+#define PAGE_ACCESSED 0x20
+#define PAGE_DIRTY 0x40
+// the mapping is the same in every address space and survives CR3 loads
+#define PAGE_GLOBAL 0x100
+// (available to software) the frame is not the process's to free, like file
+// data mapped in place or a shared memory segment; fork shares it as it is
+#define PAGE_FOREIGN 0x200
+// (available to software, in a page that is not present) the page is swapped
+// out, to the slot in the address bits (see swap.c)
+#define PAGE_SWAPPED 0x400
+// (available to software) the page is read-only because its frame is shared
+// with another process after fork; the first write copies it
+#define PAGE_COW 0x800
+
 /**
  * Enum to make privilege levels human-readable.
  */
@@ -18,13 +50,29 @@ typedef enum privilege_t {
 } privilege_t;
 
 /**
- * Struct to hold the physical page directories and page tables.
+ * Struct to hold a process's page directory and page tables.  The directory
+ * and the tables other than KERNEL_PT are frames reached through the physmap;
+ * unused ones are NULL.
  */
 typedef struct page_data_t {
-    page_dir_entry_t pd[1024] __attribute__((aligned(0x1000)));
-    page_table_entry_t pt[3][1024] __attribute__((aligned(0x1000)));
+    page_dir_entry_t *pd;
+    page_table_entry_t *pt[3];
 } page_data_t;
 
+/**
+ * Counters of TLB flushes, to measure what address space switches cost.
+ */
+typedef struct tlb_stats_t {
+    // CR3 loads, each flushing every non-global TLB entry
+    uint32_t cr3_loads;
+    // switches to the page tables that were already loaded
+    uint32_t switches_skipped;
+    // single pages dropped with invlpg
+    uint32_t invlpgs;
+} tlb_stats_t;
+
+extern tlb_stats_t tlb_stats;
+
 /**
  * (unused) struct to hold the physical page directories and page tables, along with process ID information.
  */
@@ -37,11 +85,24 @@ typedef struct page_info_t{
 // The functions only require the minimum amount of information to define a paging mapping.
 void init_paging(void);
 void load_pages(uint32_t pid);
+void flush_tlb(void);
+void invalidate_page(uint32_t v_addr);
+void map_physmap(uint32_t bytes);
 void map_4mb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t privilege);
-void map_4kb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t privilege, uint32_t ptid);
+int32_t map_4kb_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, privilege_t privilege, uint32_t ptid);
 void enable_paging(void);
+int32_t new_page_directory(uint32_t pid);
+void free_page_directory(uint32_t pid);
 void clear_page_table(uint32_t pid, uint32_t ptid);
 void remap_4kb_page(uint32_t new_p_addr, uint32_t new_v_addr, uint32_t pid, privilege_t new_privilege, uint32_t ptid);
 void copy_4kb_page(void* dest, void* src);
+void map_user_page(uint32_t p_addr, uint32_t v_addr, uint32_t pid, uint32_t flags);
+int32_t map_user_pages(uint32_t pid, uint32_t start, uint32_t end);
+uint32_t unmap_user_pages(uint32_t pid, uint32_t start, uint32_t end);
+void free_user_pages(uint32_t pid);
+page_table_entry_t *get_user_pte(uint32_t pid, uint32_t v_addr);
+int32_t copy_user_pages(uint32_t from_pid, uint32_t to_pid);
+int32_t copy_on_write(uint32_t pid, uint32_t v_addr);
+void share_user_page(uint32_t pid, uint32_t v_addr, uint32_t frame);
 
 #endif /* _PAGING_H */
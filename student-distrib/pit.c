@@ -6,6 +6,9 @@
 #include "task.h"
 
 volatile int pit_interrupt_occurred = 0;
+#ifdef MEM_PROFILE
+volatile uint32_t pit_ticks = 0;
+#endif
 
 /**
  * low-level interface to configure the PIT
@@ -80,6 +83,9 @@ void pit_handler(void)
     save_regs(regs);
 
     pit_interrupt_occurred = 1;
+#ifdef MEM_PROFILE
+    pit_ticks++;
+#endif
 
     send_eoi(0);
 
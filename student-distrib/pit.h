@@ -21,4 +21,9 @@ void pit_read(void);
 
 void pit_handler(void);
 
+#ifdef MEM_PROFILE
+// number of PIT interrupts since boot, for timestamping allocations
+extern volatile uint32_t pit_ticks;
+#endif
+
 #endif /* _PIT_H */
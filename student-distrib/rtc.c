@@ -5,6 +5,10 @@
 #include "lib.h"
 #include "keyboard.h"
 #include "spinlock.h"
+#include "mem.h"
+#include "uaccess.h"
+#include "dedup.h"
+#include "fdc.h"
 
 
 extern uint8_t cursor_on;
@@ -139,7 +143,14 @@ int32_t rtc_read(file_info_t *file, uint8_t* buf, int32_t length)
     sti();
     while(num_tics < desired_tics){
         cli();
-        schedule();
+        if (!schedule()) {
+            // nothing else can run; use the time to clear freed memory,
+            // merge identical pages and write back to or read ahead from
+            // the floppy
+            kzero_idle();
+            dedup_idle();
+            fdc_cache_idle();
+        }
         sti();
     }
     cli();
@@ -159,17 +170,23 @@ int32_t rtc_read(file_info_t *file, uint8_t* buf, int32_t length)
 int32_t rtc_write(file_info_t *file, const int8_t* buf, int32_t nbytes)
 {
     int32_t freq;
-    if (buf == NULL || nbytes == 0) {
+    union {
+        int8_t byte;
+        int16_t word;
+        int32_t dword;
+    } arg;
+    if (buf == NULL || (nbytes != 1 && nbytes != 2 && nbytes != 4)) {
+        return -1;
+    }
+    if (copy_from_user(&arg, buf, nbytes) != 0) {
         return -1;
     }
     if (nbytes == 1) {
-        freq = *buf;
+        freq = arg.byte;
     } else if (nbytes == 2) {
-        freq = *(int16_t *)buf;
-    } else if (nbytes == 4) {
-        freq = *(int32_t *)buf;
+        freq = arg.word;
     } else {
-        return -1;
+        freq = arg.dword;
     }
 
     if (rtc_set_freq(freq) == 0) {
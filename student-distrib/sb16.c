@@ -8,6 +8,8 @@
 #include "task.h"
 #include "spinlock.h"
 #include "mem.h"
+#include "slab.h"
+#include "frame.h"
 
 /* 
  * This driver is shamelessly adapted from
@@ -103,10 +105,12 @@ uint8_t dma_inb(uint16_t port) {
 }
 
 #define CHUNK_SIZE (32*1024)
-static int8_t dma_buffer[CHUNK_SIZE*2] __attribute__((aligned(64*1024)));
-static int8_t *first_block = dma_buffer;
-static int8_t *second_block = dma_buffer + CHUNK_SIZE;
-static int8_t *current_block = dma_buffer;
+#define DMA_BUFFER_SIZE (CHUNK_SIZE*2)
+// the two halves are played alternately; allocated by init_sb16
+static int8_t *dma_buffer = NULL;
+static int8_t *first_block = NULL;
+static int8_t *second_block = NULL;
+static int8_t *current_block = NULL;
 
 #define STATUS_PLAYING (1 << 0)
 #define STATUS_8BIT (1 << 1)
@@ -137,6 +141,12 @@ playback_status_t *play_status = &status;
 // "fact"
 #define FACT 0x74636166
 
+// largest wav header chunk (fmt, fact) we read into a buffer; fmt chunks
+// are 16-40 bytes and fact chunks are 4
+#define WAV_CHUNK_MAX 64
+// buffers for reading wav header chunks
+static kmem_cache_t *wav_chunk_cache;
+
 // forward declarations
 typedef struct chunk_info {
     uint32_t chunk_id;
@@ -179,6 +189,14 @@ void init_sb16() {
     status.channel = 1;
     status.mode = 0;
     status.playing = 0;
+    wav_chunk_cache = kmem_cache_create("wav_chunk", WAV_CHUNK_MAX, NULL);
+    dma_buffer = kmalloc_dma(DMA_BUFFER_SIZE);
+    if (dma_buffer != NULL) {
+        memset(dma_buffer, 0, DMA_BUFFER_SIZE);
+    }
+    first_block = dma_buffer;
+    second_block = dma_buffer + CHUNK_SIZE;
+    current_block = dma_buffer;
 }
 
 void sb16_reset() {
@@ -393,6 +411,14 @@ int32_t play_wav(int8_t *filename) {
     int32_t fd = syscall_open((uint8_t*)filename);
     int32_t bytes_read;
     status.fd = fd;
+    // sb16_handler reads the rest of the file, and cannot wait for the
+    // floppy, so bring all of it in now
+    if (fd >= 0 &&
+            fs_load_file(current_process->open_files[fd].inode_ptr) != 0) {
+        syscall_close(fd);
+        current_process = old_process;
+        return -1;
+    }
     chunk_info_t info;
     info = wav_read_chunk_header();
     if (info.chunk_id != RIFF) {
@@ -409,24 +435,34 @@ int32_t play_wav(int8_t *filename) {
         current_process = old_process;
         return -1;
     }
-    uint8_t *format = kmalloc(info.data_size);
+    if (info.data_size < 0x10 || info.data_size > WAV_CHUNK_MAX) {
+        syscall_close(fd);
+        current_process = old_process;
+        return -1;
+    }
+    uint8_t *format = kmem_cache_alloc(wav_chunk_cache);
+    if (format == NULL) {
+        syscall_close(fd);
+        current_process = old_process;
+        return -1;
+    }
     bytes_read = syscall_read(status.fd, format, info.data_size);
     if (bytes_read < info.data_size) {
-        kfree(format);
+        kmem_cache_free(wav_chunk_cache, format);
         syscall_close(fd);
         current_process = old_process;
         return -1;
     }
     if (get_int16(format, 0) != 1) {
         // not uncompressed PCM format
-        kfree(format);
+        kmem_cache_free(wav_chunk_cache, format);
         syscall_close(fd);
         current_process = old_process;
         return -1;
     }
     if (get_int16(format, 0x2) != 1) {
         // not mono sound
-        kfree(format);
+        kmem_cache_free(wav_chunk_cache, format);
         syscall_close(fd);
         current_process = old_process;
         return -1;
@@ -438,13 +474,33 @@ int32_t play_wav(int8_t *filename) {
         is_signed = 0;
     }
     sample_rate = get_int16(format, 0x4);
-    kfree(format);
+    kmem_cache_free(wav_chunk_cache, format);
 
     info = wav_read_chunk_header();
     if (info.chunk_id == FACT) {
-        uint8_t *buf = kmalloc(info.data_size);
-        bytes_read = syscall_read(status.fd, buf, info.data_size);
-        kfree(buf);
+        // skip over the fact chunk, a buffer at a time
+        uint8_t *buf = kmem_cache_alloc(wav_chunk_cache);
+        uint32_t remaining = info.data_size;
+        if (buf == NULL) {
+            syscall_close(fd);
+            current_process = old_process;
+            return -1;
+        }
+        while (remaining > 0) {
+            bytes_read = syscall_read(status.fd, buf,
+                    remaining < WAV_CHUNK_MAX ? remaining : WAV_CHUNK_MAX);
+            if (bytes_read <= 0) {
+                break;
+            }
+            remaining -= bytes_read;
+        }
+        kmem_cache_free(wav_chunk_cache, buf);
+        if (remaining > 0) {
+            // the file ended inside the chunk
+            syscall_close(fd);
+            current_process = old_process;
+            return -1;
+        }
         info = wav_read_chunk_header();
     }
     if (info.chunk_id != DATA) {
@@ -458,7 +514,7 @@ int32_t play_wav(int8_t *filename) {
 }
 
 int32_t play_file(int32_t fd, int8_t bits, int8_t is_signed, uint16_t sample_rate) {
-    if (status.playing) {
+    if (status.playing || dma_buffer == NULL) {
         return -1;
     }
     if (bits == 8) {
@@ -483,9 +539,9 @@ int32_t play_file(int32_t fd, int8_t bits, int8_t is_signed, uint16_t sample_rat
 
     process_t *old_process = current_process;
     current_process = status.process;
-    uint32_t bytes_read = syscall_read(fd, (uint8_t*)dma_buffer, CHUNK_SIZE*2);
+    uint32_t bytes_read = syscall_read(fd, (uint8_t*)dma_buffer, DMA_BUFFER_SIZE);
     current_process = old_process;
-    dma_start(status.channel, (uint32_t) dma_buffer, sizeof(dma_buffer), DMA_MODE_AI);
+    dma_start(status.channel, virt_to_phys(dma_buffer), DMA_BUFFER_SIZE, DMA_MODE_AI);
     sb16_start_playback((uint16_t) CHUNK_SIZE);
     if (bytes_read < CHUNK_SIZE) {
         sb16_stop_playback_after();
@@ -509,9 +565,8 @@ uint8_t sb16_dsp_read() {
 void reset_playback() {
     status.playing = 0;
     current_block = first_block;
-    int i;
-    for (i = 0; i < sizeof(dma_buffer); i++) {
-        dma_buffer[i] = 0;
+    if (dma_buffer != NULL) {
+        memset(dma_buffer, 0, DMA_BUFFER_SIZE);
     }
     syscall_close(status.fd);
 }
@@ -0,0 +1,273 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "shm.h"
+#include "lib.h"
+#include "paging.h"
+#include "frame.h"
+#include "task.h"
+#include "mem.h"
+#include "spinlock.h"
+#include "swap.h"
+
+/**
+ * @file shm.c
+ *
+ * @brief memory segments shared between processes
+ *
+ * A segment is a set of zeroed frames that processes find by a key they
+ * agree on. Attaching maps all of its frames writable into the process,
+ * placed below the stack like file mappings (see syscall_mmap). The mappings
+ * are PAGE_FOREIGN: the segment owns the frames, and counts the attachments
+ * instead, so the frames go when the last process detaches or halts. Fork
+ * keeps them shared rather than copy-on-write.
+ */
+
+/**
+ * a shared memory segment
+ */
+typedef struct shm_segment {
+    int32_t key;
+    uint32_t pages;
+    // the segment's frames, NULL if the segment is not in use
+    uint32_t *frames;
+    // attachments in all processes
+    uint32_t attached;
+} shm_segment_t;
+
+/**
+ * a segment attached to a process
+ */
+typedef struct shm_attachment {
+    // NULL if the slot is free
+    shm_segment_t *segment;
+    uint32_t addr;
+} shm_attachment_t;
+
+static shm_segment_t segments[SHM_MAX_SEGMENTS];
+static shm_attachment_t attachments[MAX_PROCESSES][SHM_MAX_ATTACH];
+
+// Forward declarations
+static shm_segment_t *find_segment(int32_t key);
+static int32_t attach(process_t *process, shm_segment_t *segment);
+static void release(shm_segment_t *segment);
+
+/**
+ * create a segment and attach it to the current process
+ *
+ * @param key what other processes attach the segment by
+ * @param size size in bytes, rounded up to whole pages
+ * @return where the segment is attached, -1 if the key is taken, the size
+ * is too big, there are too many segments or memory ran out
+ */
+int32_t shm_create(int32_t key, uint32_t size) {
+    shm_segment_t *segment = NULL;
+    uint32_t flags;
+    int32_t addr;
+    uint32_t i;
+
+    if (current_process->image == NULL || size == 0 || size > SHM_MAX_SIZE) {
+        return -1;
+    }
+    block_interrupts(&flags);
+    if (find_segment(key) != NULL) {
+        restore_interrupts(flags);
+        return -1;
+    }
+    for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+        if (segments[i].frames == NULL) {
+            segment = &segments[i];
+            break;
+        }
+    }
+    if (segment == NULL) {
+        restore_interrupts(flags);
+        return -1;
+    }
+
+    segment->pages = (size + KB(4) - 1) / KB(4);
+    segment->frames = kzalloc(segment->pages * sizeof(uint32_t));
+    if (segment->frames == NULL) {
+        restore_interrupts(flags);
+        return -1;
+    }
+    segment->key = key;
+    segment->attached = 1;
+    for (i = 0; i < segment->pages; i++) {
+        segment->frames[i] = swap_frame_alloc();
+        if (segment->frames[i] == 0) {
+            release(segment);
+            restore_interrupts(flags);
+            return -1;
+        }
+        memset(phys_to_virt(segment->frames[i]), 0, KB(4));
+    }
+
+    // the creator's attachment takes over the reference held so far
+    addr = attach(current_process, segment);
+    release(segment);
+    restore_interrupts(flags);
+    return addr;
+}
+
+/**
+ * attach an existing segment to the current process
+ *
+ * @param key the key the segment was created with
+ * @return where the segment is attached, -1 if there is no such segment or
+ * no room for it
+ */
+int32_t shm_attach(int32_t key) {
+    shm_segment_t *segment;
+    uint32_t flags;
+    int32_t addr;
+
+    if (current_process->image == NULL) {
+        return -1;
+    }
+    block_interrupts(&flags);
+    segment = find_segment(key);
+    addr = (segment == NULL) ? -1 : attach(current_process, segment);
+    restore_interrupts(flags);
+    return addr;
+}
+
+/**
+ * detach a segment from the current process, freeing it if no other process
+ * has it attached
+ *
+ * @param addr where the segment is attached
+ * @return 0 on success, -1 if no segment is attached there
+ */
+int32_t shm_detach(uint32_t addr) {
+    process_t *process = current_process;
+    shm_attachment_t *attachment;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t i;
+
+    block_interrupts(&flags);
+    for (i = 0; i < SHM_MAX_ATTACH; i++) {
+        attachment = &attachments[process->pid][i];
+        if (attachment->segment != NULL && attachment->addr == addr) {
+            size = attachment->segment->pages * KB(4);
+            unmap_user_pages(process->pid, addr, addr + size);
+            // give the room back if nothing was placed below it since
+            if (addr == process->mmap_start) {
+                process->mmap_start += size;
+            }
+            release(attachment->segment);
+            attachment->segment = NULL;
+            restore_interrupts(flags);
+            return 0;
+        }
+    }
+    restore_interrupts(flags);
+    return -1;
+}
+
+/**
+ * give a child of fork the parent's attachments (copy_user_pages copies the
+ * mappings themselves)
+ *
+ * @return 0
+ */
+int32_t shm_fork(uint32_t from_pid, uint32_t to_pid) {
+    uint32_t flags;
+    uint32_t i;
+
+    block_interrupts(&flags);
+    for (i = 0; i < SHM_MAX_ATTACH; i++) {
+        attachments[to_pid][i] = attachments[from_pid][i];
+        if (attachments[to_pid][i].segment != NULL) {
+            attachments[to_pid][i].segment->attached++;
+        }
+    }
+    restore_interrupts(flags);
+    return 0;
+}
+
+/**
+ * drop every attachment of a process that is being closed; its mappings go
+ * with its user pages
+ */
+void shm_detach_all(uint32_t pid) {
+    uint32_t flags;
+    uint32_t i;
+
+    block_interrupts(&flags);
+    for (i = 0; i < SHM_MAX_ATTACH; i++) {
+        if (attachments[pid][i].segment != NULL) {
+            release(attachments[pid][i].segment);
+            attachments[pid][i].segment = NULL;
+        }
+    }
+    restore_interrupts(flags);
+}
+
+/**
+ * @return the segment in use with a key, NULL if there is none
+ */
+static shm_segment_t *find_segment(int32_t key) {
+    uint32_t i;
+
+    for (i = 0; i < SHM_MAX_SEGMENTS; i++) {
+        if (segments[i].frames != NULL && segments[i].key == key) {
+            return &segments[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * map a segment into a process below its other file mappings and record
+ * the attachment
+ *
+ * @return where the segment is attached, -1 if the process has no free
+ * attachment or no room
+ */
+static int32_t attach(process_t *process, shm_segment_t *segment) {
+    shm_attachment_t *attachment = NULL;
+    uint32_t heap_top;
+    uint32_t start;
+    uint32_t i;
+
+    for (i = 0; i < SHM_MAX_ATTACH; i++) {
+        if (attachments[process->pid][i].segment == NULL) {
+            attachment = &attachments[process->pid][i];
+            break;
+        }
+    }
+    heap_top = (process->heap_end + KB(4) - 1) & ~(KB(4) - 1);
+    if (attachment == NULL ||
+            segment->pages > (process->mmap_start - heap_top) / KB(4)) {
+        return -1;
+    }
+    start = process->mmap_start - segment->pages * KB(4);
+
+    for (i = 0; i < segment->pages; i++) {
+        map_user_page(segment->frames[i], start + i * KB(4), process->pid,
+                PAGE_WRITE | PAGE_FOREIGN);
+    }
+    process->mmap_start = start;
+    attachment->segment = segment;
+    attachment->addr = start;
+    segment->attached++;
+    return start;
+}
+
+/**
+ * drop a reference to a segment, freeing its frames with the last
+ */
+static void release(shm_segment_t *segment) {
+    uint32_t i;
+
+    if (--segment->attached > 0) {
+        return;
+    }
+    for (i = 0; i < segment->pages; i++) {
+        if (segment->frames[i] != 0) {
+            frame_free(segment->frames[i], FRAME_ORDER_4KB);
+        }
+    }
+    kfree(segment->frames);
+    segment->frames = NULL;
+}
@@ -0,0 +1,20 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _SHM_H
+#define _SHM_H
+
+#include "types.h"
+
+// segments in the system at once
+#define SHM_MAX_SEGMENTS 16
+// segments one process can have attached at once
+#define SHM_MAX_ATTACH 4
+// largest segment
+#define SHM_MAX_SIZE KB(512)
+
+int32_t shm_create(int32_t key, uint32_t size);
+int32_t shm_attach(int32_t key);
+int32_t shm_detach(uint32_t addr);
+int32_t shm_fork(uint32_t from_pid, uint32_t to_pid);
+void shm_detach_all(uint32_t pid);
+
+#endif /* _SHM_H */
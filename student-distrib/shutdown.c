@@ -3,6 +3,7 @@
 #include "shutdown.h"
 #include "lib.h"
 #include "syscall.h"
+#include "efs.h"
 
 /**
  * shutdown the system
@@ -18,5 +19,7 @@ void shutdown(int8_t* message)
     uint32_t length = strlen(message);
 		syscall_write(STDOUT_FD, (uint8_t*) message, length);
 		syscall_read(STDIN_FD, bucket, 10);
+    // write what is still only in the floppy's track cache
+    efs_sync();
     outw(0x2000, 0xb004);
 }
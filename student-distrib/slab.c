@@ -0,0 +1,253 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "slab.h"
+#include "lib.h"
+#include "mem.h"
+
+/**
+ * @file slab.c
+ *
+ * @brief object caches for frequently allocated fixed-size kernel objects
+ *
+ * Each cache hands out objects from slabs: blocks of memory obtained from
+ * kmalloc_aligned, aligned to their own size, holding a header followed by an
+ * array of objects. Because slabs are aligned to their size, the slab (and
+ * the owning cache) of any object is found by masking its address, so freeing
+ * never searches. Free objects in a slab are chained through an index array
+ * in the header rather than through the objects themselves, which keeps
+ * constructed objects intact while they sit on the freelist.
+ */
+
+// smallest slab; also the granularity slabs grow by
+#define SLAB_SIZE_MIN KB(4)
+// a slab is made larger until it holds at least this many objects
+#define SLAB_MIN_OBJECTS 8
+// end of a slab's freelist
+#define SLAB_FREE_END 0xFFFF
+// free_next entry of an object that is allocated
+#define SLAB_ALLOCATED 0xFFFE
+
+typedef struct slab {
+    kmem_cache_t *cache;
+    struct slab *next;
+    struct slab *prev;
+    uint32_t in_use;
+    // index of the first free object, SLAB_FREE_END if the slab is full
+    uint16_t free_head;
+    // free_next[i] is the index of the free object after object i, or
+    // SLAB_ALLOCATED while object i is in use
+    uint16_t free_next[0];
+} slab_t;
+
+// every cache that has been created
+static kmem_cache_t *caches = NULL;
+
+// Forward declarations
+static slab_t *slab_create(kmem_cache_t *cache);
+static void slab_list_remove(slab_t **list, slab_t *slab);
+static void slab_list_push(slab_t **list, slab_t *slab);
+static uint32_t slab_header_size(uint32_t num_objects);
+
+/**
+ * create a cache of objects
+ *
+ * @param name human readable name, for debugging
+ * @param size size of each object in bytes
+ * @param ctor function run once on each new object, or NULL
+ * @return the new cache, or NULL if out of memory
+ */
+kmem_cache_t *kmem_cache_create(const int8_t *name, uint32_t size, kmem_ctor_t ctor) {
+    kmem_cache_t *cache;
+    uint32_t slab_size = SLAB_SIZE_MIN;
+    uint32_t n;
+
+    if (size == 0) {
+        return NULL;
+    }
+    // keep every object word aligned
+    size = (size + 3) & ~3;
+
+    while ((slab_size - sizeof(slab_t)) / (size + sizeof(uint16_t)) < SLAB_MIN_OBJECTS) {
+        slab_size <<= 1;
+    }
+    n = (slab_size - sizeof(slab_t)) / (size + sizeof(uint16_t));
+    while (slab_header_size(n) + n * size > slab_size) {
+        n--;
+    }
+    if (n >= SLAB_ALLOCATED) {
+        n = SLAB_ALLOCATED - 1;
+    }
+
+    cache = kmalloc(sizeof(kmem_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->name = name;
+    cache->object_size = size;
+    cache->slab_size = slab_size;
+    cache->objects_per_slab = n;
+    cache->first_object = slab_header_size(n);
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->num_slabs = 0;
+    cache->num_active = 0;
+
+    cache->next = caches;
+    caches = cache;
+
+    return cache;
+}
+
+/**
+ * allocate an object from a cache
+ *
+ * prefers partially used slabs, then a cached empty slab, and only creates a
+ * new slab when every existing one is full
+ *
+ * @return the object, or NULL if out of memory
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    slab_t *slab;
+    uint16_t index;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab != NULL) {
+            slab_list_remove(&cache->empty, slab);
+        } else {
+            slab = slab_create(cache);
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    index = slab->free_head;
+    slab->free_head = slab->free_next[index];
+    slab->free_next[index] = SLAB_ALLOCATED;
+    slab->in_use++;
+    if (slab->free_head == SLAB_FREE_END) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    cache->num_active++;
+
+    return (uint8_t*) slab + cache->first_object + index * cache->object_size;
+}
+
+/**
+ * return an object to its cache
+ *
+ * the owning slab is found from the object's address; at most one empty slab
+ * is kept around, any others are given back to kmalloc
+ *
+ * does nothing for NULL, objects that do not belong to the cache, pointers
+ * into the middle of an object, or objects that are already free
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    slab_t *slab;
+    uint32_t offset;
+    uint32_t index;
+
+    if (cache == NULL || obj == NULL) {
+        return;
+    }
+    slab = (slab_t*) ((uint32_t) obj & ~(cache->slab_size - 1));
+    if (slab->cache != cache) {
+        return;
+    }
+    offset = (uint8_t*) obj - (uint8_t*) slab;
+    if (offset < cache->first_object ||
+            (offset - cache->first_object) % cache->object_size != 0) {
+        return;
+    }
+    index = (offset - cache->first_object) / cache->object_size;
+    if (index >= cache->objects_per_slab ||
+            slab->free_next[index] != SLAB_ALLOCATED) {
+        return;
+    }
+
+    if (slab->free_head == SLAB_FREE_END) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    slab->free_next[index] = slab->free_head;
+    slab->free_head = index;
+    slab->in_use--;
+    cache->num_active--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            slab_list_push(&cache->empty, slab);
+        } else {
+            cache->num_slabs--;
+            kfree(slab);
+        }
+    }
+}
+
+/**
+ * allocate and initialize a new slab for a cache
+ *
+ * runs the cache's constructor on every object in the slab
+ */
+static slab_t *slab_create(kmem_cache_t *cache) {
+    slab_t *slab;
+    uint32_t i;
+
+    slab = kmalloc_aligned(cache->slab_size, cache->slab_size);
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->in_use = 0;
+    slab->free_head = 0;
+    for (i = 0; i < cache->objects_per_slab; i++) {
+        slab->free_next[i] = i + 1;
+        if (cache->ctor != NULL) {
+            cache->ctor((uint8_t*) slab + cache->first_object + i * cache->object_size);
+        }
+    }
+    slab->free_next[cache->objects_per_slab - 1] = SLAB_FREE_END;
+    cache->num_slabs++;
+    return slab;
+}
+
+/**
+ * size of a slab header for a number of objects, rounded up so the objects
+ * that follow it are 8 byte aligned
+ */
+static uint32_t slab_header_size(uint32_t num_objects) {
+    return (sizeof(slab_t) + num_objects * sizeof(uint16_t) + 7) & ~7;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void slab_list_push(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
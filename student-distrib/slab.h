@@ -0,0 +1,47 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "types.h"
+
+/**
+ * constructor run once on every object when its slab is created
+ *
+ * objects are handed back to the cache in their constructed state, so the
+ * constructor is not run again when an object is reused
+ */
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct slab;
+
+/**
+ * a cache of equally-sized objects, carved out of slabs
+ */
+typedef struct kmem_cache {
+    const int8_t *name;
+    // size of each object (rounded up for alignment)
+    uint32_t object_size;
+    // size (and alignment) of each slab
+    uint32_t slab_size;
+    // number of objects in each slab
+    uint32_t objects_per_slab;
+    // offset of the first object from the start of its slab
+    uint32_t first_object;
+    kmem_ctor_t ctor;
+
+    // slabs with some objects free, no objects free, and all objects free
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+
+    uint32_t num_slabs;
+    uint32_t num_active;
+
+    struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const int8_t *name, uint32_t size, kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+#endif /* _SLAB_H */
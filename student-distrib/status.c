@@ -82,7 +82,7 @@ int32_t write_status_bar(void)
 void write_status_char(int8_t theChar, int8_t current_attrib, uint32_t x)
 {
 	x %= (NUM_COLS+1);
-	*(uint8_t *)(VIDEO + ((NUM_COLS* (NUM_ROWS) + x) << 1)) = theChar;
+	*(uint8_t *)(real_vidmem + ((NUM_COLS* (NUM_ROWS) + x) << 1)) = theChar;
 	set_char_attrib(x, NUM_ROWS, current_attrib);
 }
 
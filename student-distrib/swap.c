@@ -0,0 +1,252 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "swap.h"
+#include "ide.h"
+#include "paging.h"
+#include "frame.h"
+#include "task.h"
+#include "mem.h"
+#include "spinlock.h"
+
+/**
+ * @file swap.c
+ *
+ * @brief swapping the user pages of idle processes out to disk
+ *
+ * The swap area is the IDE primary slave drive, split into page-sized slots.
+ * When a user page cannot be allocated (swap_frame_alloc), a clock hand sweeps
+ * the user page tables of idle processes: those waiting for a child to halt
+ * or for a line of input. Each page it passes is aged (frame_age) with its
+ * accessed bit, which is then cleared, so a page used since the last sweep
+ * gets another chance, and only pages unused for several sweeps are written
+ * out. A call sweeps at most once round, and after a sweep that freed
+ * nothing only one process's pages per call, so pages still age but a full
+ * memory does not cost a full sweep on every allocation. A swapped-out
+ * page's entry is left not present, marked PAGE_SWAPPED and holding its
+ * slot, and page_in reads it back on the next touch.
+ *
+ * Only private pages are swapped: shared ones (program text, file mappings)
+ * stay put.
+ */
+
+// sectors in a page
+#define SECTORS_PER_SLOT (KB(4) / IDE_SECTOR_SIZE)
+// entries in a page table
+#define PAGES_PER_TABLE 1024
+// steps in one sweep of the clock hand, a process skipped counting as its
+// whole page table
+#define SWEEP_STEPS (MAX_PROCESSES * PAGES_PER_TABLE)
+
+swap_stats_t swap_stats;
+
+// one bit per slot, set if it is in use
+static uint8_t *slot_map = NULL;
+static uint32_t num_slots = 0;
+// where to start looking for a free slot
+static uint32_t slot_hint = 0;
+
+// the clock hand: a process and a page of its user address space
+static uint32_t hand_pid = 1;
+static uint32_t hand_page = 0;
+// pages swapped out since the hand last came round, and whether the last
+// sweep swapped out none
+static uint32_t sweep_freed = 0;
+static uint32_t sweep_empty = 0;
+
+// Forward declarations
+static int32_t slot_alloc(void);
+static int32_t evict(page_table_entry_t *pte);
+
+/**
+ * set up the swap area on the IDE primary slave drive, if there is one
+ *
+ * @return 0 on success, -1 if there is no drive (user pages are then never
+ * swapped)
+ */
+int32_t init_swap(void) {
+    if (ide_init(IDE_SLAVE) != 0) {
+        return -1;
+    }
+    num_slots = ide_sectors() / SECTORS_PER_SLOT;
+    if (num_slots > SWAP_MAX_SLOTS) {
+        num_slots = SWAP_MAX_SLOTS;
+    }
+    slot_map = kzalloc((num_slots + 7) / 8);
+    if (slot_map == NULL) {
+        num_slots = 0;
+        return -1;
+    }
+    swap_stats.slots_total = num_slots;
+    return 0;
+}
+
+/**
+ * allocate a frame for a user page, swapping out idle processes' pages if
+ * memory has run out
+ *
+ * @return physical address of the frame, 0 if none could be freed
+ */
+uint32_t swap_frame_alloc(void) {
+    uint32_t frame = frame_alloc(FRAME_ORDER_4KB);
+
+    if (frame == 0 && swap_out(SWAP_BATCH) > 0) {
+        frame = frame_alloc(FRAME_ORDER_4KB);
+    }
+    return frame;
+}
+
+/**
+ * swap out pages of idle processes, least recently used first
+ *
+ * @param count how many pages to free
+ * @return how many were swapped out
+ */
+uint32_t swap_out(uint32_t count) {
+    process_t *process;
+    page_table_entry_t *pte;
+    uint32_t steps = sweep_empty ? PAGES_PER_TABLE : SWEEP_STEPS;
+    uint32_t freed = 0;
+    uint32_t flags;
+
+    if (num_slots == 0) {
+        return 0;
+    }
+    while (freed < count && steps > 0 && swap_stats.slots_used < num_slots) {
+        // one process at a time, so it cannot exit while its pages are swept
+        block_interrupts(&flags);
+        process = get_process(hand_pid);
+        if (process == NULL || !process_idle(process)) {
+            // skip the whole process
+            steps -= steps < PAGES_PER_TABLE ? steps : PAGES_PER_TABLE;
+            hand_page = PAGES_PER_TABLE;
+        }
+        while (hand_page < PAGES_PER_TABLE && freed < count && steps > 0) {
+            steps--;
+            pte = get_user_pte(hand_pid, USER_BASE + hand_page * KB(4));
+            if (pte != NULL && evict(pte) == 0) {
+                freed++;
+                sweep_freed++;
+                sweep_empty = 0;
+            }
+            hand_page++;
+        }
+        if (hand_page == PAGES_PER_TABLE) {
+            hand_page = 0;
+            hand_pid = hand_pid + 1 < MAX_PROCESSES ? hand_pid + 1 : 1;
+            if (hand_pid == 1) {
+                sweep_empty = (sweep_freed == 0);
+                sweep_freed = 0;
+            }
+        }
+        restore_interrupts(flags);
+    }
+
+    return freed;
+}
+
+/**
+ * read a swapped-out page of a process back in
+ *
+ * @param pid the process, which must be the one loaded (or not run until its
+ * page tables are next loaded)
+ * @param page page-aligned virtual address
+ * @return 0 on success, -1 if the page is not swapped out, memory ran out or
+ * the drive failed
+ */
+int32_t swap_in(uint32_t pid, uint32_t page) {
+    page_table_entry_t *pte = get_user_pte(pid, page);
+    uint32_t frame;
+    uint32_t slot;
+    uint32_t write;
+
+    if (pte == NULL || !(pte->flags & PAGE_SWAPPED)) {
+        return -1;
+    }
+    frame = swap_frame_alloc();
+    if (frame == 0) {
+        return -1;
+    }
+    slot = pte->addr_shifted;
+    if (ide_read(slot * SECTORS_PER_SLOT, phys_to_virt(frame),
+                SECTORS_PER_SLOT) != 0) {
+        frame_free(frame, FRAME_ORDER_4KB);
+        return -1;
+    }
+    // the frame is private now, even if the page was copy-on-write
+    write = (pte->flags & (PAGE_WRITE | PAGE_COW)) ? PAGE_WRITE : 0;
+    pte->addr = 0;
+    map_user_page(frame, page, pid, write);
+    swap_free(slot);
+    swap_stats.page_ins++;
+    return 0;
+}
+
+/**
+ * release a slot of the swap area
+ *
+ * @param slot the slot held by a swapped-out page's entry
+ */
+void swap_free(uint32_t slot) {
+    if (slot >= num_slots || !(slot_map[slot / 8] & (1 << (slot % 8)))) {
+        return;
+    }
+    slot_map[slot / 8] &= ~(1 << (slot % 8));
+    swap_stats.slots_used--;
+    if (slot < slot_hint) {
+        slot_hint = slot;
+    }
+}
+
+/**
+ * @return a free slot of the swap area, now in use, or -1 if it is full
+ */
+static int32_t slot_alloc(void) {
+    uint32_t slot;
+
+    for (slot = slot_hint; slot < num_slots; slot++) {
+        if (!(slot_map[slot / 8] & (1 << (slot % 8)))) {
+            slot_map[slot / 8] |= 1 << (slot % 8);
+            swap_stats.slots_used++;
+            slot_hint = slot + 1;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * age a user page and swap it out if it has not been used for a while
+ *
+ * @param pte the page's entry, in page tables that are not loaded
+ * @return 0 if the page was swapped out, -1 if not
+ */
+static int32_t evict(page_table_entry_t *pte) {
+    uint32_t frame = pte->addr_shifted << 12;
+    uint32_t used;
+    int32_t slot;
+
+    if (!(pte->flags & PAGE_PRESENT) || (pte->flags & PAGE_FOREIGN) ||
+            frame_refs(frame) != 1) {
+        return -1;
+    }
+    // second chance for pages used since the last sweep
+    used = pte->flags & PAGE_ACCESSED;
+    pte->flags &= ~PAGE_ACCESSED;
+    if (frame_age(frame, used) != 0) {
+        return -1;
+    }
+
+    slot = slot_alloc();
+    if (slot < 0) {
+        return -1;
+    }
+    if (ide_write(slot * SECTORS_PER_SLOT, phys_to_virt(frame),
+                SECTORS_PER_SLOT) != 0) {
+        swap_free(slot);
+        return -1;
+    }
+    pte->flags = (pte->flags & ~(PAGE_PRESENT | PAGE_DIRTY)) | PAGE_SWAPPED;
+    pte->addr_shifted = slot;
+    frame_free(frame, FRAME_ORDER_4KB);
+    swap_stats.page_outs++;
+    return 0;
+}
@@ -0,0 +1,32 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _SWAP_H
+#define _SWAP_H
+
+#include "types.h"
+
+// the swap area takes up at most this many pages of the drive
+#define SWAP_MAX_SLOTS 16384
+// pages swapped out at once when memory runs out
+#define SWAP_BATCH 16
+
+/**
+ * Counters of swap activity
+ */
+typedef struct swap_stats {
+    // pages read back in and written out
+    uint32_t page_ins;
+    uint32_t page_outs;
+    // slots of the swap area in use, and in all
+    uint32_t slots_used;
+    uint32_t slots_total;
+} swap_stats_t;
+
+extern swap_stats_t swap_stats;
+
+int32_t init_swap(void);
+uint32_t swap_frame_alloc(void);
+uint32_t swap_out(uint32_t count);
+int32_t swap_in(uint32_t pid, uint32_t page);
+void swap_free(uint32_t slot);
+
+#endif /* _SWAP_H */
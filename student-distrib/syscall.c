@@ -10,6 +10,14 @@
 #include "shutdown.h"
 #include "sb16.h"
 #include "soundctrl.h"
+#include "mem.h"
+#include "spinlock.h"
+#include "frame.h"
+#include "image.h"
+#include "uaccess.h"
+#include "shm.h"
+#include "efs.h"
+#include "vmstat.h"
 
 static file_ops_t terminal_funcs = {.read_func = keyboard_read,
     .write_func = keyboard_write,
@@ -29,12 +37,38 @@ static file_ops_t dir_funcs = {.read_func = directory_read,
     .close_func = fs_close,
 };
 
+static file_ops_t efs_funcs = {.read_func = efs_file_read,
+    .write_func = efs_file_write,
+    .open_func = fs_open,
+    .close_func = fs_close,
+};
+
+static file_ops_t efs_dir_funcs = {.read_func = efs_directory_read,
+    .write_func = fs_write,
+    .open_func = fs_open,
+    .close_func = fs_close,
+};
+
 static file_ops_t rtc_funcs = {.read_func = rtc_read,
     .write_func = rtc_write,
     .open_func = rtc_open,
     .close_func = rtc_close,
 };
 
+static file_ops_t vmstat_funcs = {.read_func = vmstat_read,
+    .write_func = fs_write,
+    .open_func = fs_open,
+    .close_func = fs_close,
+};
+
+#ifdef MEM_PROFILE
+static file_ops_t meminfo_funcs = {.read_func = meminfo_read,
+    .write_func = fs_write,
+    .open_func = fs_open,
+    .close_func = fs_close,
+};
+#endif
+
 int32_t find_new_fd();
 
 /**
@@ -52,6 +86,8 @@ void syscall_handler() {
     uint32_t arg1;
     uint32_t arg2;
     uint32_t arg3;
+    // strings passed by the user program are copied in here
+    int8_t string[USER_STRING_MAX];
     // the register allocations specified for the inputs ask GCC to store the
     // registers into their coprint rrect local variables, so no body is needed
     // (= specifies write-only)
@@ -75,15 +111,31 @@ void syscall_handler() {
         case SYSCALL_HALT:
             syscall_halt( (uint8_t) (arg1 & 0xFF) );
         case SYSCALL_EXECUTE:
-            ret = syscall_execute((uint8_t*) arg1);
+            if (strncpy_from_user(string, (int8_t*) arg1, USER_STRING_MAX) < 0) {
+                ret = -1;
+                break;
+            }
+            ret = syscall_execute((uint8_t*) string);
             break;
         case SYSCALL_OPEN:
-            ret = syscall_open((uint8_t*)arg1);
+            if (strncpy_from_user(string, (int8_t*) arg1, USER_STRING_MAX) < 0) {
+                ret = -1;
+                break;
+            }
+            ret = syscall_open((uint8_t*) string);
             break;
         case SYSCALL_READ:
+            if (bad_userspace_addr((void*) arg2, arg3)) {
+                ret = -1;
+                break;
+            }
             ret = syscall_read(arg1, (uint8_t*)arg2, arg3);
             break;
         case SYSCALL_WRITE:
+            if (bad_userspace_addr((void*) arg2, arg3)) {
+                ret = -1;
+                break;
+            }
             ret = syscall_write(arg1, (uint8_t*)arg2, arg3);
             break;
         case SYSCALL_CLOSE:
@@ -93,6 +145,10 @@ void syscall_handler() {
             ret = syscall_vidmap((uint8_t**) arg1);
             break;
         case SYSCALL_GETARGS:
+            if (bad_userspace_addr((void*) arg1, arg2)) {
+                ret = -1;
+                break;
+            }
             ret = syscall_getargs((uint8_t *) arg1, (int32_t) arg2);
             break;
         case SYSCALL_SET_HANDLER:
@@ -105,7 +161,34 @@ void syscall_handler() {
             ret = syscall_shutdown();
             break;
         case SYSCALL_SOUNDCTRL:
-            ret = syscall_soundctrl(arg1, (int8_t*)arg2);
+            // only playing takes a file name
+            if (arg1 == CTRL_PLAY_FILE && strncpy_from_user(string,
+                        (int8_t*) arg2, USER_STRING_MAX) < 0) {
+                ret = -1;
+                break;
+            }
+            ret = syscall_soundctrl(arg1, string);
+            break;
+        case SYSCALL_SBRK:
+            ret = syscall_sbrk((int32_t) arg1);
+            break;
+        case SYSCALL_MMAP:
+            ret = syscall_mmap((int32_t) arg1, arg2, arg3);
+            break;
+        case SYSCALL_FORK:
+            ret = syscall_fork(&regs);
+            break;
+        case SYSCALL_SHM_CREATE:
+            ret = shm_create((int32_t) arg1, arg2);
+            break;
+        case SYSCALL_SHM_ATTACH:
+            ret = shm_attach((int32_t) arg1);
+            break;
+        case SYSCALL_SHM_DETACH:
+            ret = shm_detach(arg1);
+            break;
+        case SYSCALL_TRUNCATE:
+            ret = syscall_truncate((int32_t) arg1, arg2);
             break;
         default:
             ret = -1;
@@ -186,25 +269,100 @@ int32_t syscall_open(uint8_t* filename) {
             current_process->open_files[file_num] = rtc_info;
             fd = file_num;
         }
+    } else if (strncmp((int8_t*)filename, "/dev/vmstat", 100) == 0)  {
+        file_info_t vmstat_info = {
+            .file_ops = &vmstat_funcs,
+            .inode_ptr = NULL,
+            .pos = 0,
+        };
+        vmstat_info.can_read = 1;
+        vmstat_info.can_write = 0;
+        vmstat_info.type = FileRegular;
+        vmstat_info.in_use = 1;
+        int32_t file_num = find_new_fd();
+        if (file_num < 0) {
+            return -1;
+        } else {
+            current_process->open_files[file_num] = vmstat_info;
+            fd = file_num;
+        }
+#ifdef MEM_PROFILE
+    } else if (strncmp((int8_t*)filename, "/dev/meminfo", 100) == 0)  {
+        file_info_t meminfo_info = {
+            .file_ops = &meminfo_funcs,
+            .inode_ptr = NULL,
+            .pos = 0,
+        };
+        meminfo_info.can_read = 1;
+        meminfo_info.can_write = 0;
+        meminfo_info.type = FileRegular;
+        meminfo_info.in_use = 1;
+        int32_t file_num = find_new_fd();
+        if (file_num < 0) {
+            return -1;
+        } else {
+            current_process->open_files[file_num] = meminfo_info;
+            fd = file_num;
+        }
+#endif
+    } else if (strncmp((int8_t*)filename, EFS_ROOT, 100) == 0 ||
+            strncmp((int8_t*)filename, EFS_PREFIX, 100) == 0)  {
+        file_info_t efs_dir_info = {
+            .file_ops = &efs_dir_funcs,
+            .inode_ptr = NULL,
+            .pos = 0,
+        };
+        efs_dir_info.can_read = 1;
+        efs_dir_info.can_write = 0;
+        efs_dir_info.type = FileDirectory;
+        efs_dir_info.in_use = 1;
+        int32_t file_num = find_new_fd();
+        if (file_num < 0) {
+            return -1;
+        } else {
+            current_process->open_files[file_num] = efs_dir_info;
+            fd = file_num;
+        }
+    } else if (strncmp((int8_t*)filename, EFS_PREFIX,
+                strlen(EFS_PREFIX)) == 0)  {
+        // files of the writable file system are created on first open
+        int32_t file_num = find_new_fd();
+        if (file_num < 0) {
+            return -1;
+        }
+        file_info_t efs_info = {
+            .file_ops = &efs_funcs,
+            .inode_ptr = efs_open(filename + strlen(EFS_PREFIX)),
+            .pos = 0,
+        };
+        if (efs_info.inode_ptr == NULL) {
+            return -1;
+        }
+        efs_info.can_read = 1;
+        efs_info.can_write = 1;
+        efs_info.type = FileEFS;
+        efs_info.in_use = 1;
+        current_process->open_files[file_num] = efs_info;
+        fd = file_num;
     } else {
-        dentry_t dentry;
-        if (read_dentry_by_name(filename, &dentry)) {
+        const dentry_t *dentry = find_dentry(filename);
+        if (dentry == NULL) {
             return -1;
         }
         file_info_t fs_info;
-        fs_info.inode_ptr = get_inode_ptr(dentry.inode);
+        fs_info.inode_ptr = get_inode_ptr(dentry->inode);
         fs_info.pos = 0;
-        if (dentry.type == DENTRY_DIRECTORY) {
+        if (dentry->type == DENTRY_DIRECTORY) {
             fs_info.file_ops = &dir_funcs;
             fs_info.can_read = 1;
             fs_info.can_write = 0;
             fs_info.type = FileRegular;
-        } else if (dentry.type == DENTRY_FILE) {
+        } else if (dentry->type == DENTRY_FILE) {
             fs_info.file_ops = &fs_funcs;
             fs_info.can_read = 1;
             fs_info.can_write = 0;
             fs_info.type = FileRegular;
-        } else if (dentry.type == DENTRY_RTC) {
+        } else if (dentry->type == DENTRY_RTC) {
             fs_info.file_ops = &rtc_funcs;
             fs_info.can_read = 1;
             fs_info.can_write = 1;
@@ -290,13 +448,12 @@ int32_t syscall_read(int32_t fd, const uint8_t* buf, int32_t nbytes) {
  * @param buf a pointer to the buffer holding the data
  * @param nbytes the number of bytes to try to write (though fewer will be
  * written if the file has no more available)
- * @return 0 on success, -1 on failure
+ * @return the number of bytes written (0 for the RTC), -1 on failure
  */
 int32_t syscall_write(int32_t fd, const uint8_t* buf, int32_t nbytes) {
     if (valid_fd(fd) && current_process->open_files[fd].can_write) {
         file_info_t* f = &(current_process->open_files[fd]);
-        f->file_ops->write_func(f, (int8_t*)buf, nbytes);
-        return 0;
+        return f->file_ops->write_func(f, (int8_t*)buf, nbytes);
     }
     return -1;
 }
@@ -313,6 +470,10 @@ int32_t syscall_write(int32_t fd, const uint8_t* buf, int32_t nbytes) {
  */
 void syscall_halt(uint8_t status) {
     process_t *old_process = current_process;
+    // a child of fork has no execute call waiting for it
+    if (old_process->forked) {
+        exit_process(old_process);
+    }
     assert(old_process->parent != NULL);
     void* ret_addr = old_process->parent->ret_addr;
     set_current_process(current_process->parent);
@@ -363,10 +524,19 @@ int32_t syscall_close(int32_t fd) {
  * @return -1 if there are no arguments to return, 0 otherwise
  */
 int32_t syscall_getargs(uint8_t *buf, uint32_t nbytes) {
-    if (strlen((int8_t*)current_process->args) == 0) {
+    uint32_t length = strlen((int8_t*)current_process->args);
+
+    if (length == 0) {
+        return -1;
+    }
+    // like strncpy: the arguments, then zeros up to nbytes
+    if (length > nbytes) {
+        length = nbytes;
+    }
+    if (copy_to_user(buf, current_process->args, length) != 0 ||
+            clear_user(buf + length, nbytes - length) != 0) {
         return -1;
     }
-    strncpy((int8_t*)buf, (int8_t*)current_process->args, nbytes);
     return 0;
 }
 
@@ -388,18 +558,22 @@ int32_t syscall_sigreturn(void)
  *
  * @param screen_start a pointer to where the start of video memory should be
  * stored
- * @return 0 on success, -1 if the given pointer is invalid
+ * @return 0 on success, -1 if the given pointer is invalid or memory ran out
  */
 int32_t syscall_vidmap (uint8_t** screen_start)
 {
-    // Check for out of range memory.
-    if((uint32_t)screen_start < MB(128) || (uint32_t)screen_start >= MB(132) - 4 )
+    uint8_t *start = (uint8_t *) MB(256);
+
+    if(bad_userspace_addr(screen_start, sizeof(*screen_start)) ||
+            copy_to_user(screen_start, &start, sizeof(start)) != 0)
+    {
+        return -1;
+    }
+    if(map_4kb_page(terminal_video_page(current_process->terminal), MB(256),
+                current_process->pid, UserPrivilege, VIDMAP_PT) != 0)
     {
         return -1;
     }
-    map_4kb_page(0xB8000, MB(256), current_process->pid, UserPrivilege, 1);
-
-    *screen_start = (uint8_t *) MB(256);
 
     current_process->vidmap_flag = 1;
 
@@ -435,6 +609,246 @@ int32_t syscall_soundctrl(int32_t function, int8_t *filename) {
     return 0;
 }
 
+/**
+ * sbrk system call
+ *
+ * moves the end of the current process's heap, which starts right after its
+ * program image. Pages are mapped (zeroed) the first time they are touched,
+ * and pages the heap shrinks away from are freed.
+ *
+ * @param increment number of bytes to grow the heap by, negative to shrink it
+ * @return the previous end of the heap on success, -1 if the heap would
+ * shrink past its start or grow into the file mappings
+ */
+int32_t syscall_sbrk(int32_t increment) {
+    process_t *process = current_process;
+    uint32_t old_end = process->heap_end;
+    uint32_t new_end = old_end + increment;
+    uint32_t flags;
+
+    if (process->image == NULL) {
+        return -1;
+    }
+    if (increment < 0) {
+        if (new_end > old_end || new_end < process->heap_start) {
+            return -1;
+        }
+    } else if (new_end < old_end || new_end > process->mmap_start) {
+        return -1;
+    }
+
+    block_interrupts(&flags);
+    process->heap_end = new_end;
+    if (increment < 0) {
+        process->heap_pages -= unmap_user_pages(process->pid,
+                (new_end + KB(4) - 1) & ~(KB(4) - 1), old_end);
+    }
+    restore_interrupts(flags);
+    return old_end;
+}
+
+/**
+ * mmap system call
+ *
+ * maps part of a regular file read-only into the current process. The file's
+ * data blocks are mapped where they are in the RAM disk, so nothing is copied.
+ * Mappings are placed below the stack, each under the last, and last until
+ * the process halts.
+ *
+ * @param fd file descriptor of an open regular file
+ * @param offset where in the file to start, a multiple of 4KB
+ * @param length number of bytes to map; it is cut down to the end of the
+ * file, and the rest of the last page holds whatever follows the file in its
+ * last block
+ * @return the address of the mapping on success, -1 if the file cannot be
+ * mapped or there is no room for it
+ */
+int32_t syscall_mmap(int32_t fd, uint32_t offset, uint32_t length) {
+    process_t *process = current_process;
+    file_info_t *file;
+    data_block_t *block;
+    uint32_t pages;
+    uint32_t start;
+    uint32_t heap_top;
+    uint32_t flags;
+    uint32_t i;
+
+    if (!valid_fd(fd) || process->image == NULL) {
+        return -1;
+    }
+    file = &process->open_files[fd];
+    if (file->type != FileRegular || file->inode_ptr == NULL ||
+            (offset & (KB(4) - 1)) != 0 || length == 0 ||
+            offset >= file->inode_ptr->length) {
+        return -1;
+    }
+    if (length > file->inode_ptr->length - offset) {
+        length = file->inode_ptr->length - offset;
+    }
+    pages = (length + KB(4) - 1) / KB(4);
+
+    block_interrupts(&flags);
+    heap_top = (process->heap_end + KB(4) - 1) & ~(KB(4) - 1);
+    if (pages > (process->mmap_start - heap_top) / KB(4)) {
+        restore_interrupts(flags);
+        return -1;
+    }
+    start = process->mmap_start - pages * KB(4);
+
+    // check every block first, so a failure leaves nothing mapped
+    for (i = 0; i < pages; i++) {
+        block = get_data_block(file->inode_ptr, offset / KB(4) + i);
+        if (block == NULL || ((uint32_t) block & (KB(4) - 1)) != 0) {
+            restore_interrupts(flags);
+            return -1;
+        }
+    }
+    for (i = 0; i < pages; i++) {
+        block = get_data_block(file->inode_ptr, offset / KB(4) + i);
+        map_user_page(virt_to_phys(block), start + i * KB(4), process->pid,
+                PAGE_FOREIGN);
+    }
+    process->mmap_start = start;
+    restore_interrupts(flags);
+
+    return start;
+}
+
+/**
+ * truncate system call
+ *
+ * makes a file of the writable file system (under EFS_PREFIX) a given
+ * length, cutting it off or extending it with zeros
+ *
+ * @param fd an open file of the writable file system
+ * @param length the new length in bytes
+ * @return 0 on success, -1 if fd is not such a file or there is no room
+ */
+int32_t syscall_truncate(int32_t fd, uint32_t length) {
+    if (!valid_fd(fd) || current_process->open_files[fd].type != FileEFS) {
+        return -1;
+    }
+    return efs_truncate(current_process->open_files[fd].inode_ptr, length);
+}
+
+/**
+ * fork system call
+ *
+ * starts a copy of the current process, which shares its terminal and its
+ * open files as they are now. The user address space is shared
+ * copy-on-write (see copy_user_pages), so a page is only copied when one of
+ * the two processes first writes to it. The child returns to user space from
+ * this same system call, with a return value of 0; it is not waited for by
+ * anyone, and halting it just ends it.
+ *
+ * @param regs the registers saved on entry to syscall_handler
+ * @return the child's pid in the parent, -1 if no process could be made or
+ * memory ran out
+ */
+int32_t syscall_fork(registers_t *regs) {
+    process_t *parent = current_process;
+    process_t *child;
+    uint32_t *frame;
+    uint32_t flags;
+    int32_t ret;
+
+    if (parent->image == NULL) {
+        return -1;
+    }
+    child = new_process();
+    if (child == NULL) {
+        return -1;
+    }
+    memcpy(child->program, parent->program, sizeof(child->program));
+    memcpy(child->args, parent->args, sizeof(child->args));
+    memcpy(child->open_files, parent->open_files, sizeof(child->open_files));
+    child->heap_start = parent->heap_start;
+    child->heap_end = parent->heap_end;
+    child->heap_pages = parent->heap_pages;
+    child->mmap_start = parent->mmap_start;
+    child->image = image_open(parent->image->inode);
+    if (child->image == NULL) {
+        discard_process(child);
+        return -1;
+    }
+
+    block_interrupts(&flags);
+    ret = copy_user_pages(parent->pid, child->pid);
+    if (ret == 0) {
+        ret = shm_fork(parent->pid, child->pid);
+    }
+    restore_interrupts(flags);
+    if (ret == 0 && parent->vidmap_flag) {
+        ret = map_4kb_page(terminal_video_page(child->terminal), MB(256),
+                child->pid, UserPrivilege, VIDMAP_PT);
+        child->vidmap_flag = (ret == 0);
+    }
+    if (ret != 0) {
+        shm_detach_all(child->pid);
+        free_user_pages(child->pid);
+        image_close(child->image);
+        child->image = NULL;
+        discard_process(child);
+        return -1;
+    }
+
+    // The child's kernel stack gets the parent's interrupt frame back to user
+    // space, under the user registers for a popal (see fork_return).
+    frame = (uint32_t*) child->kernel_stack - 13;
+    memcpy(frame + 8, (uint32_t*) parent->kernel_stack - 5, 5 * 4);
+    frame[0] = regs->edi;
+    frame[1] = regs->esi;
+    // syscall_handler's frame pointer points at the user's %ebp
+    frame[2] = *((uint32_t*) regs->ebp);
+    frame[3] = 0;
+    frame[4] = regs->ebx;
+    frame[5] = regs->edx;
+    frame[6] = regs->ecx;
+    // fork returns 0 in the child
+    frame[7] = 0;
+
+    child->registers = *regs;
+    child->registers.esp = (uint32_t) frame;
+    child->registers.ebp = (uint32_t) frame;
+    child->registers.eflags = regs->eflags & ~0x200;
+    child->registers.cs = KERNEL_CS;
+    child->registers.ss = KERNEL_DS;
+    child->registers.ds = USER_DS;
+    child->registers.es = USER_DS;
+    child->registers.fs = USER_DS;
+    child->registers.gs = USER_DS;
+    asm volatile ("                         \
+        leal fork_child_return, %%eax     \n\
+        movl %%eax, %0"
+        :"=m"(child->ret_addr)
+        :
+        :"eax" );
+    child->forked = 1;
+
+    // the parent stays the process shown in the terminal
+    block_interrupts(&flags);
+    add_process(child, &runqueue);
+    process_in_terminal[parent->terminal->index] = parent;
+    set_status_bar();
+    restore_interrupts(flags);
+
+    return child->pid;
+}
+
+/**
+ * where a child of fork is first scheduled (see task_switch), with the
+ * registers set up by syscall_fork; it returns to user space from there
+ *
+ * never called directly
+ */
+void fork_return(void) {
+    asm volatile ("fork_child_return:");
+    restore_regs(current_process->registers);
+    asm volatile ("             \
+        popal               \n\
+        iret");
+}
+
 /**
  * check the a file descriptor is valid in the context of the current process
  *
@@ -14,6 +14,13 @@
 #define SYSCALL_SIGRETURN 10
 #define SYSCALL_SHUTDOWN 11
 #define SYSCALL_SOUNDCTRL 12
+#define SYSCALL_SBRK 13
+#define SYSCALL_MMAP 14
+#define SYSCALL_FORK 15
+#define SYSCALL_SHM_CREATE 16
+#define SYSCALL_SHM_ATTACH 17
+#define SYSCALL_SHM_DETACH 18
+#define SYSCALL_TRUNCATE 19
 
 #define STDIN_FD 0
 #define STDOUT_FD 1
@@ -31,6 +38,11 @@ int32_t syscall_set_handler(int32_t signum, void* handler_address);
 int32_t syscall_sigreturn(void);
 int32_t syscall_shutdown(void);
 int32_t syscall_soundctrl(int32_t function, int8_t *filename);
+int32_t syscall_sbrk(int32_t increment);
+int32_t syscall_mmap(int32_t fd, uint32_t offset, uint32_t length);
+int32_t syscall_fork(registers_t *regs);
+int32_t syscall_truncate(int32_t fd, uint32_t length);
+void fork_return(void);
 int8_t valid_fd(int32_t fd);
 
 
@@ -6,69 +6,124 @@
 #include "mem.h"
 #include "keyboard.h"
 #include "status.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "image.h"
+#include "swap.h"
+#include "shm.h"
+#include "frame.h"
 
-#define FILE_HEADER_SIZE 40
-
-process_t* calc_pcb_address(int32_t pid);
-uint8_t* calc_kstack_address(int32_t pid);
 uint8_t* calc_ustack_address(int32_t pid);
-uint8_t* calc_program_start(int32_t pid);
+static int32_t alloc_pid(void);
+static void free_pid(int32_t pid);
+static void free_dead_pcbs(void);
+
+// each process's PCB sits at the bottom of a block of frames, with its
+// kernel stack growing down from the top
+#define PCB_ORDER 1
+#define PCB_SIZE (FRAME_SIZE << PCB_ORDER)
 
 task_queue_t runqueue;
 process_t *kernel_proc;
 
+// a bit for every pid in use
+static uint32_t pid_map[MAX_PROCESSES / 32];
+// exited processes whose PCBs may still be the stack that is running
+static process_t *dead_pcbs;
+
+// task structs are allocated on every execute, so they get their own cache
+static kmem_cache_t *task_cache;
+
 extern process_t* process_in_terminal[NUM_TERMINALS];
 
 process_t* current_process;
 
 /**
- * Loads a program from disk into a specified address of memory
+ * Prepares a program on disk to be run by a process
  *
  *     Checks that the file has:
  *     - a valid file type (DENTRY_FILE)
- *     - enough room for a 40B "header"
- *     - the magic first 4 bytes for elf
- *     - Validate that the whole file was read
+ *     - a valid ELF header
+ *     - loadable segments that fit in the user address space
+ *
+ * nothing is read into memory here; the process takes a reference to the
+ * program's image, and page_in brings it in a page at a time as it is touched
  *
  * @param program name of a file to load
- * @param addr location in physical memory to load the file to
+ * @param process process to load it for
  * @return the starting virtual address of the executable on seccess, NULL on
  * failure
  */
-void* load_program(int8_t *program, uint8_t *addr) {
-    dentry_t dentry;
-    inode_t *inode_ptr;
-    uint32_t file_length;
-    void* start_address;
+void* load_program(int8_t *program, process_t *process) {
+    const dentry_t *dentry;
+    image_t *image;
 
-    if (read_dentry_by_name((uint8_t*)program, &dentry) == -1) {
+    dentry = find_dentry((uint8_t*)program);
+    if (dentry == NULL) {
         return NULL;
     }
     //check that this is a regular file, it should be
-    if(dentry.type != DENTRY_FILE) {
+    if(dentry->type != DENTRY_FILE) {
         return NULL;
     }
-    inode_ptr = get_inode_ptr(dentry.inode);
-    file_length = inode_ptr->length;
-
-    //file should have 40B "header" (FILE_HEADER_SIZE)
-    if(read_data(inode_ptr, 0, addr, FILE_HEADER_SIZE) < FILE_HEADER_SIZE) {
+    image = image_open(get_inode_ptr(dentry->inode));
+    if(image == NULL) {
         return NULL;
     }
-    //check for magic number
-    if(*((uint32_t*)addr) != 0x464c457f) {
+    //leave room for the stack, and for the runtime below the program
+    if(image->end > USER_LIMIT - USER_STACK_SIZE ||
+            (runtime_image != NULL && image->start < runtime_image->end)) {
+        image_close(image);
         return NULL;
     }
-    //find starting address for executable, located at bytes 24-27
-    start_address = *((void**)(addr + 24));
-    //read the rest of the file, ensure that all is read
-    if(read_data(inode_ptr, FILE_HEADER_SIZE,
-                addr + FILE_HEADER_SIZE, file_length - FILE_HEADER_SIZE)
-            < file_length - FILE_HEADER_SIZE) {
-        return NULL;
+
+    process->image = image;
+    return image->entry;
+}
+
+/**
+ * Bring in a page of the current process's user address space on first touch
+ *
+ * called from the page fault handler. Pages that were swapped out are read
+ * back (see swap_in), pages of the program and of the shared user runtime
+ * come from their images (see image_page_in), and pages of the heap and the
+ * stack start out zeroed.
+ *
+ * @param addr the virtual address that faulted
+ * @return 0 if the page is now mapped, -1 if the address is not part of the
+ * process or memory ran out
+ */
+int32_t page_in(uint32_t addr) {
+    process_t *process = current_process;
+    uint32_t page = addr & ~(KB(4) - 1);
+    page_table_entry_t *pte;
+    uint32_t flags;
+    int32_t ret = -1;
+
+    if(process == NULL || process->image == NULL) {
+        return -1;
     }
 
-    return start_address;
+    block_interrupts(&flags);
+    pte = get_user_pte(process->pid, page);
+    if(pte != NULL && (pte->flags & PAGE_SWAPPED)) {
+        ret = swap_in(process->pid, page);
+    } else if(page >= process->image->start && page < process->image->end) {
+        ret = image_page_in(process->image, process->pid, page);
+    } else if(runtime_image != NULL && page >= runtime_image->start &&
+            page < runtime_image->end) {
+        ret = image_page_in(runtime_image, process->pid, page);
+    } else if(page >= process->heap_start && page < process->heap_end) {
+        ret = map_user_pages(process->pid, page, page + KB(4));
+        if(ret == 0) {
+            process->heap_pages++;
+        }
+    } else if(page >= USER_LIMIT - USER_STACK_SIZE && page < USER_LIMIT) {
+        ret = map_user_pages(process->pid, page, page + KB(4));
+    }
+    restore_interrupts(flags);
+
+    return ret;
 }
 
 /**
@@ -79,14 +134,16 @@ void* load_program(int8_t *program, uint8_t *addr) {
 void init_processes(void) {
     // set up runqueue first
     init_taskqueue(&runqueue);
-    // set up kernel PCB
-    kernel_proc = calc_pcb_address(0);
+    task_cache = kmem_cache_create("task_t", sizeof(task_t), NULL);
+    // the kernel's PCB and stack are the ones it booted on, just below 8MB
+    kernel_proc = (process_t*) (MB(8) - PCB_SIZE);
     int i;
 
+    pid_map[0] = 1;
     kernel_proc->pid = 0;
     kernel_proc->user_stack = NULL;
-    kernel_proc->kernel_stack = calc_kstack_address(0);
-    kernel_proc->page_start = NULL;
+    kernel_proc->kernel_stack = (uint8_t*) MB(8);
+    kernel_proc->image = NULL;
     for(i = 0; i < MAX_FILES; i++) {
         kernel_proc->open_files[i].in_use = 0;
     }
@@ -95,6 +152,8 @@ void init_processes(void) {
     kernel_proc->parent = NULL;
     kernel_proc->terminal = NULL;
     kernel_proc->vidmap_flag = 0;
+    kernel_proc->input_wait = 0;
+    kernel_proc->forked = 0;
     add_process(kernel_proc, &runqueue);
     set_current_process(kernel_proc);
 
@@ -137,7 +196,7 @@ void* setup_process(int8_t *command) {
         i++;
     }
     int argi = 0;
-    while(command[i] != '\0')
+    while(command[i] != '\0' && argi < sizeof(process->args) - 1)
     {
         process->args[argi] = command[i];
         i++;
@@ -145,13 +204,16 @@ void* setup_process(int8_t *command) {
     }
     process->args[argi] = '\0';
 
-    load_pages(process->pid);
-    start_address = load_program(process->program, process->page_start);
-    load_pages(current_process->pid);
+    start_address = load_program(process->program, process);
     if(start_address == NULL)
     {
+        discard_process(process);
         return NULL;
     }
+    process->heap_start = process->image->end;
+    process->heap_end = process->heap_start;
+    process->heap_pages = 0;
+    process->mmap_start = USER_LIMIT - USER_STACK_SIZE;
     add_process(process, &runqueue);
     set_current_process(process);
     syscall_open((uint8_t*)"/dev/stdin");
@@ -163,27 +225,40 @@ void* setup_process(int8_t *command) {
 /**
  * Find a new pid and initialize that process
  *
- * @return pointer to the process_t (PCB) found
+ * the lowest free pid is used, and the PCB and kernel stack are a new block
+ * of frames
+ *
+ * @return pointer to the process_t (PCB) found, or NULL if there are no pids
+ * or memory left
  */
 process_t* new_process(void) {
-    int pid = 0;
+    int pid;
     int i;
-    task_t *task;
-    for(task = runqueue.head; task != NULL; task = task->next) {
-        if (task->process->pid > pid) {
-            pid = task->process->pid;
-        }
+    uint32_t frame;
+
+    free_dead_pcbs();
+    pid = alloc_pid();
+    if(pid == -1)
+    {
+        return NULL;
+    }
+    if(new_page_directory(pid) != 0)
+    {
+        free_pid(pid);
+        return NULL;
     }
-    pid++;
-    if(pid >= MAX_PROCESSES)
+    frame = frame_alloc(PCB_ORDER);
+    if(frame == 0)
     {
+        free_page_directory(pid);
+        free_pid(pid);
         return NULL;
     }
-    process_t* process = calc_pcb_address(pid);
+    process_t* process = phys_to_virt(frame);
     process->pid = pid;
     process->user_stack = calc_ustack_address(pid);
-    process->kernel_stack = calc_kstack_address(pid);
-    process->page_start = calc_program_start(pid);
+    process->kernel_stack = (uint8_t*) process + PCB_SIZE;
+    process->image = NULL;
     for(i = 0; i < MAX_FILES; i++) {
         process->open_files[i].in_use = 0;
     }
@@ -194,6 +269,7 @@ process_t* new_process(void) {
     if(process->parent->terminal == NULL) {
         process->terminal = new_terminal();
         if (process->terminal == NULL) {
+            discard_process(process);
             return NULL;
         }
         switch_terminals(process->terminal);
@@ -204,6 +280,8 @@ process_t* new_process(void) {
 
     // Initialize to 0 (we have never called vidmap with this process... yet).
     process->vidmap_flag = 0;
+    process->input_wait = 0;
+    process->forked = 0;
 
     return process;
 }
@@ -235,27 +313,147 @@ void set_current_process(process_t* process) {
 }
 
 /**
- * close a process, removing it from its runqueue
+ * close a process, removing it from its runqueue and freeing its user pages,
+ * shared memory attachments and page directory
+ *
+ * the process's page directory must no longer be loaded
  */
 void close_process(process_t *process) {
+    uint32_t flags;
+
     free_task(remove_task(process->task, &runqueue));
+    shm_detach_all(process->pid);
+    free_user_pages(process->pid);
+    free_page_directory(process->pid);
+    image_close(process->image);
+    process->image = NULL;
+
+    // the PCB is usually the stack this is running on, so it is freed later
+    block_interrupts(&flags);
+    free_pid(process->pid);
+    process->next_dead = dead_pcbs;
+    dead_pcbs = process;
+    restore_interrupts(flags);
+    free_dead_pcbs();
+}
+
+/**
+ * give back a process from new_process that never ran: its page directory,
+ * pid and PCB
+ */
+void discard_process(process_t *process) {
+    free_page_directory(process->pid);
+    free_pid(process->pid);
+    frame_free(virt_to_phys(process), PCB_ORDER);
 }
 
-process_t* calc_pcb_address(int32_t pid) {
-    return (process_t*)(MB(8) - 0x2000 * (pid + 1));
+/**
+ * @return the lowest pid not in use, or -1 if there is none
+ */
+static int32_t alloc_pid(void) {
+    uint32_t flags;
+    uint32_t word;
+    int32_t bit;
+
+    block_interrupts(&flags);
+    for (word = 0; word < MAX_PROCESSES / 32; word++) {
+        if (pid_map[word] != ~0U) {
+            asm ("bsfl %1, %0" : "=r"(bit) : "rm"(~pid_map[word]) : "cc");
+            pid_map[word] |= 1 << bit;
+            restore_interrupts(flags);
+            return word * 32 + bit;
+        }
+    }
+    restore_interrupts(flags);
+    return -1;
 }
 
-uint8_t* calc_kstack_address(int32_t pid) {
-    return (void*)(MB(8) - 0x2000 * pid);
+static void free_pid(int32_t pid) {
+    pid_map[pid / 32] &= ~(1 << (pid % 32));
 }
 
-uint8_t* calc_ustack_address(int32_t pid) {
-    return (void*)(MB(128) + MB(4));
+/**
+ * free the PCBs of exited processes, except one whose kernel stack is still
+ * the one in use
+ */
+static void free_dead_pcbs(void) {
+    process_t **link = &dead_pcbs;
+    process_t *process;
+    uint32_t flags;
+    uint32_t esp;
+
+    asm ("movl %%esp, %0" : "=r"(esp));
+    block_interrupts(&flags);
+    while (*link != NULL) {
+        process = *link;
+        if (esp >= (uint32_t) process && esp < (uint32_t) process + PCB_SIZE) {
+            link = &process->next_dead;
+        } else {
+            *link = process->next_dead;
+            frame_free(virt_to_phys(process), PCB_ORDER);
+        }
+    }
+    restore_interrupts(flags);
+}
+
+/**
+ * end the current process without returning to a parent, and switch to
+ * another task
+ *
+ * used for children of fork, which no execute call waits for. There is
+ * always another active task: every terminal has one at the top of its
+ * stack of processes.
+ *
+ * this function does not return
+ */
+void exit_process(process_t *process) {
+    task_t *to_task;
+    uint32_t tasks_remaining;
+
+    cli();
+    // the kernel stack stays usable, since it is in the kernel's own page
+    load_pages(0);
+    close_process(process);
+    set_status_bar();
+    for (tasks_remaining = runqueue.num_tasks; tasks_remaining > 0;
+            tasks_remaining--) {
+        to_task = next_task(&runqueue);
+        if (to_task->status == TaskActive) {
+            resume_task(to_task);
+        }
+    }
+    while (1) {
+        asm volatile ("hlt");
+    }
 }
 
-/* finds physical address for the start of the program code */
-uint8_t* calc_program_start(int32_t pid) {
-    return (void*)(0x848000 + MB(4) * (pid - 1));
+/**
+ * @return whether a user process is idle: not running, and waiting for a
+ * child or for input
+ */
+int32_t process_idle(process_t *process) {
+    return process != current_process && process->image != NULL &&
+        (process->task->status == TaskIdle || process->input_wait);
+}
+
+/**
+ * Find a running process by its pid
+ *
+ * @return the process, or NULL if no process has that pid
+ */
+process_t *get_process(int32_t pid) {
+    task_t *task;
+
+    for (task = runqueue.head; task != NULL; task = task->next) {
+        if (task->process->pid == pid) {
+            return task->process;
+        }
+    }
+    return NULL;
+}
+
+uint8_t* calc_ustack_address(int32_t pid) {
+    return (void*) USER_LIMIT;
 }
 
 void init_taskqueue(task_queue_t *queue) {
@@ -266,8 +464,11 @@ void init_taskqueue(task_queue_t *queue) {
 
 /* scheduling tasks */
 task_t* add_process(process_t* process, task_queue_t *queue) {
-    task_t *task = kmalloc(sizeof(task_t));
+    task_t *task = kmem_cache_alloc(task_cache);
+    // objects come back from the cache as they were freed
     task->process = process;
+    task->next = NULL;
+    task->prev = NULL;
     process->task = task;
     activate_task(task);
 
@@ -363,7 +564,7 @@ void push_tail_task(task_t* task, task_queue_t* queue) {
  *
  */
 void free_task(task_t *task) {
-    kfree(task);
+    kmem_cache_free(task_cache, task);
 }
 
 /**
@@ -415,7 +616,6 @@ void task_switch(task_t* from_task, task_t* to_task) {
         return;
     }
     save_regs(from_task->process->registers);
-    void* ret_addr = to_task->process->ret_addr;
     asm (" \
             leal task_switch_back, %%eax; \n\
             movl %%eax, %0; \n \
@@ -423,27 +623,41 @@ void task_switch(task_t* from_task, task_t* to_task) {
             : "=m"(from_task->process->ret_addr)
             :
             : "eax");
+    resume_task(to_task);
+    asm("task_switch_back:");
+    // We only get back here via another task_switch, at which point
+    // current_process is set correctly. This is done in this manner to avoid a
+    // Catch-22 where we need the stack in order to correctly restore the stack.
+    restore_regs(current_process->registers);
+}
+
+/**
+ * switch to a task without saving the current one
+ *
+ * this function does not return
+ */
+void resume_task(task_t *to_task) {
+    void* ret_addr = to_task->process->ret_addr;
+
     set_current_process(to_task->process);
-    // We are only going to user code if the task we are switching to has never
-    // been scheduled and is just starting
-    if(ret_addr == from_task->process->ret_addr) {
+    // Tasks resume in the kernel (task_switch_back, or fork_child_return for a
+    // new child of fork); we are only going to user code if the task has
+    // never been scheduled and is just starting its program
+    if((uint32_t) ret_addr < USER_BASE) {
         PUSH_KERNEL();
     } else {
         PUSH_USER();
     }
     PUSH_RETURN_ADDRESS(ret_addr);
     asm volatile ("iret");
-    asm("task_switch_back:");
-    // We only get back here via another task_switch, at which point
-    // current_process is set correctly. This is done in this manner to avoid a
-    // Catch-22 where we need the stack in order to correctly restore the stack.
-    restore_regs(current_process->registers);
 }
 
 /**
  * goes through the runqueue and picks a task to switch to
+ *
+ * @return 1 if another task ran, 0 if there was nothing else to run
  */
-void schedule() {
+int32_t schedule() {
     task_t *from_task = current_process->task;
     task_t *to_task = NULL;
 
@@ -456,7 +670,9 @@ void schedule() {
     } while (to_task != NULL && to_task->status != TaskActive && tasks_remaining >= 0);
     if (to_task != NULL && from_task != to_task) {
         task_switch(from_task, to_task);
+        return 1;
     }
+    return 0;
 }
 
 void set_status_bar() {
@@ -6,12 +6,18 @@
 #include "fs.h"
 #include "x86_desc.h"
 
-/* Include one process for the kernel */
-#define MAX_PROCESSES 100
+// stack of a process, below USER_LIMIT
+#define USER_STACK_SIZE KB(16)
+
+/* Include one process for the kernel. Pids are reused, and each process's
+ * PCB and kernel stack come from the frame allocator, so this only sizes the
+ * per-pid tables (page table pointers, shared memory attachments). */
+#define MAX_PROCESSES 1024
 #define MAX_FILES 8
 
 struct process;
 struct task;
+struct image;
 struct terminal_info;
 
 typedef struct process {
@@ -20,9 +26,17 @@ typedef struct process {
     void *user_stack;
     // kernel stack for this process to switch back to in privilege switch
     void *kernel_stack;
-    // physical address of memory image
-    void *page_start;
 
+    // the program, paged in on first touch (see page_in); NULL for the kernel
+    struct image *image;
+    // heap, from the end of the image up to the break (see syscall_sbrk)
+    uint32_t heap_start;
+    uint32_t heap_end;
+    // heap pages currently mapped
+    uint32_t heap_pages;
+    // lowest address of the file mappings, which are placed from the stack
+    // down (see syscall_mmap)
+    uint32_t mmap_start;
     file_info_t open_files[MAX_FILES];
 
     int8_t program[32+1];
@@ -41,6 +55,13 @@ typedef struct process {
     struct terminal_info *terminal;
     // check to see if this process has called vidmap (used for switches)
     int32_t vidmap_flag;
+    // set while the process waits in keyboard_read, which makes it idle
+    // enough to swap out (see swap.c)
+    int32_t input_wait;
+    // set for a child of fork, which no execute call waits for
+    int32_t forked;
+    // next exited process whose PCB is still to be freed (see close_process)
+    struct process *next_dead;
 } process_t;
 
 extern process_t *current_process;
@@ -66,13 +87,18 @@ typedef struct task_queue {
 
 extern process_t* kernel_proc;
 
-void* load_program(int8_t *program, uint8_t *addr);
+void* load_program(int8_t *program, process_t *process);
 void* setup_process(int8_t *command);
 process_t * kernel_spawn(int8_t *command);
 void set_current_process(process_t* process);
 void init_processes(void);
 process_t* new_process(void);
 void close_process(process_t *process);
+void discard_process(process_t *process);
+void exit_process(process_t *process);
+int32_t page_in(uint32_t addr);
+process_t *get_process(int32_t pid);
+int32_t process_idle(process_t *process);
 
 extern task_queue_t runqueue;
 extern process_t *current_process;
@@ -89,7 +115,8 @@ void push_head_task(task_t* task, task_queue_t* queue);
 void push_tail_task(task_t* task, task_queue_t* queue);
 void free_task(task_t *task);
 void task_switch(task_t* first, task_t* second);
-void schedule();
+void resume_task(task_t *to_task);
+int32_t schedule();
 void set_status_bar();
 
 // This should be called BEFORE leave!
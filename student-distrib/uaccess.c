@@ -0,0 +1,219 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "uaccess.h"
+#include "lib.h"
+#include "paging.h"
+
+/**
+ * @file uaccess.c
+ *
+ * @brief copying to and from user memory
+ *
+ * System calls check that the pointers they are handed lie in user space
+ * (bad_userspace_addr) once, at the system call boundary, and then move the
+ * data with the copies here. A user address that is in range can still be
+ * unmapped; the copies do not check page by page, but list each instruction
+ * that touches user memory in the fixup table (the ex_table section). If one
+ * of them takes a page fault that page_in cannot satisfy, the page fault
+ * handler resumes at the fixup listed for it (search_fixup) and the copy
+ * fails with -1 instead of bringing the kernel down.
+ *
+ * The copies work on kernel memory too, so drivers can use them for buffers
+ * that come from either side.
+ */
+
+// bounds of the fixup table, provided by the linker
+extern fixup_entry_t __start_ex_table[];
+extern fixup_entry_t __stop_ex_table[];
+
+// Forward declarations
+static int32_t copy_user(void *to, const void *from, uint32_t n);
+
+/**
+ * check that a buffer handed in by a user program lies in user space
+ *
+ * @param addr start of the buffer
+ * @param len its size in bytes
+ * @return 0 if the whole buffer is in user space, 1 if not
+ */
+int32_t bad_userspace_addr(const void* addr, int32_t len) {
+    uint32_t start = (uint32_t) addr;
+
+    if (len < 0 || start < USER_BASE || start > USER_LIMIT) {
+        return 1;
+    }
+    return (uint32_t) len > USER_LIMIT - start;
+}
+
+/**
+ * copy a buffer from user memory
+ *
+ * @param to kernel buffer
+ * @param from buffer already checked with bad_userspace_addr
+ * @param n number of bytes
+ * @return 0 on success, -1 if part of the user buffer is not mapped
+ */
+int32_t copy_from_user(void *to, const void *from, uint32_t n) {
+    return copy_user(to, from, n);
+}
+
+/**
+ * copy a buffer to user memory
+ *
+ * @param to buffer already checked with bad_userspace_addr
+ * @param from kernel buffer
+ * @param n number of bytes
+ * @return 0 on success, -1 if part of the user buffer is not mapped or is
+ * read-only
+ */
+int32_t copy_to_user(void *to, const void *from, uint32_t n) {
+    return copy_user(to, from, n);
+}
+
+/**
+ * zero a buffer in user memory
+ *
+ * @param to buffer already checked with bad_userspace_addr
+ * @param n number of bytes
+ * @return 0 on success, -1 if part of the buffer is not mapped or is
+ * read-only
+ */
+int32_t clear_user(void *to, uint32_t n) {
+    int32_t ret;
+
+    asm volatile ("                 \n\
+            movw    %%ds, %%ax      \n\
+            movw    %%ax, %%es      \n\
+            xorl    %%eax, %%eax    \n\
+            movl    %%ecx, %%edx    \n\
+            shrl    $2, %%ecx       \n\
+            andl    $0x3, %%edx     \n\
+            cld                     \n\
+        1:  rep     stosl           \n\
+            movl    %%edx, %%ecx    \n\
+        2:  rep     stosb           \n\
+            jmp     4f              \n\
+        3:  movl    $-1, %%eax      \n\
+        4:                          \n\
+            .section ex_table, \"a\"\n\
+            .long   1b, 3b          \n\
+            .long   2b, 3b          \n\
+            .previous"
+            : "=&a"(ret), "+c"(n), "+D"(to)
+            :
+            : "edx", "memory", "cc" );
+
+    return ret;
+}
+
+/**
+ * copy a string, stopping after its terminator, and survive faults on either
+ * side
+ *
+ * @param dest where to copy it
+ * @param src the string
+ * @param n size of dest
+ * @return length of the string, or -1 if it is not mapped or does not fit
+ * (with its terminator) in n bytes
+ */
+int32_t safe_strncpy(int8_t* dest, const int8_t* src, int32_t n) {
+    int8_t *start = dest;
+    int32_t ret;
+
+    if (n <= 0) {
+        return -1;
+    }
+    asm volatile ("                 \n\
+            movw    %%ds, %%ax      \n\
+            movw    %%ax, %%es      \n\
+            cld                     \n\
+        1:  testl   %%ecx, %%ecx    \n\
+            jz      4f              \n\
+            decl    %%ecx           \n\
+        2:  lodsb                   \n\
+        3:  stosb                   \n\
+            testb   %%al, %%al      \n\
+            jnz     1b              \n\
+            movl    %%edi, %%eax    \n\
+            subl    %[start], %%eax \n\
+            decl    %%eax           \n\
+            jmp     5f              \n\
+        4:  movl    $-1, %%eax      \n\
+        5:                          \n\
+            .section ex_table, \"a\"\n\
+            .long   2b, 4b          \n\
+            .long   3b, 4b          \n\
+            .previous"
+            : "=&a"(ret), "+c"(n), "+S"(src), "+D"(dest)
+            : [start]"r"(start)
+            : "memory", "cc" );
+
+    return ret;
+}
+
+/**
+ * copy a string handed in by a user program into the kernel
+ *
+ * @param dest kernel buffer
+ * @param src the user's string, unchecked
+ * @param n size of dest
+ * @return length of the string, or -1 if it is not in user space or does not
+ * fit (with its terminator) in n bytes
+ */
+int32_t strncpy_from_user(int8_t *dest, const int8_t *src, int32_t n) {
+    // the string can only run from user space into unmapped memory, which
+    // safe_strncpy survives
+    if (bad_userspace_addr(src, 1)) {
+        return -1;
+    }
+    return safe_strncpy(dest, src, n);
+}
+
+/**
+ * find where to resume after a page fault at an instruction
+ *
+ * @param eip address of the faulting instruction
+ * @return address of its fixup, 0 if it has none
+ */
+uint32_t search_fixup(uint32_t eip) {
+    fixup_entry_t *entry;
+
+    for (entry = __start_ex_table; entry < __stop_ex_table; entry++) {
+        if (entry->insn == eip) {
+            return entry->fixup;
+        }
+    }
+    return 0;
+}
+
+/**
+ * copy a buffer a dword at a time, and survive faults on either side
+ *
+ * @return 0 on success, -1 on a fault
+ */
+static int32_t copy_user(void *to, const void *from, uint32_t n) {
+    int32_t ret;
+
+    asm volatile ("                 \n\
+            movw    %%ds, %%ax      \n\
+            movw    %%ax, %%es      \n\
+            movl    %%ecx, %%edx    \n\
+            shrl    $2, %%ecx       \n\
+            andl    $0x3, %%edx     \n\
+            cld                     \n\
+        1:  rep     movsl           \n\
+            movl    %%edx, %%ecx    \n\
+        2:  rep     movsb           \n\
+            xorl    %%eax, %%eax    \n\
+            jmp     4f              \n\
+        3:  movl    $-1, %%eax      \n\
+        4:                          \n\
+            .section ex_table, \"a\"\n\
+            .long   1b, 3b          \n\
+            .long   2b, 3b          \n\
+            .previous"
+            : "=&a"(ret), "+c"(n), "+S"(from), "+D"(to)
+            :
+            : "edx", "memory", "cc" );
+
+    return ret;
+}
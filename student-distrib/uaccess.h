@@ -0,0 +1,28 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _UACCESS_H
+#define _UACCESS_H
+
+#include "types.h"
+
+// longest string (with its terminator) taken from a user program, such as a
+// command line or a file name
+#define USER_STRING_MAX 128
+
+/**
+ * An entry of the fixup table: an instruction that may fault on a user
+ * address, and where to continue if it does
+ */
+typedef struct fixup_entry {
+    uint32_t insn;
+    uint32_t fixup;
+} fixup_entry_t;
+
+int32_t bad_userspace_addr(const void* addr, int32_t len);
+int32_t copy_from_user(void *to, const void *from, uint32_t n);
+int32_t copy_to_user(void *to, const void *from, uint32_t n);
+int32_t clear_user(void *to, uint32_t n);
+int32_t safe_strncpy(int8_t* dest, const int8_t* src, int32_t n);
+int32_t strncpy_from_user(int8_t *dest, const int8_t *src, int32_t n);
+uint32_t search_fixup(uint32_t eip);
+
+#endif /* _UACCESS_H */
@@ -0,0 +1,105 @@
+// vim: tw=80:ts=4:sw=4:et
+#include "vmstat.h"
+#include "lib.h"
+#include "frame.h"
+#include "paging.h"
+#include "swap.h"
+#include "dedup.h"
+#include "spinlock.h"
+#include "uaccess.h"
+
+/**
+ * @file vmstat.c
+ *
+ * @brief /dev/vmstat, the counters of the virtual memory system
+ *
+ * Reports free frames, TLB flushes, swapping and page merging, so what each
+ * of them saves or costs can be measured in any build. The heap has its own
+ * report, /dev/meminfo, in profiling builds (see mem.c).
+ */
+
+// size of the report
+#define VMSTAT_SIZE 512
+
+static int8_t vmstat[VMSTAT_SIZE];
+static uint32_t vmstat_len;
+
+static void vmstat_str(const int8_t *str) {
+    while (*str != '\0' && vmstat_len < VMSTAT_SIZE - 1) {
+        vmstat[vmstat_len++] = *str++;
+    }
+    vmstat[vmstat_len] = '\0';
+}
+
+static void vmstat_num(uint32_t num) {
+    int8_t buf[16];
+    itoa(num, buf, 10);
+    vmstat_str(buf);
+}
+
+/**
+ * write the report into vmstat
+ */
+static void vmstat_render(void) {
+    vmstat_len = 0;
+    vmstat_str("frames: ");
+    vmstat_num(frames_free());
+    vmstat_str(" of ");
+    vmstat_num(frames_total());
+    vmstat_str(" free\ntlb: ");
+    vmstat_num(tlb_stats.cr3_loads);
+    vmstat_str(" cr3 loads, ");
+    vmstat_num(tlb_stats.switches_skipped);
+    vmstat_str(" switches skipped, ");
+    vmstat_num(tlb_stats.invlpgs);
+    vmstat_str(" pages invalidated\nswap: ");
+    vmstat_num(swap_stats.slots_used);
+    vmstat_str(" of ");
+    vmstat_num(swap_stats.slots_total);
+    vmstat_str(" pages used, ");
+    vmstat_num(swap_stats.page_ins);
+    vmstat_str(" in, ");
+    vmstat_num(swap_stats.page_outs);
+    vmstat_str(" out\ndedup: ");
+    vmstat_num(dedup_pages_saved());
+    vmstat_str(" pages saved by ");
+    vmstat_num(dedup_shared_frames());
+    vmstat_str(" shared, ");
+    vmstat_num(dedup_stats.merges);
+    vmstat_str(" merges, ");
+    vmstat_num(dedup_stats.pages_scanned);
+    vmstat_str(" scanned in ");
+    vmstat_num(dedup_stats.sweeps);
+    vmstat_str(" sweeps\n");
+}
+
+/**
+ * read handler for /dev/vmstat
+ *
+ * the report is taken when reading starts (at offset 0), so it stays
+ * consistent across reads
+ *
+ * @return number of bytes read, 0 at the end of the report
+ */
+int32_t vmstat_read(file_info_t *file, uint8_t *buf, int32_t length) {
+    uint32_t flags;
+    uint32_t count;
+
+    if (file->pos == 0) {
+        block_interrupts(&flags);
+        vmstat_render();
+        restore_interrupts(flags);
+    }
+    if (length <= 0 || file->pos >= vmstat_len) {
+        return 0;
+    }
+    count = vmstat_len - file->pos;
+    if (count > length) {
+        count = length;
+    }
+    if (copy_to_user(buf, vmstat + file->pos, count) != 0) {
+        return -1;
+    }
+    file->pos += count;
+    return count;
+}
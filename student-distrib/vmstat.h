@@ -0,0 +1,10 @@
+// vim: tw=80:ts=4:sw=4:et
+#ifndef _VMSTAT_H
+#define _VMSTAT_H
+
+#include "types.h"
+#include "fs.h"
+
+int32_t vmstat_read(file_info_t *file, uint8_t *buf, int32_t length);
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "ece391support.h"
+#include "ece391syscall.h"
+
+/*
+ * Times filename lookups: open of every file in the directory, open of a
+ * name that is not there, and execute of a command that is not there (what
+ * the shell does for a typo). Prints the number of files and the average
+ * cost of each in processor cycles, to compare file systems of different
+ * sizes.
+ */
+
+#define SBUFSIZE 33
+#define MAX_FILES 63
+#define ROUNDS 100
+#define MISSING ((uint8_t*)"no-such-file")
+
+static uint8_t names[MAX_FILES][SBUFSIZE];
+
+static uint32_t cycles (void)
+{
+    uint32_t low, high;
+
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return low;
+}
+
+static void report (const uint8_t* what, uint32_t total, uint32_t count)
+{
+    int8_t buf[12];
+
+    ece391_fdputs (1, what);
+    itoa (total / count, buf, 10);
+    ece391_fdputs (1, (uint8_t*)buf);
+    ece391_fdputs (1, (uint8_t*)" cycles\n");
+}
+
+int main ()
+{
+    int32_t fd, cnt, num_files, i, round;
+    uint32_t start, open_total = 0, miss_total = 0, exec_total = 0;
+    int8_t buf[12];
+
+    if (-1 == (fd = ece391_open ((uint8_t*)"."))) {
+        ece391_fdputs (1, (uint8_t*)"directory open failed\n");
+        return 2;
+    }
+    for (num_files = 0; num_files < MAX_FILES; num_files++) {
+        cnt = ece391_read (fd, names[num_files], SBUFSIZE - 1);
+        if (cnt <= 0)
+            break;
+        names[num_files][cnt] = '\0';
+    }
+    ece391_close (fd);
+    if (0 == num_files) {
+        ece391_fdputs (1, (uint8_t*)"no files\n");
+        return 3;
+    }
+
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < num_files; i++) {
+            start = cycles ();
+            fd = ece391_open (names[i]);
+            open_total += cycles () - start;
+            if (-1 != fd)
+                ece391_close (fd);
+        }
+        start = cycles ();
+        ece391_open (MISSING);
+        miss_total += cycles () - start;
+        start = cycles ();
+        ece391_execute (MISSING);
+        exec_total += cycles () - start;
+    }
+
+    ece391_fdputs (1, (uint8_t*)"files: ");
+    itoa (num_files, buf, 10);
+    ece391_fdputs (1, (uint8_t*)buf);
+    ece391_fdputs (1, (uint8_t*)"\n");
+    report ((uint8_t*)"open: ", open_total, ROUNDS * num_files);
+    report ((uint8_t*)"open (missing): ", miss_total, ROUNDS);
+    report ((uint8_t*)"execute (missing): ", exec_total, ROUNDS);
+    return 0;
+}
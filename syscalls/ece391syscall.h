@@ -23,6 +23,25 @@ extern int32_t ece391_set_handler (int32_t signum, void* handler);
 extern int32_t ece391_sigreturn (void);
 extern int32_t ece391_shutdown (void);
 extern int32_t ece391_soundctrl (int32_t function, int8_t *filename);
+/* Grows the heap by increment bytes (shrinks it if negative) and returns the
+ * old end of the heap; memory between the two is zeroed on first touch. */
+extern void* ece391_sbrk (int32_t increment);
+/* Maps length bytes of an open file, from offset (a multiple of 4096),
+ * read-only into memory and returns their address. */
+extern void* ece391_mmap (int32_t fd, uint32_t offset, uint32_t length);
+/* Starts a copy of the calling program, which shares its memory until either
+ * writes to it; returns the child's pid in the parent and 0 in the child. */
+extern int32_t ece391_fork (void);
+/* Creates a zeroed shared memory segment of size bytes that other programs
+ * can attach by key, attaches it, and returns its address. */
+extern void* ece391_shm_create (int32_t key, uint32_t size);
+/* Attaches the segment created with key and returns its address. */
+extern void* ece391_shm_attach (int32_t key);
+/* Detaches the segment at addr; it is freed once no program has it. */
+extern int32_t ece391_shm_detach (void* addr);
+/* Makes a file opened under "/efs/" (which open creates if it is not there)
+ * length bytes long, cutting it off or extending it with zeros. */
+extern int32_t ece391_truncate (int32_t fd, uint32_t length);
 
 enum signums {
 	DIV_ZERO = 0,
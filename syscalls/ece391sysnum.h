@@ -13,5 +13,12 @@
 #define SYS_SIGRETURN  10
 #define SYS_SHUTDOWN 11
 #define SYS_SOUNDCTRL 12
+#define SYS_SBRK 13
+#define SYS_MMAP 14
+#define SYS_FORK 15
+#define SYS_SHM_CREATE 16
+#define SYS_SHM_ATTACH 17
+#define SYS_SHM_DETACH 18
+#define SYS_TRUNCATE 19
 
 #endif /* ECE391SYSNUM_H */